@@ -0,0 +1,355 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+
+//
+// Runs the tracker over many recorded matches at once, and prints the
+// statistics of every match.
+//
+// Usage: trackbatch [-j threads] [-c WxH,filterScale,downsampleFactor[,searchFactor]]
+//                   [-fps F] [-csv] [-l list.txt]
+//                   [-rgba WxH | -i420 WxH] recording ...
+//
+// The recordings all have the format of -rgba or -i420, or are directories
+// of TGA files (see framereader.h and trackreplay). With -l the recordings
+// are also read from a file, one per line.
+//
+// Every recording is one job, with its own Tracker (tracker.h), so the jobs
+// do not share any state. They are run on a work-stealing pool of -j
+// threads, by default one per core: the jobs are dealt to the threads from
+// large to small (by file size), and a thread that has no jobs left takes
+// the smallest one of another thread. So one long match does not keep the
+// other cores waiting at the end.
+//
+// For every match it prints the goals, the number of SAVE and FAST
+// signals, the highest MAXSPEED and the ball possession: the part of the
+// frames in which the ball was detected at the bars of a team.
+// With -csv it prints comma separated values instead of a table.
+// The log messages of the trackers come first, and can be interleaved.
+//
+#include "../tracker/analysis.h"
+#include "../tracker/eventchannel.h"
+#include "../tracker/framereader.h"
+#include "../tracker/tracker.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Team numbers of analysis_bar_team
+constexpr int TeamBlue = 1;
+constexpr int TeamRed = 2;
+
+struct Match {
+    std::string path;
+    long long size = 0; // Bytes, to deal out the large jobs first
+
+    bool ok = false;
+    int frames = 0;
+    int goals[3] = {0, 0, 0}; // By team, from RG and BG
+    int saves = 0;
+    int fasts = 0;
+    float maxSpeed = 0.0f;    // km/h
+    int possession[3] = {0, 0, 0}; // Frames with the ball at the bars of a team
+};
+
+FrameReader::Format format = FrameReader::TGA_DIRECTORY;
+int frameWidth = 0, frameHeight = 0;
+bool configured = false;
+int configWidth = 0, configHeight = 0;
+int filterScale = 0, downsampleFactor = 0, searchFactor = 0;
+float fps = 40.0f;
+
+void print_usage() {
+    printf("Usage: trackbatch [-j threads] [-c WxH,filterScale,downsampleFactor[,searchFactor]]\n");
+    printf("                  [-fps F] [-csv] [-l list.txt]\n");
+    printf("                  [-rgba WxH | -i420 WxH] recording ...\n");
+}
+
+// Called by the analysis of a job, on its thread
+void collect_event(void* context, const EventHeader& header, const void* payload) {
+    Match* match = (Match*)context;
+    if (header.type == EVENT_MESSAGE) {
+        std::string msg((const char*)payload, header.size);
+        if (msg.compare(0, 3, "RG ") == 0) {
+            match->goals[TeamRed]++;
+        } else if (msg.compare(0, 3, "BG ") == 0) {
+            match->goals[TeamBlue]++;
+        } else if (msg == "SAVE") {
+            match->saves++;
+        } else if (msg == "FAST") {
+            match->fasts++;
+        } else if (msg.compare(0, 9, "MAXSPEED ") == 0) {
+            float speed = (float)atof(msg.c_str() + 9);
+            if (speed > match->maxSpeed)
+                match->maxSpeed = speed;
+        }
+    } else if (header.type == EVENT_BALL) {
+        EventBall ball;
+        memcpy(&ball, payload, sizeof(ball));
+        // Only the frames where the ball was seen, not the ones
+        // that the ball filter filled in
+        if (ball.state == BALL_MEASURED)
+            match->possession[analysis_bar_team(analysis_player_bar({ball.x, ball.y}))]++;
+    }
+}
+
+void run_match(Match* match) {
+    FrameReader reader;
+    if (reader.open(match->path.c_str(), format, frameWidth, frameHeight))
+        return;
+
+    Tracker tracker;
+    if (configured) {
+        if (tracker.configure(configWidth, configHeight, filterScale, downsampleFactor, searchFactor))
+            return;
+    } else if (tracker.configure(reader.width, reader.height, filterScale, downsampleFactor, searchFactor)) {
+        return;
+    }
+    tracker.analysis().set_event_sink(collect_event, match);
+    tracker.set_fps(fps);
+    if (tracker.init())
+        return;
+
+    std::vector<uint8_t> rgba;
+    while (reader.next(rgba))
+        tracker.process_frame(rgba.data(), reader.width, reader.height);
+    tracker.term();
+
+    match->frames = reader.frames;
+    match->ok = true;
+}
+
+//
+// Every thread has a deque of jobs. It takes its own jobs from the front,
+// and when it has none left, it steals from the back of another deque.
+// Jobs are whole matches of seconds to minutes, so a mutex per deque
+// costs nothing compared to them.
+//
+class WorkStealingPool {
+  public:
+    explicit WorkStealingPool(int threads) : queues(threads) {}
+
+    // Deal out the jobs in order, one to every thread in turn
+    void add_jobs(const std::vector<int>& jobs) {
+        for (size_t i = 0; i < jobs.size(); ++i)
+            queues[i % queues.size()].jobs.push_back(jobs[i]);
+    }
+
+    template <typename F>
+    void run(F&& job) {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < (int)queues.size(); ++t)
+            threads.emplace_back([this, t, &job]() {
+                int j;
+                while (take(t, &j) || steal(t, &j))
+                    job(j);
+            });
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    int steals() const { return stealCount.load(); }
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> jobs;
+    };
+
+    bool take(int t, int* job) {
+        std::lock_guard<std::mutex> lock(queues[t].mutex);
+        if (queues[t].jobs.empty())
+            return false;
+        *job = queues[t].jobs.front();
+        queues[t].jobs.pop_front();
+        return true;
+    }
+
+    // Jobs are never added while running, so when all
+    // other queues are empty there is nothing left to do
+    bool steal(int t, int* job) {
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue& q = queues[(t + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.jobs.empty())
+                continue;
+            *job = q.jobs.back();
+            q.jobs.pop_back();
+            stealCount++;
+            return true;
+        }
+        return false;
+    }
+
+    std::vector<Queue> queues;
+    std::atomic<int> stealCount{0};
+};
+
+// Size of a file, or of all files in a directory
+long long path_size(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    if (!S_ISDIR(st.st_mode))
+        return (long long)st.st_size;
+    long long size = 0;
+    DIR* dir = opendir(path);
+    if (!dir)
+        return 0;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string file = std::string(path) + "/" + entry->d_name;
+        if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            size += (long long)st.st_size;
+    }
+    closedir(dir);
+    return size;
+}
+
+double percentage(int part, int total) {
+    return (total ? 100.0 * (double)part / (double)total : 0.0);
+}
+
+void print_matches(const std::vector<Match>& matches, bool csv) {
+    if (csv)
+        printf("recording,frames,red goals,blue goals,saves,fasts,max speed,red possession,blue possession\n");
+    else
+        printf("%-40s %8s %5s %5s %5s %5s %9s %8s %8s\n",
+               "recording", "frames", "red", "blue", "saves", "fasts", "maxspeed", "red %", "blue %");
+
+    Match total;
+    for (const Match& m : matches) {
+        if (!m.ok) {
+            printf(csv ? "%s,failed\n" : "%-40s failed\n", m.path.c_str());
+            continue;
+        }
+        int withBall = m.possession[0] + m.possession[TeamBlue] + m.possession[TeamRed];
+        double red = percentage(m.possession[TeamRed], withBall);
+        double blue = percentage(m.possession[TeamBlue], withBall);
+        if (csv)
+            printf("%s,%d,%d,%d,%d,%d,%.1f,%.1f,%.1f\n", m.path.c_str(), m.frames, m.goals[TeamRed], m.goals[TeamBlue],
+                   m.saves, m.fasts, m.maxSpeed, red, blue);
+        else
+            printf("%-40s %8d %5d %5d %5d %5d %9.1f %8.1f %8.1f\n", m.path.c_str(), m.frames, m.goals[TeamRed], m.goals[TeamBlue],
+                   m.saves, m.fasts, m.maxSpeed, red, blue);
+
+        total.frames += m.frames;
+        for (int team = 0; team < 3; ++team) {
+            total.goals[team] += m.goals[team];
+            total.possession[team] += m.possession[team];
+        }
+        total.saves += m.saves;
+        total.fasts += m.fasts;
+        if (m.maxSpeed > total.maxSpeed)
+            total.maxSpeed = m.maxSpeed;
+    }
+
+    int withBall = total.possession[0] + total.possession[TeamBlue] + total.possession[TeamRed];
+    double red = percentage(total.possession[TeamRed], withBall);
+    double blue = percentage(total.possession[TeamBlue], withBall);
+    if (csv)
+        printf("total,%d,%d,%d,%d,%d,%.1f,%.1f,%.1f\n", total.frames, total.goals[TeamRed], total.goals[TeamBlue],
+               total.saves, total.fasts, total.maxSpeed, red, blue);
+    else
+        printf("%-40s %8d %5d %5d %5d %5d %9.1f %8.1f %8.1f\n", "total", total.frames, total.goals[TeamRed], total.goals[TeamBlue],
+               total.saves, total.fasts, total.maxSpeed, red, blue);
+}
+
+int main(int argc, char** argv) {
+    // This can be 0 when the number of cores is not known
+    int threads = std::max(1, (int)std::thread::hardware_concurrency());
+    bool csv = false;
+    std::vector<Match> matches;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads <= 0) {
+                printf("Invalid number of threads %s\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d,%d,%d,%d", &configWidth, &configHeight, &filterScale, &downsampleFactor, &searchFactor) < 4) {
+                printf("Usage: -c WxH,filterScale,downsampleFactor[,searchFactor]\n");
+                return 1;
+            }
+            configured = true;
+        } else if (!strcmp(argv[i], "-fps") && i + 1 < argc) {
+            fps = (float)atof(argv[++i]);
+            if (fps <= 0.0f) {
+                printf("Invalid framerate %s\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-csv")) {
+            csv = true;
+        } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            std::ifstream list(argv[++i]);
+            if (!list.is_open()) {
+                printf("Unable to open %s\n", argv[i]);
+                return 1;
+            }
+            std::string line;
+            while (std::getline(list, line)) {
+                if (line.empty() || line[0] == '#')
+                    continue;
+                matches.emplace_back();
+                matches.back().path = line;
+            }
+        } else if ((!strcmp(argv[i], "-rgba") || !strcmp(argv[i], "-i420")) && i + 1 < argc) {
+            format = (argv[i][1] == 'r' ? FrameReader::RAW_RGBA : FrameReader::RAW_I420);
+            if (sscanf(argv[++i], "%dx%d", &frameWidth, &frameHeight) != 2) {
+                printf("Invalid frame size %s, use WxH\n", argv[i]);
+                return 1;
+            }
+        } else if (argv[i][0] != '-') {
+            matches.emplace_back();
+            matches.back().path = argv[i];
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (matches.empty()) {
+        print_usage();
+        return 1;
+    }
+    if (threads > (int)matches.size())
+        threads = (int)matches.size();
+
+    // Largest first, so that the last jobs are short ones
+    std::vector<int> jobs;
+    for (size_t i = 0; i < matches.size(); ++i) {
+        matches[i].size = path_size(matches[i].path.c_str());
+        jobs.push_back((int)i);
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [&](int a, int b) { return matches[a].size > matches[b].size; });
+
+    auto start = std::chrono::steady_clock::now();
+    WorkStealingPool pool(threads);
+    pool.add_jobs(jobs);
+    pool.run([&](int job) { run_match(&matches[job]); });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    print_matches(matches, csv);
+
+    int frames = 0;
+    int failed = 0;
+    for (const Match& m : matches) {
+        frames += m.frames;
+        failed += (m.ok ? 0 : 1);
+    }
+    fprintf(stderr, "%d recordings (%d failed), %d frames in %.2f s on %d threads, %.0f frames per second, %d jobs stolen\n",
+            (int)matches.size(), failed, frames, seconds, threads, (double)frames / seconds, pool.steals());
+    return (failed ? 1 : 0);
+}
@@ -0,0 +1,313 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+
+//
+// Micro-benchmarks for the hot paths of the tracker.
+//
+// Usage: trackerbench [-n iterations] [--csv]
+//                     [-c WxH,filterScale,downsampleFactor[,searchFactor]]
+//                     [framedump.tga ...]
+//
+// Every stage is timed on a synthetic frame, and on every given
+// recorded frame (e.g. the `/tmp/framedump_*.tga` files written by
+// core.cpp with DO_FRAMEDUMPS), at both the BIGTEX and the
+// non-BIGTEX texture sizes.
+// The complete pipeline runs with the sizes given by -c
+// (see balltrack_core_configure), by default those of pipeline.h.
+// The synthetic frame has the source size of that configuration.
+// The color filter, downsample and pyramid stages are the CPU versions of
+// the shaders, so on the Pi they say nothing about the GPU timings.
+// The `_pyramid` stages search a level that is 4 times smaller first.
+//
+
+#include "../tracker/core.h"
+#include "../tracker/pipeline.h"
+#include "../tracker/cpufilter.h"
+#include "../tracker/analysis.h"
+#include "../tracker/bufferqueue.h"
+#include "../tracker/framereader.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Texture sizes of both settings of BIGTEX in pipeline.h
+struct PipelineSizes {
+    const char* name;
+    int width1, height1; // color filter output, in RGBA texels
+    int width2, height2; // downsample output, in RGBA texels
+};
+
+const PipelineSizes allSizes[] = {
+    {"BIGTEX", 1280 / 4, 720, 320 / 4, 180},
+    {"smalltex", 640 / 4, 360, 160 / 4, 90},
+};
+
+struct Frame {
+    std::string name;
+    int width;
+    int height;
+    std::vector<uint8_t> rgba; // Bottom-to-top rows, like OpenGL
+};
+
+int iterations = 200;
+bool csvOutput = false;
+
+// A green field with white borders and an orange ball
+// Sizes are for 720p and scaled with the width
+Frame synthetic_frame(int width, int height) {
+    Frame frame;
+    frame.name = "synthetic";
+    frame.width = width;
+    frame.height = height;
+    frame.rgba.resize(4 * width * height);
+    int ballx = width / 3;
+    int bally = height / 2;
+    int radius = 14 * width / 1280;
+    int borderx = 60 * width / 1280;
+    int bordery = 40 * width / 1280;
+    uint8_t* p = frame.rgba.data();
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            bool border = (x < borderx || x >= width - borderx || y < bordery || y >= height - bordery);
+            bool ball = ((x - ballx) * (x - ballx) + (y - bally) * (y - bally) < radius * radius);
+            if (ball) {
+                p[0] = 250; p[1] = 120; p[2] = 20;
+            } else if (border) {
+                p[0] = 200; p[1] = 200; p[2] = 200;
+            } else {
+                p[0] = 40; p[1] = 120; p[2] = 50;
+            }
+            p[3] = 255;
+            p += 4;
+        }
+    }
+    return frame;
+}
+
+bool load_frame(const char* filename, Frame& frame) {
+    frame.name = filename;
+    return load_tga_rgba(filename, &frame.width, &frame.height, frame.rgba);
+}
+
+// Runs `func` a number of times and prints the time per call
+template <typename F>
+void bench(const char* stage, const char* sizes, const Frame& frame, F func) {
+    func(); // Warm up caches
+
+    std::vector<double> times(iterations);
+    for (int i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto end = std::chrono::steady_clock::now();
+        times[i] = std::chrono::duration<double, std::micro>(end - start).count();
+    }
+    std::sort(times.begin(), times.end());
+    double total = 0.0;
+    for (double t : times)
+        total += t;
+
+    double mean = total / iterations;
+    double median = times[iterations / 2];
+    double p95 = times[(95 * iterations) / 100];
+    if (csvOutput) {
+        printf("%s,%s,%s,%d,%.2f,%.2f,%.2f,%.2f\n", stage, sizes, frame.name.c_str(),
+               iterations, mean, median, times[0], p95);
+    } else {
+        printf("%-22s %-9s %-24s %10.2f %10.2f %10.2f %10.2f\n", stage, sizes,
+               frame.name.c_str(), mean, median, times[0], p95);
+    }
+}
+
+//
+// The pixelbuffer handoff of send_buffer_to_analysis, with the same
+// PixelbufferHandoff: copy the readout texture out of its power-of-two
+// VCSM layout into a buffer of the queue, and wake up the analysis thread.
+//
+// Only the GL thread side is timed. The analysis thread reads the buffer
+// but does no analysis, so this measures the handoff overhead itself.
+//
+class HandoffBench {
+  public:
+    HandoffBench(int w, int h, bool dropOldest)
+        : width(w), height(h), handoff(PIXELBUFFER_QUEUE_DEPTH, 4 * w * h, dropOldest) {
+        potWidth = 64;
+        while (potWidth < width)
+            potWidth *= 2;
+        potHeight = 64;
+        while (potHeight < height)
+            potHeight *= 2;
+        vcsmBuffer.resize(4 * potWidth * potHeight, 0x40);
+
+        consumer = std::thread(&HandoffBench::analysis_thread, this);
+    }
+
+    ~HandoffBench() {
+        stop = true;
+        handoff.wake_consumer();
+        consumer.join();
+    }
+
+    void send_buffer() {
+        handoff.send(0, -1, [&](uint8_t* buf) {
+            copy_rows(buf, vcsmBuffer.data(), 4 * width, height, 4 * potWidth);
+        });
+    }
+
+    uint32_t dropped() const { return handoff.dropped(); }
+
+  private:
+    void analysis_thread() {
+        while (!stop) {
+            handoff.wait_published();
+            int type;
+            int64_t tag;
+            const uint8_t* buffer;
+            while ((buffer = handoff.pop(&type, &tag))) {
+                for (int i = 0; i < 4 * width * height; i += 64)
+                    checksum += buffer[i];
+                handoff.release();
+            }
+        }
+    }
+
+    int width, height;
+    int potWidth, potHeight;
+    std::vector<uint8_t> vcsmBuffer;
+    PixelbufferHandoff handoff;
+    std::atomic<bool> stop{false};
+    unsigned checksum = 0;
+    std::thread consumer;
+};
+
+// Copy a width x height buffer into a power-of-two sized one like the
+// VCSM textures, returns the number of bytes per row
+int copy_to_pot_layout(const std::vector<uint8_t>& src, int width, int height, std::vector<uint8_t>& dst) {
+    int stride = 256;
+    while (stride < width)
+        stride *= 2;
+    dst.assign(stride * height, 0);
+    for (int y = 0; y < height; ++y)
+        memcpy(dst.data() + y * stride, src.data() + y * width, width);
+    return stride;
+}
+
+void bench_frame(const Frame& frame) {
+    for (const PipelineSizes& s : allSizes) {
+        std::vector<uint8_t> texColorFilter(4 * s.width1 * s.height1);
+        std::vector<uint8_t> texColorFilterField(4 * s.width1 * s.height1);
+        std::vector<uint8_t> texDownscaled(4 * s.width2 * s.height2);
+        std::vector<uint8_t> texDownscaledField(4 * s.width2 * s.height2);
+        std::vector<uint8_t> texLevel1(s.width2 * s.height2);
+        std::vector<uint8_t> texLevel2(s.width2 * s.height2 / 4);
+        const uint8_t* src = frame.rgba.data();
+
+        bench("colorfilter_ball", s.name, frame, [&] {
+            cpu_colorfilter_ball(src, frame.width, frame.height, texColorFilter.data(), s.width1, s.height1);
+        });
+        bench("colorfilter_field", s.name, frame, [&] {
+            cpu_colorfilter_field(src, frame.width, frame.height, texColorFilterField.data(), s.width1, s.height1);
+        });
+        bench("downsample", s.name, frame, [&] {
+            cpu_downsample(texColorFilter.data(), s.width1, s.height1, texDownscaled.data(), s.width2, s.height2);
+        });
+        cpu_downsample(texColorFilterField.data(), s.width1, s.height1, texDownscaledField.data(), s.width2, s.height2);
+        bench("pyramid", s.name, frame, [&] {
+            cpu_pyramid(texDownscaled.data(), s.width2, s.height2, texLevel1.data(), s.width2 / 2, s.height2 / 2);
+            cpu_pyramid(texLevel1.data(), s.width2 / 2, s.height2 / 2, texLevel2.data(), s.width2 / 4, s.height2 / 4);
+        });
+
+        // The analysis functions are given the readout of this frame.
+        // Their internal state (field, ball history) carries over
+        // between calls, just like in the real tracker.
+        bench("process_field_buffer", s.name, frame, [&] {
+            analysis_process_field_buffer(texDownscaledField.data(), 4 * s.width2, s.height2);
+        });
+        bench("process_ball_buffer", s.name, frame, [&] {
+            analysis_process_ball_buffer(texDownscaled.data(), 4 * s.width2, s.height2);
+        });
+        bench("process_ball_pyramid", s.name, frame, [&] {
+            analysis_process_ball_buffer(texDownscaled.data(), 4 * s.width2, s.height2, texLevel2.data(), 4);
+        });
+
+        // With zero copy readout, the analysis reads the power-of-two VCSM
+        // layout in place, instead of the copy made by the handoff
+        std::vector<uint8_t> potDownscaled;
+        int potStride = copy_to_pot_layout(texDownscaled, 4 * s.width2, s.height2, potDownscaled);
+        bench("process_ball_zerocopy", s.name, frame, [&] {
+            analysis_process_ball_buffer(potDownscaled.data(), 4 * s.width2, s.height2, 0, 1, potStride);
+        });
+
+        HandoffBench handoff(s.width2, s.height2, false);
+        bench("send_buffer_handoff", s.name, frame, [&] { handoff.send_buffer(); });
+        HandoffBench handoffDrop(s.width2, s.height2, true);
+        bench("send_buffer_dropoldest", s.name, frame, [&] { handoffDrop.send_buffer(); });
+    }
+
+    // The complete CPU pipeline, with the configured sizes
+    analysis_set_roi_tracking(0);
+    bench("process_frame", "pipeline", frame, [&] {
+        balltrack_core_process_frame(frame.rgba.data(), frame.width, frame.height);
+    });
+    // With ROI tracking, once the ball is found only the window around it is filtered
+    analysis_set_roi_tracking(1);
+    bench("process_frame_roi", "pipeline", frame, [&] {
+        balltrack_core_process_frame(frame.rgba.data(), frame.width, frame.height);
+    });
+}
+
+int main(int argc, char** argv) {
+    std::vector<Frame> frames;
+    frames.push_back(Frame());
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+            if (iterations < 1)
+                iterations = 1;
+        } else if (!strcmp(argv[i], "--csv")) {
+            csvOutput = true;
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            int width, height, filterScale, downsampleFactor;
+            int searchFactor = 0;
+            if (sscanf(argv[++i], "%dx%d,%d,%d,%d", &width, &height, &filterScale, &downsampleFactor, &searchFactor) < 4) {
+                printf("Usage: -c WxH,filterScale,downsampleFactor[,searchFactor]\n");
+                return 1;
+            }
+            if (balltrack_core_configure(width, height, filterScale, downsampleFactor, searchFactor))
+                return 1;
+        } else {
+            Frame frame;
+            if (!load_frame(argv[i], frame)) {
+                printf("Unable to load %s\n", argv[i]);
+                return 1;
+            }
+            frames.push_back(frame);
+        }
+    }
+
+    frames[0] = synthetic_frame(pipeline.width0, pipeline.height0);
+
+    if (balltrack_core_init(0, 0))
+        return 1;
+
+    // All times are in microseconds per call
+    if (csvOutput) {
+        printf("stage,sizes,input,iterations,mean,median,min,p95\n");
+    } else {
+        printf("%-22s %-9s %-24s %10s %10s %10s %10s\n", "stage", "sizes", "input",
+               "mean(us)", "median(us)", "min(us)", "p95(us)");
+    }
+    for (const Frame& frame : frames)
+        bench_frame(frame);
+
+    balltrack_core_term();
+    return 0;
+}
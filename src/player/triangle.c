@@ -47,14 +47,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <pthread.h>
 
 #include "../tracker/core.h"
+#include "../tracker/trace.h"
 
 // This has to be exactly the size of the file that is being played
 // TODO: Determine from file
-
-//#define IMAGE_SIZE_WIDTH 1920
-//#define IMAGE_SIZE_HEIGHT 1080
-#define IMAGE_SIZE_WIDTH 1280
-#define IMAGE_SIZE_HEIGHT 720
+// Can be given on the command line, see main
+static int imageWidth = 1280;
+static int imageHeight = 720;
 
 #ifndef M_PI
    #define M_PI 3.141592654
@@ -69,20 +68,20 @@ typedef struct
    EGLDisplay display;
    EGLSurface surface;
    EGLContext context;
-   GLuint tex;
+   GLuint tex[MAX_DECODE_FRAMES];
 } STATE_T;
 
 static void init_ogl(STATE_T *state);
-static void redraw_scene(STATE_T *state);
+static int redraw_scene(STATE_T *state);
 static void init_textures(STATE_T *state);
 static void exit_func(void);
 static volatile int terminate;
 static STATE_T _state, *state=&_state;
 
-static void* eglImage = 0;
+// Number of textures that the decoder fills in turn, see main
+static VIDEO_DECODE_PARAMS decodeParams = { 3 };
 static pthread_t thread1;
 VCOS_SEMAPHORE_T semNewFrame;
-VCOS_SEMAPHORE_T semFinishedFrame;
 
 /***********************************************************
  * Name: init_ogl
@@ -205,10 +204,10 @@ static void init_ogl(STATE_T *state)
  * Description:   Draws the model and calls eglSwapBuffers
  *                to render to screen
  *
- * Returns: void
+ * Returns: 0, or -1 when the video has ended
  *
  ***********************************************************/
-static void redraw_scene(STATE_T *state)
+static int redraw_scene(STATE_T *state)
 {
    // Start with a clear screen
    //glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
@@ -238,14 +237,27 @@ static void redraw_scene(STATE_T *state)
 #endif
 
    // Wait for a frame from the video decoder
-   vcos_semaphore_wait(&semNewFrame);
+   int index = video_wait_frame();
+   if (index < 0)
+      return -1;
+
+   // There are no timestamps here, so number the decoded frames
+   static int64_t videoFrame = 0;
+   TRACE_FRAME(videoFrame++);
+   TRACE_BEGIN("redraw_scene");
 
-   balltrack_core_process_image(state->screen_width, state->screen_height, state->tex, GL_TEXTURE_2D);
+   balltrack_core_process_image(state->screen_width, state->screen_height, state->tex[index], GL_TEXTURE_2D);
 
+   TRACE_BEGIN("eglSwapBuffers");
    eglSwapBuffers(state->display, state->surface);
+   TRACE_END("eglSwapBuffers");
+   TRACE_END("redraw_scene");
 
-   // Tell the video decoder we are ready for the next frame
-   vcos_semaphore_post(&semFinishedFrame);
+   // Tell the video decoder it can fill this texture again. The swap
+   // has queued the rendering that reads it, so the next frame of the
+   // decoder goes into another texture in the meantime.
+   video_return_frame(index);
+   return 0;
 }
 
 /***********************************************************
@@ -262,31 +274,34 @@ static void redraw_scene(STATE_T *state)
  ***********************************************************/
 static void init_textures(STATE_T *state)
 {
-   //// load three texture buffers but use them on six OGL|ES texture surfaces
-   glGenTextures(1, &state->tex);
-
-   glBindTexture(GL_TEXTURE_2D, state->tex);
-   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, IMAGE_SIZE_WIDTH, IMAGE_SIZE_HEIGHT, 0,
-                GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-
-   /* Create EGL Image */
-   eglImage = eglCreateImageKHR(
-                state->display,
-                state->context,
-                EGL_GL_TEXTURE_2D_KHR,
-                (EGLClientBuffer)state->tex,
-                0);
-    
-   if (eglImage == EGL_NO_IMAGE_KHR)
+   // One texture for every frame that the decoder can be ahead
+   glGenTextures(decodeParams.frameCount, state->tex);
+
+   for (int i = 0; i < decodeParams.frameCount; ++i)
    {
-      printf("eglCreateImageKHR failed.\n");
-      exit(1);
+      glBindTexture(GL_TEXTURE_2D, state->tex[i]);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, imageWidth, imageHeight, 0,
+                   GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+
+      /* Create EGL Image */
+      decodeParams.eglImages[i] = eglCreateImageKHR(
+                   state->display,
+                   state->context,
+                   EGL_GL_TEXTURE_2D_KHR,
+                   (EGLClientBuffer)state->tex[i],
+                   0);
+
+      if (decodeParams.eglImages[i] == EGL_NO_IMAGE_KHR)
+      {
+         printf("eglCreateImageKHR failed.\n");
+         exit(1);
+      }
    }
 
     VCOS_STATUS_T status;
@@ -295,14 +310,9 @@ static void init_textures(STATE_T *state)
         printf("Failed to create render semaphore %d\n", status);
         exit(1);
     }
-    status = vcos_semaphore_create(&semFinishedFrame, "semFinishedFrame", 1);
-    if (status != VCOS_SUCCESS) {
-        printf("Failed to create render semaphore %d\n", status);
-        exit(1);
-    }
 
    // Start decoding video frames
-   pthread_create(&thread1, NULL, video_decode_test, eglImage);
+   pthread_create(&thread1, NULL, video_decode_test, &decodeParams);
 }
 //------------------------------------------------------------------------------
 
@@ -311,10 +321,13 @@ static void exit_func(void)
 {
     balltrack_core_term();
 
-   if (eglImage != 0)
+   for (int i = 0; i < decodeParams.frameCount; ++i)
    {
-      if (!eglDestroyImageKHR(state->display, (EGLImageKHR) eglImage))
-         printf("eglDestroyImageKHR failed.");
+      if (decodeParams.eglImages[i] != 0)
+      {
+         if (!eglDestroyImageKHR(state->display, (EGLImageKHR) decodeParams.eglImages[i]))
+            printf("eglDestroyImageKHR failed.");
+      }
    }
 
    // clear screen
@@ -328,7 +341,6 @@ static void exit_func(void)
    eglTerminate( state->display );
 
     vcos_semaphore_delete(&semNewFrame);
-    vcos_semaphore_delete(&semFinishedFrame);
 
    printf("\nVideoplayer closed\n");
 } // exit_func()
@@ -364,14 +376,66 @@ static void update_render_fps()
    }
 }
 
+// Usage: player [file.h264] [fps] [WxH] [filter scale] [downsample factor] [search factor] [fbo mode] [readout] [gpu search] [fence readout] [decode frames] [no scheduler]
+// The size and factors set the tracker pipeline, see balltrack_core_configure,
+// and the next four are for balltrack_core_set_fbo_mode, balltrack_core_set_readout,
+// balltrack_core_set_gpu_search and balltrack_core_set_fence_readout.
+// Decode frames is the number of textures that the decoder fills in turn (3),
+// so it can be that many frames ahead of the tracker. With no scheduler = 1,
+// the video is decoded as fast as the tracker goes, once, and fps is only used
+// as the framerate of the analysis.
 int main (int argc, char **argv)
 {
+    int filterScale = 0; // Default of the tracker
+    int downsampleFactor = 0;
+    int searchFactor = 0;
     if (argc >= 2) {
         filename = argv[1];
     }
     if (argc >= 3) {
         fps = atoi(argv[2]);
     }
+    if (argc >= 4) {
+        if (sscanf(argv[3], "%dx%d", &imageWidth, &imageHeight) != 2) {
+            printf("Invalid video size %s, use WxH\n", argv[3]);
+            return 1;
+        }
+    }
+    if (argc >= 5) {
+        filterScale = atoi(argv[4]);
+    }
+    if (argc >= 6) {
+        downsampleFactor = atoi(argv[5]);
+    }
+    if (argc >= 7) {
+        searchFactor = atoi(argv[6]);
+    }
+    if (balltrack_core_configure(imageWidth, imageHeight, filterScale, downsampleFactor, searchFactor)) {
+        return 1;
+    }
+    if (argc >= 8) {
+        balltrack_core_set_fbo_mode(atoi(argv[7]));
+    }
+    if (argc >= 9) {
+        if (balltrack_core_set_readout(atoi(argv[8])))
+            return 1;
+    }
+    if (argc >= 10) {
+        balltrack_core_set_gpu_search(atoi(argv[9]));
+    }
+    if (argc >= 11) {
+        balltrack_core_set_fence_readout(atoi(argv[10]));
+    }
+    if (argc >= 12) {
+        decodeParams.frameCount = atoi(argv[11]);
+        if (decodeParams.frameCount < 1 || decodeParams.frameCount > MAX_DECODE_FRAMES) {
+            printf("Invalid number of decode frames %s, use 1 to %d\n", argv[11], MAX_DECODE_FRAMES);
+            return 1;
+        }
+    }
+    if (argc >= 13) {
+        decodeParams.noScheduler = atoi(argv[12]);
+    }
 
    bcm_host_init();
    printf("Note: ensure you have sufficient gpu_mem configured\n");
@@ -382,14 +446,32 @@ int main (int argc, char **argv)
    // Start OGLES
    init_ogl(state);
 
+   if (decodeParams.noScheduler)
+   {
+      // Do not wait for the display, and give the analysis the
+      // framerate of the footage instead of the measured one
+      eglSwapInterval(state->display, 0);
+      balltrack_core_set_fps_measurement(0);
+      balltrack_core_set_fps(fps);
+   }
+
    // initialise the OGLES texture(s)
    init_textures(state);
 
+   TRACE_THREAD_NAME("GL");
+
    while (!terminate)
    {
-      redraw_scene(state);
+      if (redraw_scene(state) < 0)
+      {
+         printf("Video ended\n");
+         terminate = 1;
+         break;
+      }
       update_render_fps();
    }
+   // The decoder has stopped using the textures
+   pthread_join(thread1, NULL);
    exit_func();
    return 0;
 }
@@ -26,5 +26,26 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #pragma once
 
+// Most frames that the decoder can be ahead of the tracker
+#define MAX_DECODE_FRAMES 4
 
+typedef struct
+{
+   // EGLImages that egl_render decodes into, in turn. While the
+   // tracker processes one, the decoder can fill the others.
+   int frameCount;
+   void* eglImages[MAX_DECODE_FRAMES];
+   // Decode as fast as possible, without the video_scheduler and clock,
+   // and stop at the end of the file instead of starting again
+   int noScheduler;
+} VIDEO_DECODE_PARAMS;
+
+// Decoder thread, `arg` is a VIDEO_DECODE_PARAMS
 void* video_decode_test(void* arg);
+
+// Called from the GL thread
+// Waits for the next decoded frame and returns its index in eglImages,
+// or -1 when the video has ended
+int video_wait_frame(void);
+// The frame is processed, so the decoder can fill it again
+void video_return_frame(int index);
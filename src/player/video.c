@@ -37,16 +37,25 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "libilclient/ilclient.h"
 #include "interface/vcos/vcos.h" // For threads and semaphores
 
-static OMX_BUFFERHEADERTYPE* eglBuffer = NULL;
+#include "triangle.h"
+
 static COMPONENT_T* egl_render = NULL;
 
-static void* eglImage = 0;
+static VIDEO_DECODE_PARAMS params;
+static OMX_BUFFERHEADERTYPE* eglBuffers[MAX_DECODE_FRAMES];
+
+// Decoded frames that the GL thread did not take yet, in decode order.
+// semNewFrame is posted once for every frame, and once more at the end.
+static int decodedFrames[MAX_DECODE_FRAMES];
+static int decodedFirst = 0;
+static int decodedCount = 0;
+static volatile int videoEnded = 0;
+static VCOS_MUTEX_T decodedMutex;
 
 char* filename = "/opt/vc/src/hello_pi/hello_video/test.h264";
 int fps = 10;
 
 extern VCOS_SEMAPHORE_T semNewFrame;
-extern VCOS_SEMAPHORE_T semFinishedFrame;
 
 static void update_fps()
 {
@@ -74,39 +83,120 @@ static void update_fps()
    }
 }
 
-// This is called when the texture buffer is filled
+// Tell the GL thread that there are no more frames
+static void end_video()
+{
+   vcos_mutex_lock(&decodedMutex);
+   int wasEnded = videoEnded;
+   videoEnded = 1;
+   vcos_mutex_unlock(&decodedMutex);
+   if (!wasEnded)
+      vcos_semaphore_post(&semNewFrame);
+}
+
+// This is called when egl_render has filled one of the EGLImages.
+// It does not wait for the GL thread: the frame is queued, and the GL
+// thread gives it back with video_return_frame. In the meantime
+// the decoder goes on with the other EGLImages.
 void my_fill_buffer_done(void* data, COMPONENT_T* comp) {
-    update_fps();
-
-    // Notify GL thread that there is a frame
-    vcos_semaphore_post(&semNewFrame);
-    // Wait for the GL thread to finish
-    vcos_semaphore_wait(&semFinishedFrame);
-
-    // Tell the video decoder that this buffer is handled
-    // and can be filled with the next video frame
-    if (OMX_FillThisBuffer(ilclient_get_handle(egl_render), eglBuffer) !=
-        OMX_ErrorNone) {
-        printf("OMX_FillThisBuffer failed in callback\n");
-        exit(1);
+    OMX_BUFFERHEADERTYPE* buf;
+    // ilclient keeps the filled buffers of the port in a list
+    while ((buf = ilclient_get_output_buffer(egl_render, 221, 0)) != NULL) {
+        int index = -1;
+        for (int i = 0; i < params.frameCount; ++i) {
+            if (eglBuffers[i] == buf)
+                index = i;
+        }
+        if (index < 0)
+            continue;
+        int eos = (buf->nFlags & OMX_BUFFERFLAG_EOS) != 0;
+        int queued = 0;
+        vcos_mutex_lock(&decodedMutex);
+        // After the end, egl_render gives back the buffers that it still
+        // has when it goes to idle. Those are not frames, so they are dropped.
+        if (!videoEnded && buf->nFilledLen > 0) {
+            decodedFrames[(decodedFirst + decodedCount) % MAX_DECODE_FRAMES] = index;
+            ++decodedCount;
+            queued = 1;
+        } else if (!videoEnded && !eos) {
+            // An empty buffer while decoding, fill it again
+            if (OMX_FillThisBuffer(ILC_GET_HANDLE(egl_render), buf) != OMX_ErrorNone) {
+                printf("OMX_FillThisBuffer failed in callback\n");
+                exit(1);
+            }
+        }
+        vcos_mutex_unlock(&decodedMutex);
+
+        if (queued) {
+            update_fps();
+            // Notify GL thread that there is a frame
+            vcos_semaphore_post(&semNewFrame);
+        }
+        if (eos)
+            end_video();
     }
 }
 
+int video_wait_frame(void)
+{
+   int index = -1;
+   vcos_semaphore_wait(&semNewFrame);
+   vcos_mutex_lock(&decodedMutex);
+   if (decodedCount > 0) {
+      index = decodedFrames[decodedFirst];
+      decodedFirst = (decodedFirst + 1) % MAX_DECODE_FRAMES;
+      --decodedCount;
+   }
+   vcos_mutex_unlock(&decodedMutex);
+   return index;
+}
+
+void video_return_frame(int index)
+{
+   // After the end, the components are being stopped
+   vcos_mutex_lock(&decodedMutex);
+   if (!videoEnded) {
+      // Tell the video decoder that this buffer is handled
+      // and can be filled with the next video frame
+      if (OMX_FillThisBuffer(ILC_GET_HANDLE(egl_render), eglBuffers[index]) != OMX_ErrorNone) {
+         printf("OMX_FillThisBuffer failed\n");
+         exit(1);
+      }
+   }
+   vcos_mutex_unlock(&decodedMutex);
+}
+
 // Modified function prototype to work with pthreads
 void *video_decode_test(void* arg)
 {
-   eglImage = arg;
+   params = *(VIDEO_DECODE_PARAMS*)arg;
+
+   if (params.frameCount < 1 || params.frameCount > MAX_DECODE_FRAMES)
+   {
+      printf("Unsupported number of decode frames %d, use 1 to %d.\n", params.frameCount, MAX_DECODE_FRAMES);
+      exit(1);
+   }
+   for (int i = 0; i < params.frameCount; ++i)
+   {
+      if (params.eglImages[i] == 0)
+      {
+         printf("eglImage is null.\n");
+         exit(1);
+      }
+   }
 
-   if (eglImage == 0)
+   if (vcos_mutex_create(&decodedMutex, "decodedMutex") != VCOS_SUCCESS)
    {
-      printf("eglImage is null.\n");
+      printf("Failed to create decode mutex\n");
       exit(1);
    }
 
    OMX_VIDEO_PARAM_PORTFORMATTYPE format;
    OMX_TIME_CONFIG_CLOCKSTATETYPE cstate;
+   OMX_PARAM_PORTDEFINITIONTYPE portdef;
    COMPONENT_T *video_decode = NULL, *video_scheduler = NULL, *clock = NULL;
    COMPONENT_T *list[5];
+   int listCount = 0;
    TUNNEL_T tunnel[4];
    ILCLIENT_T *client;
    FILE *in;
@@ -117,11 +207,15 @@ void *video_decode_test(void* arg)
    memset(tunnel, 0, sizeof(tunnel));
 
    if((in = fopen(filename, "rb")) == NULL)
+   {
+      end_video();
       return (void *)-2;
+   }
 
    if((client = ilclient_init()) == NULL)
    {
       fclose(in);
+      end_video();
       return (void *)-3;
    }
 
@@ -129,6 +223,7 @@ void *video_decode_test(void* arg)
    {
       ilclient_destroy(client);
       fclose(in);
+      end_video();
       return (void *)-4;
    }
 
@@ -138,40 +233,49 @@ void *video_decode_test(void* arg)
    // create video_decode
    if(ilclient_create_component(client, &video_decode, "video_decode", ILCLIENT_DISABLE_ALL_PORTS | ILCLIENT_ENABLE_INPUT_BUFFERS) != 0)
       status = -14;
-   list[0] = video_decode;
+   list[listCount++] = video_decode;
 
    // create egl_render
    if(status == 0 && ilclient_create_component(client, &egl_render, "egl_render", ILCLIENT_DISABLE_ALL_PORTS | ILCLIENT_ENABLE_OUTPUT_BUFFERS) != 0)
       status = -14;
-   list[1] = egl_render;
-
-   // create clock
-   if(status == 0 && ilclient_create_component(client, &clock, "clock", ILCLIENT_DISABLE_ALL_PORTS) != 0)
-      status = -14;
-   list[2] = clock;
-
-   memset(&cstate, 0, sizeof(cstate));
-   cstate.nSize = sizeof(cstate);
-   cstate.nVersion.nVersion = OMX_VERSION;
-   cstate.eState = OMX_TIME_ClockStateWaitingForStartTime;
-   cstate.nWaitMask = 1;
-   if(clock != NULL && OMX_SetParameter(ILC_GET_HANDLE(clock), OMX_IndexConfigTimeClockState, &cstate) != OMX_ErrorNone)
-      status = -13;
-
-   // create video_scheduler
-   if(status == 0 && ilclient_create_component(client, &video_scheduler, "video_scheduler", ILCLIENT_DISABLE_ALL_PORTS) != 0)
-      status = -14;
-   list[3] = video_scheduler;
+   list[listCount++] = egl_render;
 
-   set_tunnel(tunnel, video_decode, 131, video_scheduler, 10);
-   set_tunnel(tunnel+1, video_scheduler, 11, egl_render, 220);
-   set_tunnel(tunnel+2, clock, 80, video_scheduler, 12);
-
-   // setup clock tunnel first
-   if(status == 0 && ilclient_setup_tunnel(tunnel+2, 0, 0) != 0)
-      status = -15;
+   if (params.noScheduler)
+   {
+      // The decoder goes straight into egl_render, which
+      // takes the frames as soon as it has a free EGLImage
+      set_tunnel(tunnel, video_decode, 131, egl_render, 220);
+   }
    else
-      ilclient_change_component_state(clock, OMX_StateExecuting);
+   {
+      // create clock
+      if(status == 0 && ilclient_create_component(client, &clock, "clock", ILCLIENT_DISABLE_ALL_PORTS) != 0)
+         status = -14;
+      list[listCount++] = clock;
+
+      memset(&cstate, 0, sizeof(cstate));
+      cstate.nSize = sizeof(cstate);
+      cstate.nVersion.nVersion = OMX_VERSION;
+      cstate.eState = OMX_TIME_ClockStateWaitingForStartTime;
+      cstate.nWaitMask = 1;
+      if(clock != NULL && OMX_SetParameter(ILC_GET_HANDLE(clock), OMX_IndexConfigTimeClockState, &cstate) != OMX_ErrorNone)
+         status = -13;
+
+      // create video_scheduler
+      if(status == 0 && ilclient_create_component(client, &video_scheduler, "video_scheduler", ILCLIENT_DISABLE_ALL_PORTS) != 0)
+         status = -14;
+      list[listCount++] = video_scheduler;
+
+      set_tunnel(tunnel, video_decode, 131, video_scheduler, 10);
+      set_tunnel(tunnel+1, video_scheduler, 11, egl_render, 220);
+      set_tunnel(tunnel+2, clock, 80, video_scheduler, 12);
+
+      // setup clock tunnel first
+      if(status == 0 && ilclient_setup_tunnel(tunnel+2, 0, 0) != 0)
+         status = -15;
+      else
+         ilclient_change_component_state(clock, OMX_StateExecuting);
+   }
 
    if(status == 0)
       ilclient_change_component_state(video_decode, OMX_StateIdle);
@@ -200,8 +304,8 @@ void *video_decode_test(void* arg)
          // feed data and wait until we get port settings changed
          unsigned char *dest = buf->pBuffer;
 
-         // loop if at end
-         if (feof(in))
+         // loop if at end, but not for offline analysis
+         if (feof(in) && !params.noScheduler)
             rewind(in);
 
          data_len += fread(dest, 1, buf->nAllocLen-data_len, in);
@@ -213,25 +317,60 @@ void *video_decode_test(void* arg)
          {
             port_settings_changed = 1;
 
-            if(ilclient_setup_tunnel(tunnel, 0, 0) != 0)
+            if (params.noScheduler)
             {
-               status = -7;
-               break;
+               // setup tunnel to egl_render
+               if(ilclient_setup_tunnel(tunnel, 0, 1000) != 0)
+               {
+                  status = -12;
+                  break;
+               }
             }
-
-            ilclient_change_component_state(video_scheduler, OMX_StateExecuting);
-
-            // now setup tunnel to egl_render
-            if(ilclient_setup_tunnel(tunnel+1, 0, 1000) != 0)
+            else
             {
-               status = -12;
-               break;
+               if(ilclient_setup_tunnel(tunnel, 0, 0) != 0)
+               {
+                  status = -7;
+                  break;
+               }
+
+               ilclient_change_component_state(video_scheduler, OMX_StateExecuting);
+
+               // now setup tunnel to egl_render
+               if(ilclient_setup_tunnel(tunnel+1, 0, 1000) != 0)
+               {
+                  status = -12;
+                  break;
+               }
             }
 
             // Set egl_render to idle
             ilclient_change_component_state(egl_render, OMX_StateIdle);
 
-            // Enable the output port and tell egl_render to use the texture as a buffer
+            // One output buffer per EGLImage, this can
+            // only be set while the port is disabled
+            memset(&portdef, 0, sizeof(portdef));
+            portdef.nSize = sizeof(portdef);
+            portdef.nVersion.nVersion = OMX_VERSION;
+            portdef.nPortIndex = 221;
+            if (OMX_GetParameter(ILC_GET_HANDLE(egl_render), OMX_IndexParamPortDefinition, &portdef) != OMX_ErrorNone)
+            {
+               printf("OMX_GetParameter failed for the egl_render output port.\n");
+               exit(1);
+            }
+            if ((OMX_U32)params.frameCount < portdef.nBufferCountMin)
+            {
+               printf("egl_render needs at least %u decode frames.\n", (unsigned)portdef.nBufferCountMin);
+               exit(1);
+            }
+            portdef.nBufferCountActual = params.frameCount;
+            if (OMX_SetParameter(ILC_GET_HANDLE(egl_render), OMX_IndexParamPortDefinition, &portdef) != OMX_ErrorNone)
+            {
+               printf("OMX_SetParameter failed for %d decode frames.\n", params.frameCount);
+               exit(1);
+            }
+
+            // Enable the output port and tell egl_render to use the textures as buffers
             //ilclient_enable_port(egl_render, 221); THIS BLOCKS SO CAN'T BE USED
             if (OMX_SendCommand(ILC_GET_HANDLE(egl_render), OMX_CommandPortEnable, 221, NULL) != OMX_ErrorNone)
             {
@@ -239,21 +378,27 @@ void *video_decode_test(void* arg)
                exit(1);
             }
 
-            if (OMX_UseEGLImage(ILC_GET_HANDLE(egl_render), &eglBuffer, 221, NULL, eglImage) != OMX_ErrorNone)
+            for (int i = 0; i < params.frameCount; ++i)
             {
-               printf("OMX_UseEGLImage failed.\n");
-               exit(1);
+               if (OMX_UseEGLImage(ILC_GET_HANDLE(egl_render), &eglBuffers[i], 221, NULL, params.eglImages[i]) != OMX_ErrorNone)
+               {
+                  printf("OMX_UseEGLImage failed.\n");
+                  exit(1);
+               }
             }
 
             // Set egl_render to executing
             ilclient_change_component_state(egl_render, OMX_StateExecuting);
 
 
-            // Request egl_render to write data to the texture buffer
-            if(OMX_FillThisBuffer(ILC_GET_HANDLE(egl_render), eglBuffer) != OMX_ErrorNone)
+            // Request egl_render to write data to all texture buffers, in turn
+            for (int i = 0; i < params.frameCount; ++i)
             {
-               printf("OMX_FillThisBuffer failed.\n");
-               exit(1);
+               if(OMX_FillThisBuffer(ILC_GET_HANDLE(egl_render), eglBuffers[i]) != OMX_ErrorNone)
+               {
+                  printf("OMX_FillThisBuffer failed.\n");
+                  exit(1);
+               }
             }
          }
          if(!data_len)
@@ -284,6 +429,12 @@ void *video_decode_test(void* arg)
       if(OMX_EmptyThisBuffer(ILC_GET_HANDLE(video_decode), buf) != OMX_ErrorNone)
          status = -20;
 
+      // The GL thread takes the last frames until the end of stream
+      // comes out of egl_render
+      for (int ms = 0; status == 0 && ms < 10000 && !videoEnded; ms += 10)
+         vcos_sleep(10);
+      end_video();
+
       // need to flush the renderer to allow video_decode to disable its input port
       ilclient_flush_tunnels(tunnel, 0);
 
@@ -291,13 +442,33 @@ void *video_decode_test(void* arg)
    }
 
    fclose(in);
+   end_video();
 
    ilclient_disable_tunnel(tunnel);
-   ilclient_disable_tunnel(tunnel+1);
-   ilclient_disable_tunnel(tunnel+2);
+   if (!params.noScheduler)
+   {
+      ilclient_disable_tunnel(tunnel+1);
+      ilclient_disable_tunnel(tunnel+2);
+   }
    ilclient_teardown_tunnels(tunnel);
 
    ilclient_state_transition(list, OMX_StateIdle);
+
+   // The EGLImage buffers of egl_render are not freed by ilclient, and
+   // egl_render does not go to loaded while it still has them
+   if (eglBuffers[0] != NULL)
+   {
+      if (OMX_SendCommand(ILC_GET_HANDLE(egl_render), OMX_CommandPortDisable, 221, NULL) != OMX_ErrorNone)
+         printf("OMX_CommandPortDisable failed.\n");
+      for (int i = 0; i < params.frameCount; ++i)
+      {
+         if (OMX_FreeBuffer(ILC_GET_HANDLE(egl_render), 221, eglBuffers[i]) != OMX_ErrorNone)
+            printf("OMX_FreeBuffer failed.\n");
+         eglBuffers[i] = NULL;
+      }
+      ilclient_wait_for_command_complete(egl_render, OMX_CommandPortDisable, 221);
+   }
+
    ilclient_state_transition(list, OMX_StateLoaded);
 
    ilclient_cleanup_components(list);
@@ -43,6 +43,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "interface/mmal/util/mmal_util.h"
 #include "interface/mmal/util/mmal_util_params.h"
 #include "../tracker/tga.h"
+#include "../tracker/trace.h"
 
 //#include "gl_scenes/mirror.h"
 //#include "gl_scenes/sobel.h"
@@ -269,6 +270,11 @@ static int raspitex_draw(RASPITEX_STATE *state, MMAL_BUFFER_HEADER_T *buf)
 {
    int rc = 0;
 
+   /* The camera timestamp identifies the frame in the trace */
+   if (buf)
+      TRACE_FRAME(buf->pts);
+   TRACE_BEGIN("raspitex_draw");
+
    /* If buf is non-NULL then there is a new viewfinder frame available
     * from the camera so the texture should be updated.
     *
@@ -342,7 +348,9 @@ static int raspitex_draw(RASPITEX_STATE *state, MMAL_BUFFER_HEADER_T *buf)
       // ADDED: COMMENTED OUT
       //raspitex_do_capture(state);
 
+      TRACE_BEGIN("eglSwapBuffers");
       eglSwapBuffers(state->display, state->surface);
+      TRACE_END("eglSwapBuffers");
       update_fps();
    }
    else
@@ -351,6 +359,7 @@ static int raspitex_draw(RASPITEX_STATE *state, MMAL_BUFFER_HEADER_T *buf)
    }
 
 end:
+   TRACE_END("raspitex_draw");
    return rc;
 }
 
@@ -408,6 +417,7 @@ static void *preview_worker(void *arg)
    int rc;
 
    vcos_log_trace("%s: port %p", VCOS_FUNCTION, preview_port);
+   TRACE_THREAD_NAME("GL");
 
    rc = state->ops.create_native_window(state);
    if (rc != 0)
@@ -469,6 +479,10 @@ static void preview_output_cb(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf)
    }
    else
    {
+      TRACE_THREAD_NAME("camera");
+      TRACE_FRAME(buf->pts);
+      TRACE_INSTANT("camera_buffer");
+
       /* Enqueue the preview frame for rendering and return to
        * avoid blocking MMAL core.
        */
@@ -86,6 +86,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "RaspiHelpers.h"
 //#include "RaspiGPS.h" // ADDED: COMMENTED OUT
 #include "RaspiTex.h" // ADDED
+#include "../tracker/core.h" // ADDED
 
 #include <semaphore.h>
 
@@ -228,6 +229,16 @@ struct RASPIVID_STATE_S
    bool netListen;
    MMAL_BOOL_T addSPSTiming;
    int slices;
+
+   int trackFilterScale;               /// ADDED: Color filter on every pixel (1) or on 2x2 averages (2)
+   int trackDownsample;                /// ADDED: Size of the ball buffer macropixels
+   int trackSearch;                    /// ADDED: Size of the macropixels where the ball is searched first
+   int highFramerate;                  /// ADDED: 640x480 at 90 fps or more
+   int fboMode;                        /// ADDED: How the tracker binds its render targets
+   int readoutMethod;                  /// ADDED: How the tracker reads out its textures
+   int trackGpuSearch;                 /// ADDED: Search the ball on the GPU
+   int trackNoFence;                   /// ADDED: Read out the tracker with frame delays instead of fences
+   int trackNoOverlay;                 /// ADDED: Do not draw the tracker overlay
 };
 
 
@@ -311,7 +322,16 @@ enum
    CommandRawFormat,
    CommandNetListen,
    CommandSPSTimings,
-   CommandSlices
+   CommandSlices,
+   CommandTrackFilterScale, // ADDED
+   CommandTrackDownsample,  // ADDED
+   CommandTrackSearch,      // ADDED
+   CommandHighFramerate,    // ADDED
+   CommandFboMode,          // ADDED
+   CommandReadout,          // ADDED
+   CommandTrackGpuSearch,   // ADDED
+   CommandTrackNoFence,     // ADDED
+   CommandTrackNoOverlay    // ADDED
 };
 
 static COMMAND_LIST cmdline_commands[] =
@@ -345,6 +365,15 @@ static COMMAND_LIST cmdline_commands[] =
    { CommandNetListen,     "-listen",     "l", "Listen on a TCP socket", 0},
    { CommandSPSTimings,    "-spstimings",    "stm", "Add in h.264 sps timings", 0},
    { CommandSlices   ,     "-slices",     "sl", "Horizontal slices per frame. Default 1 (off)", 1},
+   { CommandTrackFilterScale, "-trackscale", "tsc", "Ball tracker: color filter on every pixel (1) or on 2x2 averages (2)", 1},
+   { CommandTrackDownsample, "-trackdownsample", "tds", "Ball tracker: downsample factor of the ball buffer, 4, 8 or 16", 1},
+   { CommandTrackSearch, "-tracksearch", "tss", "Ball tracker: downsample factor of the coarse search, 1, 2, 4 or 8 times -tds", 1},
+   { CommandHighFramerate, "-highfps",    "hfr", "Ball tracker: record 640x480 at 90 fps (or the -fps value up to 120)", 0},
+   { CommandFboMode,       "-fbomode",    "fbo", "Ball tracker: one framebuffer (0), one per texture (1), or compare both (2)", 1},
+   { CommandReadout,       "-readout",    "ro",  "Ball tracker readout: fastest (0), glReadPixels (1), VCSM (2), mapped VCSM (3) or zero copy VCSM (4)", 1},
+   { CommandTrackGpuSearch, "-trackgpusearch", "tgs", "Ball tracker: search the ball on the GPU and only read out the result", 0},
+   { CommandTrackNoFence,  "-tracknofence", "tnf", "Ball tracker: read out with fixed frame delays instead of EGL fences", 0},
+   { CommandTrackNoOverlay, "-tracknooverlay", "tno", "Ball tracker: do not draw the field and ball positions on the preview", 0},
 };
 
 static int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
@@ -430,6 +459,15 @@ static void default_status(RASPIVID_STATE *state)
    state->preview_parameters.previewWindow.height = 360;
    state->raspitex_state.width = 640;
    state->raspitex_state.height = 360;
+   state->trackFilterScale = 0; // Default of the tracker
+   state->trackDownsample = 0;
+   state->trackSearch = 0;
+   state->highFramerate = 0;
+   state->fboMode = FBO_SINGLE;
+   state->readoutMethod = 0;
+   state->trackGpuSearch = 0;
+   state->trackNoFence = 0;
+   state->trackNoOverlay = 0;
 }
 
 static void check_camera_model(int cam_num)
@@ -490,6 +528,8 @@ static void dump_status(RASPIVID_STATE *state)
    fprintf(stderr, "H264 Fill SPS Timings %s\n", state->addSPSTiming ? "Yes" : "No");
    fprintf(stderr, "H264 Intra refresh type %s, period %d\n", raspicli_unmap_xref(state->intra_refresh_type, intra_refresh_map, intra_refresh_map_size), state->intraperiod);
    fprintf(stderr, "H264 Slices %d\n", state->slices);
+   fprintf(stderr, "Ball tracker filter scale %d, downsample factor %d, search factor %d\n",
+           state->trackFilterScale, state->trackDownsample, state->trackSearch);
 
    // Not going to display segment data unless asked for it.
    if (state->segmentSize)
@@ -928,6 +968,75 @@ static int parse_cmdline(int argc, const char **argv, RASPIVID_STATE *state)
          break;
       }
 
+      case CommandTrackFilterScale:
+      {
+         if (sscanf(argv[i + 1], "%d", &state->trackFilterScale) == 1)
+            i++;
+         else
+            valid = 0;
+         break;
+      }
+
+      case CommandTrackDownsample:
+      {
+         if (sscanf(argv[i + 1], "%d", &state->trackDownsample) == 1)
+            i++;
+         else
+            valid = 0;
+         break;
+      }
+
+      case CommandTrackSearch:
+      {
+         if (sscanf(argv[i + 1], "%d", &state->trackSearch) == 1)
+            i++;
+         else
+            valid = 0;
+         break;
+      }
+
+      case CommandHighFramerate:
+      {
+         state->highFramerate = 1;
+         break;
+      }
+
+      case CommandFboMode:
+      {
+         if (sscanf(argv[i + 1], "%d", &state->fboMode) == 1)
+            i++;
+         else
+            valid = 0;
+         break;
+      }
+
+      case CommandReadout:
+      {
+         if (sscanf(argv[i + 1], "%d", &state->readoutMethod) == 1)
+            i++;
+         else
+            valid = 0;
+         break;
+      }
+
+      case CommandTrackGpuSearch:
+      {
+         state->trackGpuSearch = 1;
+         break;
+      }
+
+      case CommandTrackNoFence:
+      {
+         state->trackNoFence = 1;
+         break;
+      }
+
+      case CommandTrackNoOverlay:
+      {
+         state->trackNoOverlay = 1;
+         break;
+      }
+
       case CommandSPSTimings:
       {
          state->addSPSTiming = MMAL_TRUE;
@@ -2490,6 +2599,38 @@ int main(int argc, const char **argv)
 
    check_camera_model(state.common_settings.cameraNum);
 
+   // ADDED: High framerate mode
+   // The camera has a 640x480 mode up to 90 fps (v1) or 120 fps (v2).
+   // The tracker uses 4x4 macropixels there, a ball buffer of 160x120,
+   // and the color filter runs on 3 times less pixels than at 720p,
+   // so the GPU can keep up.
+   if (state.highFramerate)
+   {
+      state.common_settings.width = 640;
+      state.common_settings.height = 480;
+      if (state.framerate < 90)
+         state.framerate = 90;
+      if (state.framerate > 120)
+         state.framerate = 120;
+      if (state.trackDownsample == 0)
+         state.trackDownsample = 4;
+   }
+
+   // ADDED: The camera texture has the size of the recording
+   if (balltrack_core_configure(state.common_settings.width, state.common_settings.height,
+                                state.trackFilterScale, state.trackDownsample, state.trackSearch))
+   {
+      exit(EX_USAGE);
+   }
+   if (state.framerate > 0)
+      balltrack_core_set_fps(state.framerate);
+   balltrack_core_set_fbo_mode(state.fboMode);
+   if (balltrack_core_set_readout(state.readoutMethod))
+      exit(EX_USAGE);
+   balltrack_core_set_gpu_search(state.trackGpuSearch);
+   balltrack_core_set_fence_readout(!state.trackNoFence);
+   balltrack_core_set_overlay(!state.trackNoOverlay);
+
    // ADDED: COMMENTED OUT
    //if (state.common_settings.gps)
    //   if (raspi_gps_setup(state.common_settings.verbose))
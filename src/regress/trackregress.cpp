@@ -0,0 +1,190 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+
+//
+// Runs the analysis over a recording and compares its events with the
+// expected ones, to see whether a change of the analysis changes its result.
+//
+// Usage: trackregress [-update] [-balls] [-fps F] recording expected.txt
+//
+// The recording is written by `trackreplay -r` or by any program that calls
+// analysis_set_recording (see analysis.h). It has the ball and field buffers
+// of every frame, so the color filter and downsampling are not run again.
+// The clock of the analysis gives the framerate of every record, or F with
+// -fps, so the result does not depend on how fast this runs.
+//
+// The events are lines of
+//
+//     <frame> MSG <message>
+//     <frame> BALL <x> <y> <confidence> <state>
+//
+// where the BALL lines are only there with -balls. They are compared line
+// by line with expected.txt, and the first difference is printed.
+// With -update, expected.txt is written instead.
+// The exit code is 0 when they are the same, and 1 otherwise.
+//
+#include "../tracker/analysis.h"
+#include "../tracker/eventchannel.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+bool withBalls = false;
+float fpsOverride = 0.0f;
+float recordFPS = 40.0f;
+std::vector<std::string> lines;
+Analysis analysis;
+
+void print_usage() {
+    printf("Usage: trackregress [-update] [-balls] [-fps F] recording expected.txt\n");
+}
+
+float record_fps() {
+    return (fpsOverride > 0.0f ? fpsOverride : recordFPS);
+}
+
+// Called by the analysis, on this thread
+void collect_event(void* context, const EventHeader& header, const void* payload) {
+    char buffer[EVENT_MAX_PAYLOAD + 64];
+    if (header.type == EVENT_MESSAGE) {
+        // Without the newline at the end of the message
+        int size = header.size;
+        const char* msg = (const char*)payload;
+        while (size > 0 && (msg[size - 1] == '\n' || msg[size - 1] == '\r'))
+            --size;
+        snprintf(buffer, sizeof(buffer), "%u MSG %.*s", header.frame, size, msg);
+    } else if (header.type == EVENT_BALL && withBalls) {
+        EventBall ball;
+        memcpy(&ball, payload, sizeof(ball));
+        snprintf(buffer, sizeof(buffer), "%u BALL %.4f %.4f %.2f %d", header.frame, ball.x, ball.y, ball.confidence, ball.state);
+    } else {
+        return;
+    }
+    lines.push_back(buffer);
+}
+
+// Returns the number of records, or -1 when the file is not a valid recording
+int run_recording(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        printf("Unable to open %s\n", filename);
+        return -1;
+    }
+
+    int records = 0;
+    std::vector<uint8_t> data;
+    AnalysisRecord header;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        int size = header.width * header.height;
+        if (header.type == ANALYSIS_RECORD_BALL && header.coarseFactor > 1)
+            size += (header.width / header.coarseFactor) * (header.height / header.coarseFactor);
+        if (header.magic != ANALYSIS_RECORD_MAGIC || header.coarseFactor == 0 ||
+            (header.type != ANALYSIS_RECORD_BALL && header.type != ANALYSIS_RECORD_FIELD) ||
+            header.size != (uint32_t)size) {
+            printf("%s: invalid record %d\n", filename, records);
+            fclose(file);
+            return -1;
+        }
+        data.resize(size);
+        if (fread(data.data(), 1, size, file) != (size_t)size) {
+            printf("%s: record %d is incomplete\n", filename, records);
+            fclose(file);
+            return -1;
+        }
+
+        recordFPS = header.fps;
+        if (header.type == ANALYSIS_RECORD_BALL) {
+            const uint8_t* coarse = (header.coarseFactor > 1 ? data.data() + header.width * header.height : 0);
+            analysis.process_ball_buffer(data.data(), header.width, header.height, coarse, header.coarseFactor);
+        } else {
+            analysis.process_field_buffer(data.data(), header.width, header.height);
+        }
+        ++records;
+    }
+    fclose(file);
+    return records;
+}
+
+int main(int argc, char** argv) {
+    bool update = false;
+    const char* recording = 0;
+    const char* expected = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-update")) {
+            update = true;
+        } else if (!strcmp(argv[i], "-balls")) {
+            withBalls = true;
+        } else if (!strcmp(argv[i], "-fps") && i + 1 < argc) {
+            fpsOverride = (float)atof(argv[++i]);
+            if (fpsOverride <= 0.0f) {
+                printf("Invalid framerate %s\n", argv[i]);
+                return 1;
+            }
+        } else if (argv[i][0] != '-' && !recording) {
+            recording = argv[i];
+        } else if (argv[i][0] != '-' && !expected) {
+            expected = argv[i];
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (!recording || !expected) {
+        print_usage();
+        return 1;
+    }
+
+    analysis.set_event_sink(collect_event, 0);
+    analysis.set_clock(record_fps);
+    int records = run_recording(recording);
+    if (records < 0)
+        return 1;
+
+    if (update) {
+        std::ofstream out(expected);
+        for (const auto& line : lines)
+            out << line << '\n';
+        if (!out) {
+            printf("Unable to write %s\n", expected);
+            return 1;
+        }
+        printf("UPDATED %s: %d lines from %d records\n", expected, (int)lines.size(), records);
+        return 0;
+    }
+
+    std::ifstream in(expected);
+    if (!in.is_open()) {
+        printf("Unable to open %s\n", expected);
+        return 1;
+    }
+    std::vector<std::string> expectedLines;
+    std::string line;
+    while (std::getline(in, line))
+        expectedLines.push_back(line);
+
+    size_t count = (lines.size() < expectedLines.size() ? lines.size() : expectedLines.size());
+    for (size_t i = 0; i < count; ++i) {
+        if (lines[i] != expectedLines[i]) {
+            printf("FAIL %s line %d\n", expected, (int)i + 1);
+            printf("  expected: %s\n", expectedLines[i].c_str());
+            printf("  got:      %s\n", lines[i].c_str());
+            return 1;
+        }
+    }
+    if (lines.size() != expectedLines.size()) {
+        printf("FAIL %s: expected %d lines, got %d\n", expected, (int)expectedLines.size(), (int)lines.size());
+        if (lines.size() > count)
+            printf("  first extra line: %s\n", lines[count].c_str());
+        else
+            printf("  first missing line: %s\n", expectedLines[count].c_str());
+        return 1;
+    }
+    printf("PASS %s: %d lines from %d records\n", expected, (int)lines.size(), records);
+    return 0;
+}
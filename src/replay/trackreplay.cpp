@@ -0,0 +1,174 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+
+//
+// Runs the tracker over recorded frames, as fast as it can.
+//
+// Usage: trackreplay [-c WxH,filterScale,downsampleFactor[,searchFactor]]
+//                    [-fps F] [-o events.bin] [-r recording] [-q]
+//                    (-rgba WxH frames.rgba | -i420 WxH frames.yuv | directory)
+//
+// The frames are raw RGBA or I420 frames, or a directory of TGA files,
+// see framereader.h. They go through the CPU pipeline (core_cpu.cpp),
+// without a display and without waiting between frames, and every event
+// of the analysis is printed as a line:
+//
+//     <frame> <time> MSG <message>
+//     <frame> <time> BALL <x> <y> <confidence> <state>
+//
+// where <time> is the time in the footage in seconds, at F frames per
+// second (default 40). Other lines are log messages of the tracker.
+//
+// With -o the events are also written in the framing of the event channel
+// (eventchannel.h), with that time as timestamp, so the file can be read
+// like the pipe of the webproxy.
+// With -r the ball and field buffers are recorded for trackregress
+// (see analysis_set_recording).
+// With -q only the summary is printed.
+//
+// The pipeline sizes are those of -c (see balltrack_core_configure),
+// by default those of pipeline.h for the size of the frames.
+//
+#include "../tracker/analysis.h"
+#include "../tracker/core.h"
+#include "../tracker/pipeline.h"
+#include "../tracker/eventchannel.h"
+#include "../tracker/framereader.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+float fps = 40.0f;
+bool quiet = false;
+FILE* eventFile = 0;
+FILE* recordingFile = 0;
+
+void print_usage() {
+    printf("Usage: trackreplay [-c WxH,filterScale,downsampleFactor[,searchFactor]]\n");
+    printf("                   [-fps F] [-o events.bin] [-r recording] [-q]\n");
+    printf("                   (-rgba WxH frames.rgba | -i420 WxH frames.yuv | directory)\n");
+}
+
+// Called by the analysis, on this thread
+void write_event(void* context, const EventHeader& header, const void* payload) {
+    // The time in the footage instead of the time of the replay
+    EventHeader h = header;
+    h.timestamp = (uint64_t)((double)h.frame * 1e6 / (double)fps);
+
+    if (eventFile) {
+        fwrite(&h, sizeof(h), 1, eventFile);
+        fwrite(payload, 1, h.size, eventFile);
+    }
+    if (quiet)
+        return;
+    double t = 1e-6 * (double)h.timestamp;
+    if (h.type == EVENT_MESSAGE) {
+        printf("%u %.3f MSG %.*s\n", h.frame, t, (int)h.size, (const char*)payload);
+    } else if (h.type == EVENT_BALL) {
+        EventBall ball;
+        memcpy(&ball, payload, sizeof(ball));
+        printf("%u %.3f BALL %.4f %.4f %.2f %d\n", h.frame, t, ball.x, ball.y, ball.confidence, ball.state);
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* input = 0;
+    const char* eventFilename = 0;
+    const char* recordingFilename = 0;
+    FrameReader::Format format = FrameReader::TGA_DIRECTORY;
+    int width = 0, height = 0;
+    bool configured = false;
+    int filterScale = 0, downsampleFactor = 0, searchFactor = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d,%d,%d,%d", &width, &height, &filterScale, &downsampleFactor, &searchFactor) < 4) {
+                printf("Usage: -c WxH,filterScale,downsampleFactor[,searchFactor]\n");
+                return 1;
+            }
+            configured = true;
+        } else if (!strcmp(argv[i], "-fps") && i + 1 < argc) {
+            fps = (float)atof(argv[++i]);
+            if (fps <= 0.0f) {
+                printf("Invalid framerate %s\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            eventFilename = argv[++i];
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            recordingFilename = argv[++i];
+        } else if (!strcmp(argv[i], "-q")) {
+            quiet = true;
+        } else if ((!strcmp(argv[i], "-rgba") || !strcmp(argv[i], "-i420")) && i + 2 < argc) {
+            format = (argv[i][1] == 'r' ? FrameReader::RAW_RGBA : FrameReader::RAW_I420);
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) {
+                printf("Invalid frame size %s, use WxH\n", argv[i]);
+                return 1;
+            }
+            input = argv[++i];
+        } else if (argv[i][0] != '-' && !input) {
+            input = argv[i];
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (!input) {
+        print_usage();
+        return 1;
+    }
+
+    FrameReader reader;
+    if (reader.open(input, format, width, height))
+        return 1;
+
+    // The pipeline source size is that of the frames, unless given with -c
+    if (!configured) {
+        width = reader.width;
+        height = reader.height;
+    }
+    if (balltrack_core_configure(width, height, filterScale, downsampleFactor, searchFactor))
+        return 1;
+
+    if (eventFilename) {
+        eventFile = fopen(eventFilename, "wb");
+        if (!eventFile) {
+            printf("Unable to open %s\n", eventFilename);
+            return 1;
+        }
+    }
+    if (recordingFilename) {
+        recordingFile = fopen(recordingFilename, "wb");
+        if (!recordingFile) {
+            printf("Unable to open %s\n", recordingFilename);
+            return 1;
+        }
+        analysis_set_recording(recordingFile);
+    }
+    event_channel_set_sink(write_event);
+    balltrack_core_set_fps(fps);
+    if (balltrack_core_init(0, 0))
+        return 1;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> rgba;
+    while (reader.next(rgba))
+        balltrack_core_process_frame(rgba.data(), reader.width, reader.height);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    balltrack_core_term();
+    if (eventFile)
+        fclose(eventFile);
+    if (recordingFile) {
+        analysis_set_recording(0);
+        fclose(recordingFile);
+    }
+
+    fprintf(stderr, "%d frames (%.1f s of footage) in %.2f s, %.0f frames per second\n",
+            reader.frames, (double)reader.frames / fps, seconds, (double)reader.frames / seconds);
+    return 0;
+}
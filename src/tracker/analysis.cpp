@@ -1,19 +1,26 @@
 #include "analysis.h"
+#include "ballfilter.h"
+#include "pipeline.h"
+#include "trace.h"
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <cmath>
 #include <vector>
 #include <fstream>
+#include <mutex>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // To communicate with the Python websocket server
 // we use a named pipe (FIFO) stored at
-//     /tmp/fooballtrackerpipe.in
-// These includes allow writing to such an object
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
+//     /tmp/foosballtrackerpipe.in
+// which is written by the event channel
+#include "eventchannel.h"
 
 // Size of the goal in field-coordinates,
 // i.e., 1.0f is the full field width/height
@@ -21,19 +28,6 @@ float goalWidth = 0.10f;
 float goalHeight = 0.38f;
 
 
-// Ball history
-const int historyCount = 256;
-POINT balls[historyCount]; // in [0,1]x[0,1] field coordinates
-int ballFrames[historyCount];
-POINT ballsScreen[historyCount]; // in [-1,1]x[-1,1] screen coordinates
-int ballCur = 0;
-
-int ballMissing = 1000;
-
-
-FIELD field;
-int frameNumber = 0;
-
 // Size of the green field:
 // 120.5 cm x 61.4 cm
 // Size of the field including the white bars:
@@ -43,41 +37,139 @@ int frameNumber = 0;
 // For ball speeds
 constexpr float fieldWidth  = 1.205f; // in meters
 constexpr float fieldHeight = 0.702f; // in meters
-extern float stableFPS; // Computed in core.cpp
-constexpr int BallSpeedCount = 5 * 60; // 5 seconds at 60 fps
-float ballSpeeds[BallSpeedCount];
-int ballSpeedIndex = 0;
-int ballSpeedFramesSinceLastUpdate = 0; // To prevent flooding the server
-
-
-int analysis_send_to_server(const char* str) {
-    int fd = open("/tmp/foosballtrackerpipe.in", O_WRONLY | O_NONBLOCK);
-    if (fd > 0) {
-        write(fd, str, strlen(str));
-        close(fd);
-        return 1;
-    }
-    return 0;
+
+// Used by the analysis_ functions, for the camera of the GPU pipeline
+Analysis defaultAnalysis;
+
+Analysis* analysis_default() {
+    return &defaultAnalysis;
 }
 
-void sendMaxSpeed(float speed) {
+Analysis::Analysis() {
+#ifdef ROI_TRACKING
+    roiTracking = true;
+#else
+    roiTracking = false;
+#endif
+    for (auto& speed : ballSpeeds)
+        speed = 0.0f;
+}
+
+void Analysis::send_event(EventType type, const void* payload, int size) {
+    if (eventSink)
+        event_sink_send(eventSink, eventSinkContext, type, frameNumber, payload, size);
+    else
+        event_channel_send(type, frameNumber, payload, size);
+}
+
+// Without a sink, the message is queued for the writer thread of the
+// event channel, so this does not wait for the pipe
+int Analysis::send_to_server(const char* str) {
+    TRACE_INSTANT("send_event");
+    if (!eventSink)
+        return (event_channel_send_message(frameNumber, str) ? 1 : 0);
+    int size = (int)strlen(str);
+    if (size > 0 && str[size - 1] == '\n')
+        --size;
+    return (event_sink_send(eventSink, eventSinkContext, EVENT_MESSAGE, frameNumber, str, size) ? 1 : 0);
+}
+
+void Analysis::sendMaxSpeed(float speed) {
     char buffer[64];
     sprintf(buffer, "MAXSPEED %.1f\n", speed);
-    analysis_send_to_server(buffer);
+    send_to_server(buffer);
     ballSpeedFramesSinceLastUpdate = 0;
 }
 
-std::ofstream timeseriesfile;
+void Analysis::set_clock(AnalysisClock clock) {
+    analysisClock = clock;
+}
 
-int analysis_init() {
-#ifdef GENERATE_TIMESERIES
-    timeseriesfile.open("/tmp/timeseries.txt");
+void Analysis::set_fps(float fps) {
+    analysisClock = 0;
+    clockFPS = fps;
+}
+
+void Analysis::read_clock() {
+    if (analysisClock)
+        clockFPS = analysisClock();
+}
+
+void Analysis::set_recording(FILE* file) {
+    recordingFile = file;
+}
+
+void Analysis::set_event_sink(EventSink sink, void* context) {
+    eventSink = sink;
+    eventSinkContext = context;
+}
+
+void Analysis::open_timeseries(const char* filename) {
+    timeseriesfile.open(filename);
     if (!timeseriesfile.is_open()) {
-        printf("Unable to open /tmp/timeseries.txt\n");
+        printf("Unable to open %s\n", filename);
     } else {
         timeseriesfile << "(* framenumber, x, y *)" << std::endl;
     }
+}
+
+// Writes `height` rows of `width` bytes that are `stride` bytes apart
+static void record_rows(FILE* file, const uint8_t* rows, int width, int height, int stride) {
+    for (int y = 0; y < height; ++y)
+        fwrite(rows + y * stride, 1, width, file);
+}
+
+void Analysis::record_ball_buffer(const uint8_t* pixelbuffer, int width, int height, int stride,
+                               const uint8_t* coarse, int coarseFactor, int coarseStride) {
+    if (!coarse)
+        coarseFactor = 1;
+    int cwidth = width / coarseFactor;
+    int cheight = height / coarseFactor;
+    AnalysisRecord header = {};
+    header.magic = ANALYSIS_RECORD_MAGIC;
+    header.type = ANALYSIS_RECORD_BALL;
+    header.coarseFactor = (uint8_t)coarseFactor;
+    header.width = (uint16_t)width;
+    header.height = (uint16_t)height;
+    header.fps = clockFPS;
+    header.size = width * height + (coarseFactor > 1 ? cwidth * cheight : 0);
+    fwrite(&header, sizeof(header), 1, recordingFile);
+    record_rows(recordingFile, pixelbuffer, width, height, stride);
+    if (coarseFactor > 1)
+        record_rows(recordingFile, coarse, cwidth, cheight, coarseStride);
+}
+
+void Analysis::record_field_buffer(const uint8_t* pixelbuffer, int width, int height) {
+    AnalysisRecord header = {};
+    header.magic = ANALYSIS_RECORD_MAGIC;
+    header.type = ANALYSIS_RECORD_FIELD;
+    header.coarseFactor = 1;
+    header.width = (uint16_t)width;
+    header.height = (uint16_t)height;
+    header.fps = clockFPS;
+    header.size = width * height;
+    fwrite(&header, sizeof(header), 1, recordingFile);
+    record_rows(recordingFile, pixelbuffer, width, height, width);
+}
+
+void analysis_set_clock(AnalysisClock clock) {
+    defaultAnalysis.set_clock(clock);
+}
+
+void analysis_set_recording(FILE* file) {
+    defaultAnalysis.set_recording(file);
+}
+
+int analysis_init() {
+#ifdef GENERATE_TIMESERIES
+    defaultAnalysis.open_timeseries("/tmp/timeseries.txt");
 #endif
+    event_channel_init("/tmp/foosballtrackerpipe.in");
+    return 1;
+}
+
+int analysis_term() {
+    event_channel_term();
     return 1;
 }
 
@@ -124,19 +216,36 @@ int getPlayerBar(POINT ball) {
     return (int)(1.0f + 8.0f * ball.x);
 }
 
-int playerBarFrameThreshold = 6;
+// The ball has to be near the same bar for this long before a goal
+constexpr float playerBarTime = 6.0f / 40.0f;
+
+// Durations were tuned as a number of frames at 40 fps.
+// This gives the number of frames at the current framerate.
+int Analysis::frames_for(float seconds) const {
+    int frames = int(seconds * clockFPS + 0.5f);
+    return (frames < 1 ? 1 : frames);
+}
 
 int barTeams[9] = {0, 1, 1, 2, 1, 2, 1, 2, 2};
 
+int analysis_player_bar(POINT ball) {
+    return getPlayerBar(ball);
+}
+
+int analysis_bar_team(int bar) {
+    return (bar > 0 && bar <= 8 ? barTeams[bar] : 0);
+}
+
 // team == 1 -> goal for red, scored by blue
 // team == 2 -> goal for blue, scored by red
-int getPlayerWhoScored(int team) {
+int Analysis::getPlayerWhoScored(int team) const {
     int curIdx = ballCur;
     int player = 0;
     int hits = 0;
+    int playerBarFrameThreshold = frames_for(playerBarTime);
 
     // Look back 2.5 seconds
-    int maxI = int(2.5f * stableFPS);
+    int maxI = int(2.5f * clockFPS);
     if (maxI > historyCount)
         maxI = historyCount;
     for(int i = 0; i < maxI; ++i) {
@@ -163,30 +272,108 @@ int getPlayerWhoScored(int team) {
     return 0;
 }
 
-int analysis_update(POINT ball, bool ballFound) {
+// Speed of the filtered ball in km/h
+float Analysis::filtered_speed() const {
+    POINT v = ballFilter.velocity();
+    // In meters per frame
+    float vx = v.x * fieldWidth;
+    float vy = v.y * fieldHeight;
+    return std::sqrt(vx * vx + vy * vy) * clockFPS * 3.6f;
+}
+
+// Returns 1 or 2 (like isInGoal) when the filtered ball
+// will cross that goal line within `frames` frames
+int Analysis::heading_into_goal(int frames) const {
+    POINT p = ballFilter.position();
+    POINT v = ballFilter.velocity();
+    float t;
+    int goal;
+    if (v.x < 0.0f) {
+        t = (0.0f - p.x) / v.x;
+        goal = 1;
+    } else if (v.x > 0.0f) {
+        t = (1.0f - p.x) / v.x;
+        goal = 2;
+    } else {
+        return 0;
+    }
+    if (t > (float)frames)
+        return 0;
+    if (t < 0.0f)
+        t = 0.0f;
+    float y = p.y + t * v.y;
+    if (y > 0.5f - 0.5f * goalHeight && y < 0.5f + 0.5f * goalHeight)
+        return goal;
+    return 0;
+}
+
+// Returns 1 or 2 (like isInGoal) when the extrapolated ball is behind that goal line
+int Analysis::crossed_goal_line() const {
+    POINT p = ballFilter.position();
+    if (p.y > 0.5f - 0.5f * goalHeight && p.y < 0.5f + 0.5f * goalHeight) {
+        if (p.x < 0.0f)
+            return 1;
+        else if (p.x > 1.0f)
+            return 2;
+    }
+    return 0;
+}
+
+void Analysis::send_goal(int goal) {
+    if (frameNumber - lastGOAL < int(1.5f * clockFPS)) // Check if the last goal was at least 1.5 seconds ago
+        return;
+    lastGOAL = frameNumber;
+    TRACE_INSTANT("goal");
+    int player = getPlayerWhoScored(goal);
+    char buffer[64];
+    if (goal == 1) {
+        printf("Goal for red scored by \"bar\" %d\n", player);
+        sprintf(buffer, "RG %d\n", player);
+    } else if (goal == 2) {
+        printf("Goal for blue scored by \"bar\" %d\n", player);
+        sprintf(buffer, "BG %d\n", player);
+    }
+    send_to_server(buffer);
+}
+
+// A shot has to be followed for a few frames before its direction is reliable
+constexpr float minSignalTime = 3.0f / 40.0f;
+// A goal is reported when the ball is gone for this long after it was near the goal
+constexpr float goalMissingTime = 15.0f / 40.0f;
+// ... or after this time when the ball was last seen going into the goal
+constexpr float fastGoalTime = 5.0f / 40.0f;
+
+int Analysis::update(POINT ball, bool ballFound) {
     ++frameNumber;
 
-    static int sendSAVE = 0;
-    static int sendFAST = 0;
-    static int lastGOAL = 0;
+    int minSignalFrames = frames_for(minSignalTime);
+    int goalMissingFrames = frames_for(goalMissingTime);
+    int fastGoalFrames = frames_for(fastGoalTime);
+
+    ballFilter.predict();
+    if (ballFound)
+        ballFilter.update(ball);
 
-    // Only send the signals if they do not get interrupted by a goal within 0.5 seconds
+    // Only send the signals if they do not get interrupted by a goal within 0.5 seconds,
+    // or earlier when the ball is seen again and it is not going into a goal
+    int signalDelay = int(0.5f * clockFPS);
+    bool noGoal = ballFound && ballFilter.has_velocity() && !heading_into_goal(signalDelay);
     if (sendSAVE) {
-        if (sendSAVE++ > int(0.5f * stableFPS)) {
-            analysis_send_to_server("SAVE\n");
+        if (sendSAVE++ > signalDelay || (sendSAVE > minSignalFrames && noGoal)) {
+            send_to_server("SAVE\n");
             sendSAVE = 0;
         }
     }
     if (sendFAST) {
-        if (sendFAST++ > int(0.5f * stableFPS)) {
-            analysis_send_to_server("FAST\n");
+        if (sendFAST++ > signalDelay || (sendFAST > minSignalFrames && noGoal)) {
+            send_to_server("FAST\n");
             sendFAST = 0;
         }
     }
 
     int prevIdx = (ballCur == 0 ? historyCount - 1 : ballCur - 1);
     if (ballFound) {
-        if (ballMissing >= 30 && ballMissing != 1000) {
+        if (ballMissing >= 2 * goalMissingFrames && ballMissing != 1000) {
             printf("Ball was gone for %d frames.\n", ballMissing);
         }
         ballMissing = 0;
@@ -196,15 +383,9 @@ int analysis_update(POINT ball, bool ballFound) {
         ++ballCur;
 
         // Check for fast shot to goal
-        // This point and previous points should be at most 2 frames apart
-        POINT prevBall = balls[prevIdx];
-        int frameDiffs = frameNumber - ballFrames[prevIdx];
-        if (frameDiffs <= 10 && frameNumber > 100) {
-            float ballDist = dist(prevBall, ball);
-            float ballSpeed = ballDist * stableFPS / float(frameDiffs);
-            // ballDist is in meters
-            ballSpeed *= 3.6f;
-            // ballSpeed is in km/h
+        // The filter needs at least two recent points for the speed
+        if (ballFilter.has_velocity() && frameNumber > 100) {
+            float ballSpeed = filtered_speed(); // km/h
 
             ballSpeeds[ballSpeedIndex] = ballSpeed;
             ++ballSpeedIndex;
@@ -233,36 +414,43 @@ int analysis_update(POINT ball, bool ballFound) {
         }
 
     } else {
-        ballSpeeds[ballSpeedIndex] = 0.0f;
+        // During short dropouts the filter still has the speed
+        ballSpeeds[ballSpeedIndex] = (ballFilter.has_velocity() ? filtered_speed() : 0.0f);
         ++ballSpeedIndex;
         if (ballSpeedIndex == BallSpeedCount)
             ballSpeedIndex = 0;
 
-        if (ballMissing++ == 15) {
-            int goal = isInGoal(balls[prevIdx]);
-            if (goal) {
-                sendSAVE = 0; // Dont send a potential SAVE
-                sendFAST = 0;
-                if (frameNumber - lastGOAL >= int(1.5f * stableFPS)) { // Check if the last goal was at least 1.5 seconds ago
-                    lastGOAL = frameNumber;
-                    int player = getPlayerWhoScored(goal);
-                    char buffer[64];
-                    if (goal == 1) {
-                        printf("Goal for red scored by \"bar\" %d\n", player);
-                        sprintf(buffer, "RG %d\n", player);
-                    } else if (goal == 2) {
-                        printf("Goal for blue scored by \"bar\" %d\n", player);
-                        sprintf(buffer, "BG %d\n", player);
-                    }
-                    analysis_send_to_server(buffer);
-                }
-            }
+        // A short dropout, for example the ball behind a player, is
+        // interpolated by the filter while it still tracks the ball and its
+        // extrapolated position is on the field. Only after that the
+        // frames count as missing, for the goal check below.
+        POINT predicted = ballFilter.position();
+        bool interpolated = ballFilter.tracking() && predicted.x >= 0.0f && predicted.x <= 1.0f;
+        int missing = (interpolated ? -1 : ballMissing++);
+        int goal = 0;
+        if (missing == goalMissingFrames) {
+            goal = isInGoal(balls[prevIdx]);
+        } else if (ballFilter.frames_missing() == fastGoalFrames + 1) {
+            // The ball was last seen near the goal and its
+            // extrapolated position is now behind the goal line.
+            // This counts from the last detection, because an
+            // interpolated ball can not be behind the goal line.
+            goal = isInGoal(balls[prevIdx]);
+            if (goal != crossed_goal_line())
+                goal = 0;
+        }
+        if (goal) {
+            sendSAVE = 0; // Dont send a potential SAVE
+            sendFAST = 0;
+            send_goal(goal);
         }
     }
 
-    if (frameNumber > 100 && ballSpeedFramesSinceLastUpdate > int(0.5f * stableFPS)) {
+    if (frameNumber > 100 && ballSpeedFramesSinceLastUpdate > int(0.5f * clockFPS)) {
         // Only look at the last 5 seconds
-        int numFrames = int(5.0f * stableFPS);
+        int numFrames = int(5.0f * clockFPS);
+        if (numFrames > BallSpeedCount)
+            numFrames = BallSpeedCount;
         float max = 0.0f;
         for (int i = ballSpeedIndex - numFrames; i < ballSpeedIndex; ++i) {
             int idx = (i < 0 ? i + BallSpeedCount : i);
@@ -278,6 +466,7 @@ int analysis_update(POINT ball, bool ballFound) {
     return 1;
 }
 
+#ifndef CPU_PIPELINE
 // From BalltrackCore
 void draw_square(float xmin, float xmax, float ymin, float ymax, uint32_t color);
 void draw_line_strip(POINT* xys, int count, uint32_t color);
@@ -286,7 +475,7 @@ void draw_line_strip(POINT* xys, int count, uint32_t color);
 // whereas the update function is called from a separate thread
 // The `field` and `ballsScreen` are not yet properly protected
 // from threading issues
-int analysis_draw() {
+int Analysis::draw() {
     // Draw `player bar regions`
     // (#bar - 1)/8 <= (x+1)/2 < #bar / 8
     for (int bar = 1; bar < 8; ++bar) {
@@ -338,61 +527,280 @@ int analysis_draw() {
     return 1;
 }
 
-// This runs in thread separate from the GL thread
-int analysis_process_ball_buffer(uint8_t* pixelbuffer, int width, int height) {
-    int fieldxmin = (int)(0.5f * (1.0f + field.xmin) * (float)width - 1.5f);
-    int fieldxmax = (int)(0.5f * (1.0f + field.xmax) * (float)width + 1.5f);
-    int fieldymin = (int)(0.5f * (1.0f + field.ymin) * (float)height - 1.5f);
-    int fieldymax = (int)(0.5f * (1.0f + field.ymax) * (float)height + 1.5f);
+int analysis_draw() {
+    return defaultAnalysis.draw();
+}
+#endif
 
-    // TODO: BLUR ?
+//
+// ROI tracking
+// While the ball is being tracked, its next position is predicted with
+// the ball filter and only a window around it is searched.
+//
+// Half the size of the window in screen coordinates, about 100 pixels
+// of the 1280x720 source. It grows with the ball speed, with the
+// uncertainty of the filter and with the number of frames that is predicted ahead.
+constexpr float roiMarginX = 0.15f;
+constexpr float roiMarginY = 0.25f;
+constexpr float roiSpeedMargin = 1.5f;
+
+void analysis_set_roi_tracking(int enabled) {
+    defaultAnalysis.set_roi_tracking(enabled != 0);
+}
 
-    // Find the max orange intensity
-    int maxx = 0, maxy = 0;
-    uint32_t maxValue = 0;
-    uint8_t* ptr = pixelbuffer;
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            uint32_t value = (uint32_t) *ptr++;
+void roi_to_pixels(const ROI& roi, int width, int height, int* x0, int* y0, int* x1, int* y1) {
+    auto clamp = [](int i, int size) { return (i < 0 ? 0 : (i > size ? size : i)); };
+    *x0 = clamp((int)std::floor(0.5f * (1.0f + roi.xmin) * (float)width), width);
+    *x1 = clamp((int)std::ceil(0.5f * (1.0f + roi.xmax) * (float)width), width);
+    *y0 = clamp((int)std::floor(0.5f * (1.0f + roi.ymin) * (float)height), height);
+    *y1 = clamp((int)std::ceil(0.5f * (1.0f + roi.ymax) * (float)height), height);
+}
 
-            if ( y < fieldymin || y > fieldymax ) continue;
-            if ( x < fieldxmin || x > fieldxmax ) continue;
-            if (value > maxValue) {
-                maxx = x;
-                maxy = y;
-                maxValue = value;
-            }
-        }
+// Called after analysis_update
+// Only predict when the ball was seen in this frame, when it was missing
+// the window can be anywhere so the full frame is processed
+void Analysis::update_prediction() {
+    BallPrediction p;
+    p.valid = (ballFilter.tracking() && ballFilter.frames_missing() == 0);
+    p.filter = ballFilter;
+    p.field = field;
+    std::lock_guard<std::mutex> lock(predictionMutex);
+    prediction = p;
+}
+
+int Analysis::predict_window(ROI* roi, int framesAhead) {
+    if (!roiTracking)
+        return 0;
+    BallPrediction p;
+    {
+        std::lock_guard<std::mutex> lock(predictionMutex);
+        p = prediction;
     }
+    if (!p.valid)
+        return 0;
+
+    // From field coordinates to screen coordinates
+    float scalex = p.field.xmax - p.field.xmin;
+    float scaley = p.field.ymax - p.field.ymin;
+    POINT pos = p.filter.position_at(framesAhead);
+    POINT vel = p.filter.velocity();
+    POINT var = p.filter.variance_at(framesAhead);
+    float x = p.field.xmin + scalex * pos.x;
+    float y = p.field.ymin + scaley * pos.y;
+    float rx = roiMarginX + scalex * (roiSpeedMargin * (float)framesAhead * std::fabs(vel.x) + 3.0f * std::sqrt(var.x));
+    float ry = roiMarginY + scaley * (roiSpeedMargin * (float)framesAhead * std::fabs(vel.y) + 3.0f * std::sqrt(var.y));
+    roi->xmin = x - rx;
+    roi->xmax = x + rx;
+    roi->ymin = y - ry;
+    roi->ymax = y + ry;
+
+    // The ball is only searched inside the field,
+    // with some margin because the ball can be partly outside of it.
+    // This uses the field of the snapshot, not the one that the
+    // analysis thread might be updating.
+    const float margin = 0.05f;
+    if (roi->xmin < p.field.xmin - margin) roi->xmin = p.field.xmin - margin;
+    if (roi->xmax > p.field.xmax + margin) roi->xmax = p.field.xmax + margin;
+    if (roi->ymin < p.field.ymin - margin) roi->ymin = p.field.ymin - margin;
+    if (roi->ymax > p.field.ymax + margin) roi->ymax = p.field.ymax + margin;
+    return (roi->xmin < roi->xmax && roi->ymin < roi->ymax);
+}
+
+int Analysis::predict_roi(ROI* roi, int framesAhead) {
+    return predict_window(roi, framesAhead);
+}
+
+int analysis_predict_roi(ROI* roi, int framesAhead) {
+    return defaultAnalysis.predict_roi(roi, framesAhead);
+}
+
+// Maximum of a row of pixels, using NEON or SSE2 when available
+static inline uint32_t row_max(const uint8_t* row, int count) {
+    int x = 0;
+    uint32_t result = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (count >= 16) {
+        uint8x16_t m = vdupq_n_u8(0);
+        for (; x + 16 <= count; x += 16)
+            m = vmaxq_u8(m, vld1q_u8(row + x));
+        uint8x8_t r = vmax_u8(vget_low_u8(m), vget_high_u8(m));
+        r = vpmax_u8(r, r);
+        r = vpmax_u8(r, r);
+        r = vpmax_u8(r, r);
+        result = vget_lane_u8(r, 0);
+    }
+#elif defined(__SSE2__)
+    if (count >= 16) {
+        __m128i m = _mm_setzero_si128();
+        for (; x + 16 <= count; x += 16)
+            m = _mm_max_epu8(m, _mm_loadu_si128((const __m128i*)(row + x)));
+        m = _mm_max_epu8(m, _mm_srli_si128(m, 8));
+        m = _mm_max_epu8(m, _mm_srli_si128(m, 4));
+        m = _mm_max_epu8(m, _mm_srli_si128(m, 2));
+        m = _mm_max_epu8(m, _mm_srli_si128(m, 1));
+        result = (uint32_t)(_mm_cvtsi128_si32(m) & 0xff);
+    }
+#endif
+    for (; x < count; ++x)
+        if (row[x] > result)
+            result = row[x];
+    return result;
+}
 
-    // Take weighted average near the maximum
+// The max orange intensity in the pixels [xbegin,xend)x[ybegin,yend)
+// and the weighted sums of the window around it
+struct BallSearch {
+    int maxx = 0, maxy = 0;
+    uint32_t maxValue = 0;
     int avgx = 0, avgy = 0;
     int weight = 0;
-    ptr = pixelbuffer;
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            uint32_t value = (uint32_t) *ptr++;
-            if (y < maxy - 5 || y > maxy + 5) continue;
-            if (x < maxx - 5 || x > maxx + 5) continue;
-            avgx += x * value;
-            avgy += y * value;
-            weight += value;
+};
+
+// `stride` is the number of bytes from one row to the next
+static void find_max(const uint8_t* pixelbuffer, int stride,
+                     int xbegin, int xend, int ybegin, int yend, BallSearch* s) {
+    // For every row the maximum is computed first, and only when it beats
+    // the current maximum we look up its (first) position in the row.
+    for (int y = ybegin; y < yend && xbegin < xend; ++y) {
+        const uint8_t* row = pixelbuffer + y * stride + xbegin;
+        uint32_t value = row_max(row, xend - xbegin);
+        if (value > s->maxValue) {
+            int x = 0;
+            while (row[x] != value)
+                ++x;
+            s->maxx = xbegin + x;
+            s->maxy = y;
+            s->maxValue = value;
         }
     }
+}
 
-    // avgx, avgy are the bottom-left corner of the macropixels
-    // Shift them by half a pixel to fix
-    float x = 0.5f + (((float)avgx) / ((float)weight));
-    float y = 0.5f + (((float)avgy) / ((float)weight));
+static BallSearch search_ball(const uint8_t* pixelbuffer, int stride, int width, int height,
+                              int xbegin, int xend, int ybegin, int yend, int radius) {
+    BallSearch s;
+    find_max(pixelbuffer, stride, xbegin, xend, ybegin, yend, &s);
+
+    // Take weighted average near the maximum, in the window of
+    // (2*radius+1)^2 pixels around it (this can go outside of the search area)
+    // Every row sum is added once for the y-coordinate
+    int wxbegin = (s.maxx - radius < 0 ? 0 : s.maxx - radius);
+    int wxend = (s.maxx + radius >= width ? width : s.maxx + radius + 1);
+    int wybegin = (s.maxy - radius < 0 ? 0 : s.maxy - radius);
+    int wyend = (s.maxy + radius >= height ? height : s.maxy + radius + 1);
+    for (int y = wybegin; y < wyend; ++y) {
+        const uint8_t* row = pixelbuffer + y * stride;
+        int rowSum = 0;
+        for (int x = wxbegin; x < wxend; ++x) {
+            uint32_t value = (uint32_t) row[x];
+            s.avgx += x * value;
+            rowSum += value;
+        }
+        s.avgy += y * rowSum;
+        s.weight += rowSum;
+    }
+    return s;
+}
 
-    // Total should be at least T pixels (where T is taken from neural network)
-    // But it was first averaged over 8x8 = 64 pixels
-    // And that is rescaled to the 256 range
-    // So (T/64) * 255 ~= threshold2
+// Same, but the maximum is first found in the `factor` times smaller
+// `coarse` level, and then only the ball buffer pixels of that coarse pixel
+// and its neighbours are searched, since the ball can be on the border of two.
+static BallSearch search_ball(const uint8_t* pixelbuffer, int stride, int width, int height,
+                              const uint8_t* coarse, int coarseStride, int factor,
+                              int xbegin, int xend, int ybegin, int yend, int radius) {
+    if (!coarse || factor == 1)
+        return search_ball(pixelbuffer, stride, width, height, xbegin, xend, ybegin, yend, radius);
+
+    int cwidth = width / factor;
+    int cheight = height / factor;
+    int cxend = (xend + factor - 1) / factor;
+    int cyend = (yend + factor - 1) / factor;
+    BallSearch c;
+    find_max(coarse, coarseStride, xbegin / factor, (cxend < cwidth ? cxend : cwidth),
+             ybegin / factor, (cyend < cheight ? cyend : cheight), &c);
+    int x0 = (c.maxx - 1) * factor;
+    int x1 = (c.maxx + 2) * factor;
+    int y0 = (c.maxy - 1) * factor;
+    int y1 = (c.maxy + 2) * factor;
+    return search_ball(pixelbuffer, stride, width, height,
+                       (x0 > xbegin ? x0 : xbegin), (x1 < xend ? x1 : xend),
+                       (y0 > ybegin ? y0 : ybegin), (y1 < yend ? y1 : yend), radius);
+}
 
-    int threshold1 = 100; // The max pixel should be at least this
-    int threshold2 = 270; // The total in the neighborhood should be at least this
-    bool ballFound = maxValue > threshold1 && weight > threshold2;
+// Total should be at least T pixels (where T is taken from neural network)
+// But it was first averaged over 8x8 = 64 pixels
+// And that is rescaled to the 256 range
+// So (T/64) * 255 ~= threshold2
+// These are for a ball buffer of 160 macropixels wide (BIGTEX with 8x8 averages),
+// with an 11x11 window. In other sizes the ball covers (width/160)^2 times as
+// many macropixels, so threshold2 and the window are scaled with that.
+constexpr uint32_t threshold1 = 100; // The max pixel should be at least this
+constexpr int threshold2 = 270; // The total in the neighborhood should be at least this
+constexpr int thresholdWidth = 160;
+constexpr int windowRadius = 5;
+
+static bool is_ball(const BallSearch& s, int minWeight) {
+    return s.maxValue > threshold1 && s.weight > minWeight;
+}
+
+// Ball position for the live stream of the web interface
+// Sent for every frame while the filter tracks the ball, and once when it is lost
+void Analysis::send_ball_event(bool ballFound, float confidence) {
+    bool tracking = ballFilter.tracking();
+    if (!tracking && !wasTracking)
+        return;
+    wasTracking = tracking;
+
+    EventBall e;
+    POINT p = ballFilter.position();
+    e.x = p.x;
+    e.y = p.y;
+    e.confidence = 0.0f;
+    if (!tracking) {
+        e.state = BALL_LOST;
+    } else if (ballFound) {
+        e.state = BALL_MEASURED;
+        e.confidence = (confidence > 1.0f ? 1.0f : confidence);
+    } else {
+        e.state = BALL_EXTRAPOLATED;
+    }
+    memset(e.reserved, 0, sizeof(e.reserved));
+    send_event(EVENT_BALL, &e, sizeof(e));
+}
+
+void Analysis::ball_search_area(int width, int height, int* xbegin, int* xend, int* ybegin, int* yend) const {
+    int fieldxmin = (int)(0.5f * (1.0f + field.xmin) * (float)width - 1.5f);
+    int fieldxmax = (int)(0.5f * (1.0f + field.xmax) * (float)width + 1.5f);
+    int fieldymin = (int)(0.5f * (1.0f + field.ymin) * (float)height - 1.5f);
+    int fieldymax = (int)(0.5f * (1.0f + field.ymax) * (float)height + 1.5f);
+
+    // Only the rows and columns inside the field are searched
+    *xbegin = (fieldxmin < 0 ? 0 : fieldxmin);
+    *xend = (fieldxmax >= width ? width : fieldxmax + 1);
+    *ybegin = (fieldymin < 0 ? 0 : fieldymin);
+    *yend = (fieldymax >= height ? height : fieldymax + 1);
+}
+
+void analysis_ball_search_area(int width, int height, int* xbegin, int* xend, int* ybegin, int* yend) {
+    defaultAnalysis.ball_search_area(width, height, xbegin, xend, ybegin, yend);
+}
+
+int analysis_ball_window_radius(int width) {
+    float scale = (float)width / (float)thresholdWidth;
+    int radius = (int)((float)windowRadius * scale + 0.5f);
+    return (radius < 2 ? 2 : radius);
+}
+
+static int min_ball_weight(int width) {
+    float scale = (float)width / (float)thresholdWidth;
+    return (int)((float)threshold2 * scale * scale);
+}
+
+// The rest of the analysis, for a ball at macropixel x,y (from the
+// bottom-left corner of the buffer, not the center of the macropixel)
+void Analysis::process_ball_position(float x, float y, bool ballFound, int weight, int width, int height) {
+    // Shift by half a pixel to get the center
+    x += 0.5f;
+    y += 0.5f;
 
     POINT ball;
     // First map to [-1,1] screen coordinate range and save it
@@ -405,14 +813,88 @@ int analysis_process_ball_buffer(uint8_t* pixelbuffer, int width, int height) {
     ball.x = (ball.x - field.xmin) / (field.xmax - field.xmin);
     ball.y = (ball.y - field.ymin) / (field.ymax - field.ymin);
 
-    analysis_update(ball, ballFound);
+    ballFilter.configure(clockFPS, width);
+    update(ball, ballFound);
+    update_prediction();
+    // Four times the threshold is a clearly visible ball
+    send_ball_event(ballFound, (float)weight / (4.0f * (float)min_ball_weight(width)));
+}
+
+// This runs in thread separate from the GL thread
+int Analysis::process_ball_buffer(uint8_t* pixelbuffer, int width, int height,
+                                  const uint8_t* coarse, int coarseFactor,
+                                  int stride, int coarseStride) {
+    if (stride == 0)
+        stride = width;
+    if (coarseStride == 0)
+        coarseStride = width / coarseFactor;
+
+    read_clock();
+    if (recordingFile)
+        record_ball_buffer(pixelbuffer, width, height, stride, coarse, coarseFactor, coarseStride);
+
+    // TODO: BLUR ?
+
+    int xbegin, xend, ybegin, yend;
+    ball_search_area(width, height, &xbegin, &xend, &ybegin, &yend);
+    int minWeight = min_ball_weight(width);
+    int radius = analysis_ball_window_radius(width);
+
+    // While tracking, first look near the predicted position.
+    // If the ball is not there, scan the full field.
+    BallSearch search;
+    bool ballFound = false;
+    ROI roi;
+    if (predict_window(&roi, 1)) {
+        int x0, y0, x1, y1;
+        roi_to_pixels(roi, width, height, &x0, &y0, &x1, &y1);
+        search = search_ball(pixelbuffer, stride, width, height, coarse, coarseStride, coarseFactor,
+                             (x0 > xbegin ? x0 : xbegin), (x1 < xend ? x1 : xend),
+                             (y0 > ybegin ? y0 : ybegin), (y1 < yend ? y1 : yend), radius);
+        ballFound = is_ball(search, minWeight);
+    }
+    if (!ballFound) {
+        search = search_ball(pixelbuffer, stride, width, height, coarse, coarseStride, coarseFactor,
+                             xbegin, xend, ybegin, yend, radius);
+        ballFound = is_ball(search, minWeight);
+    }
+
+    // avgx, avgy are the bottom-left corner of the macropixels
+    float x = ((float)search.avgx) / ((float)search.weight);
+    float y = ((float)search.avgy) / ((float)search.weight);
+    process_ball_position(x, y, ballFound, search.weight, width, height);
     return 0;
 }
 
-std::vector<int> xSums, ySums;
+int analysis_process_ball_buffer(uint8_t* pixelbuffer, int width, int height,
+                                 const uint8_t* coarse, int coarseFactor,
+                                 int stride, int coarseStride) {
+    return defaultAnalysis.process_ball_buffer(pixelbuffer, width, height, coarse, coarseFactor, stride, coarseStride);
+}
 
 // This runs in thread separate from the GL thread
-int analysis_process_field_buffer(uint8_t* pixelbuffer, int width, int height) {
+int Analysis::process_ball_result(const uint8_t* result, int width, int height) {
+    read_clock();
+    // See ballcentroid.frag for the layout
+    BallSearch search;
+    search.maxValue = result[4];
+    search.weight = result[5] | (result[6] << 8) | (result[7] << 16);
+    bool ballFound = is_ball(search, min_ball_weight(width));
+    float x = (1.0f / 32.0f) * (float)(result[0] | (result[1] << 8));
+    float y = (1.0f / 32.0f) * (float)(result[2] | (result[3] << 8));
+    process_ball_position(x, y, ballFound, search.weight, width, height);
+    return 0;
+}
+
+int analysis_process_ball_result(const uint8_t* result, int width, int height) {
+    return defaultAnalysis.process_ball_result(result, width, height);
+}
+
+// This runs in thread separate from the GL thread
+int Analysis::process_field_buffer(uint8_t* pixelbuffer, int width, int height) {
+    if (recordingFile)
+        record_field_buffer(pixelbuffer, width, height);
+
     // Row and column sums
     xSums.resize(height);
     ySums.resize(width);
@@ -435,6 +917,15 @@ int analysis_process_field_buffer(uint8_t* pixelbuffer, int width, int height) {
         }
     }
 
+    return process_field_sums(width, height, totalValue);
+}
+
+int analysis_process_field_buffer(uint8_t* pixelbuffer, int width, int height) {
+    return defaultAnalysis.process_field_buffer(pixelbuffer, width, height);
+}
+
+// Row sums in xSums, column sums in ySums
+int Analysis::process_field_sums(int width, int height, int totalValue) {
     // The shape of the row sums is something like
     //
     //     ______
@@ -572,3 +1063,30 @@ int analysis_process_field_buffer(uint8_t* pixelbuffer, int width, int height) {
 
     return 0;
 }
+
+// This runs in thread separate from the GL thread
+int Analysis::process_field_result(const uint8_t* result, int width, int height) {
+    // Two rows of max(width, height) texels, see fieldsums.frag
+    int resultWidth = (width > height ? width : height);
+    const uint8_t* columns = result;
+    const uint8_t* rows = result + 4 * resultWidth;
+
+    xSums.resize(height);
+    ySums.resize(width);
+    int totalValue = 0;
+    for (int y = 0; y < height; ++y) {
+        xSums[y] = rows[0] | (rows[1] << 8) | (rows[2] << 16);
+        totalValue += xSums[y];
+        rows += 4;
+    }
+    for (int x = 0; x < width; ++x) {
+        ySums[x] = columns[0] | (columns[1] << 8) | (columns[2] << 16);
+        columns += 4;
+    }
+
+    return process_field_sums(width, height, totalValue);
+}
+
+int analysis_process_field_result(const uint8_t* result, int width, int height) {
+    return defaultAnalysis.process_field_result(result, width, height);
+}
@@ -1,32 +1,232 @@
 #pragma once
 
+#include "ballfilter.h"
+#include "eventchannel.h"
+#include "geometry.h"
+#include <atomic>
 #include <cstdint> // for uint8_t
+#include <cstdio>  // for FILE
+#include <fstream>
+#include <mutex>
+#include <vector>
 
-// Field is given in screen coordinates; [-1,1]x[-1,1] range, the OpenGL standard
-struct FIELD {
-    float xmin;
-    float xmax;
-    float ymin;
-    float ymax;
+// The pixels [x0,x1)x[y0,y1) of a width x height texture that cover the ROI
+void roi_to_pixels(const ROI& roi, int width, int height, int* x0, int* y0, int* x1, int* y1);
 
-    FIELD() : xmin(-0.9f), xmax(0.9f), ymin(-0.9f), ymax(0.9f) {};
+// The framerate with which durations in seconds are converted to frames.
+// It is read once per analysed frame, on the analysis thread. The GPU
+// version gives the measured render framerate, the CPU version the one of
+// balltrack_core_set_fps. Without a clock it is 40 fps. A replay can give
+// the framerate of the recording, so its result does not depend on timing.
+typedef float (*AnalysisClock)();
+void analysis_set_clock(AnalysisClock clock);
+
+// Recording of the input of analysis_process_ball_buffer and
+// analysis_process_field_buffer, to run the analysis on it again later
+// (see src/regress/trackregress.cpp). The file is a sequence of records:
+// an AnalysisRecord followed by `size` bytes, the buffer without stride,
+// and for the ball buffer the coarse level right after it.
+// The _result versions, with the search on the GPU, are not recorded.
+constexpr uint32_t ANALYSIS_RECORD_MAGIC = 0x43524246; // "FBRC"
+enum AnalysisRecordType : uint8_t {
+    ANALYSIS_RECORD_BALL = 1,
+    ANALYSIS_RECORD_FIELD = 2,
+};
+struct AnalysisRecord {
+    uint32_t magic;
+    uint8_t type;         // AnalysisRecordType
+    uint8_t coarseFactor; // 1 when there is no coarse level
+    uint16_t width;       // In macropixels
+    uint16_t height;
+    uint16_t reserved;
+    float fps;            // Of the clock at this frame
+    uint32_t size;
 };
+static_assert(sizeof(AnalysisRecord) == 20, "AnalysisRecord has to be packed");
+
+//
+// The analysis of one camera or recording: the field, the ball history and
+// filter, and the events that are sent for them.
+// All of the state is in here, so several of them can run in one process,
+// each on its own thread (see Tracker in tracker.h for the CPU pipeline).
+// The process_ functions and the setters are called from one thread, the
+// analysis thread. predict_roi and set_roi_tracking may be called
+// from another one.
+// The analysis_ functions below use a default instance, for the
+// single camera of the GPU pipeline.
+//
+class Analysis {
+  public:
+    Analysis();
+
+    // Without a clock, the framerate is the one of set_fps, default 40
+    void set_clock(AnalysisClock clock);
+    void set_fps(float fps);
+
+    // See analysis_set_recording
+    void set_recording(FILE* file);
+
+    // Give the events of this analysis to `sink` instead of the event
+    // channel, see event_channel_set_sink. 0 goes back to the channel.
+    void set_event_sink(EventSink sink, void* context);
+
+    void set_roi_tracking(bool enabled) { roiTracking = enabled; }
+    // See analysis_predict_roi
+    int predict_roi(ROI* roi, int framesAhead);
+
+    // See the analysis_process_ functions
+    int process_field_buffer(uint8_t* pixelbuffer, int width, int height);
+    int process_field_result(const uint8_t* result, int width, int height);
+    int process_ball_buffer(uint8_t* pixelbuffer, int width, int height,
+                            const uint8_t* coarse = 0, int coarseFactor = 1,
+                            int stride = 0, int coarseStride = 0);
+    int process_ball_result(const uint8_t* result, int width, int height);
+
+    // See analysis_ball_search_area
+    void ball_search_area(int width, int height, int* xbegin, int* xend, int* ybegin, int* yend) const;
+
+    // Number of analysed ball frames
+    int frame_number() const { return frameNumber; }
+
+    // Writes the ball positions to `filename` (GENERATE_TIMESERIES)
+    void open_timeseries(const char* filename);
+
+#ifndef CPU_PIPELINE
+    int draw();
+#endif
+
+  private:
+    // Ball history, 2.5 seconds at 200 fps
+    static constexpr int historyCount = 512;
+    // Ball speeds of 5 seconds at up to 200 fps
+    static constexpr int BallSpeedCount = 5 * 200;
+
+    // Copy of the ball filter at the last analysed frame
+    // Written by the analysis thread, read by predict_roi
+    struct BallPrediction {
+        bool valid = false;
+        BallFilter filter;
+        FIELD field;
+    };
+
+    void read_clock();
+    int frames_for(float seconds) const;
+    void record_ball_buffer(const uint8_t* pixelbuffer, int width, int height, int stride,
+                            const uint8_t* coarse, int coarseFactor, int coarseStride);
+    void record_field_buffer(const uint8_t* pixelbuffer, int width, int height);
 
-// All ball positions are given in field coordinates in [0,1]x[0,1] range, normalized by the green field size
-// So (0,y) is at the left edge of the field and (1,y) is at the right edge of the field.
+    void send_event(EventType type, const void* payload, int size);
+    int send_to_server(const char* str);
+    void sendMaxSpeed(float speed);
+    void send_goal(int goal);
+    void send_ball_event(bool ballFound, float confidence);
 
-struct POINT {
-    float x;
-    float y;
+    int getPlayerWhoScored(int team) const;
+    float filtered_speed() const;
+    int heading_into_goal(int frames) const;
+    int crossed_goal_line() const;
+    int update(POINT ball, bool ballFound);
+    void update_prediction();
+    int predict_window(ROI* roi, int framesAhead);
+    void process_ball_position(float x, float y, bool ballFound, int weight, int width, int height);
+    int process_field_sums(int width, int height, int totalValue);
+
+    POINT balls[historyCount]; // in [0,1]x[0,1] field coordinates
+    int ballFrames[historyCount];
+    POINT ballsScreen[historyCount]; // in [-1,1]x[-1,1] screen coordinates
+    int ballCur = 0;
+    int ballMissing = 1000; // Frames without the ball, after the filter stopped interpolating
+
+    // Smoothed ball position and velocity, in field coordinates
+    BallFilter ballFilter;
+
+    FIELD field;
+    int frameNumber = 0;
+
+    // The framerate for durations, read once per analysed frame so that
+    // it does not change in the middle of one
+    AnalysisClock analysisClock = 0;
+    float clockFPS = 40.0f;
+
+    FILE* recordingFile = 0;
+    std::ofstream timeseriesfile;
+    EventSink eventSink = 0;
+    void* eventSinkContext = 0;
+
+    float ballSpeeds[BallSpeedCount];
+    int ballSpeedIndex = 0;
+    int ballSpeedFramesSinceLastUpdate = 0; // To prevent flooding the server
+
+    // Frames since a SAVE or FAST signal was found, 0 when there is none
+    int sendSAVE = 0;
+    int sendFAST = 0;
+    int lastGOAL = 0;
+    bool wasTracking = false; // For the ball events
+
+    std::atomic<bool> roiTracking; // Set from any thread
+    BallPrediction prediction;
+    std::mutex predictionMutex;
+
+    std::vector<int> xSums, ySums;
 };
 
+// The instance that the analysis_ functions use
+Analysis* analysis_default();
+
+// Start writing records to `file`, or stop with 0. The file is not closed.
+// Call this from the analysis thread, or before it is started.
+void analysis_set_recording(FILE* file);
+
 // Called from GL thread
+// Opens the event channel
 int analysis_init();
+int analysis_term();
+
+// Called from GL thread
+// Window around the predicted ball position, `framesAhead` frames after the
+// last analysed frame. Returns 0 when the full frame has to be processed:
+// when ROI tracking is disabled or when the ball is not being tracked.
+int analysis_predict_roi(ROI* roi, int framesAhead);
+void analysis_set_roi_tracking(int enabled);
 
 // Called from separate analysis thread
 int analysis_process_field_buffer(uint8_t* pixelbuffer, int width, int height);
-int analysis_process_ball_buffer(uint8_t* pixelbuffer, int width, int height);
+// Same, but with the row and column sums that were computed on the GPU,
+// see fieldsums.frag. width x height is the field buffer size in macropixels.
+int analysis_process_field_result(const uint8_t* result, int width, int height);
+// The ball buffer has one byte per macropixel, width x height of them.
+// `coarse` is the last level of the downsample pyramid, `coarseFactor`
+// times smaller in both directions. The ball is searched there first and
+// then measured in the ball buffer around it. Without it, the complete
+// ball buffer is searched.
+// `stride` and `coarseStride` are the number of bytes from one row to the
+// next, for buffers that are part of a larger one. 0 means `width` and
+// `width / coarseFactor`.
+int analysis_process_ball_buffer(uint8_t* pixelbuffer, int width, int height,
+                                 const uint8_t* coarse = 0, int coarseFactor = 1,
+                                 int stride = 0, int coarseStride = 0);
+// Same, but the ball was already searched on the GPU, see ballcentroid.frag
+// `result` is the 8 bytes of that, and width x height the ball buffer size.
+int analysis_process_ball_result(const uint8_t* result, int width, int height);
+
+// Called from the analysis thread, or from the GL thread when the
+// analysis runs on the GPU
+// The macropixels [xbegin,xend)x[ybegin,yend) of a width x height
+// ball buffer where the ball is searched: the field with a small margin
+void analysis_ball_search_area(int width, int height, int* xbegin, int* xend, int* ybegin, int* yend);
+// The ball position is the weighted average of the macropixels up to
+// this distance from the brightest one
+int analysis_ball_window_radius(int width);
+
+// Called from any thread
+// The player bar at a ball position in field coordinates, from 1 (blue
+// keeper) to 8 (red keeper), or 0 when it is outside the field
+int analysis_player_bar(POINT ball);
+// The team of a player bar: 1 for blue, 2 for red and 0 for no bar
+int analysis_bar_team(int bar);
 
+#ifndef CPU_PIPELINE
 // Called from GL thread
 int analysis_draw();
+#endif
 
@@ -0,0 +1,126 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#include "ballfilter.h"
+
+// All in field coordinates, per frame, at 40 fps and 160 macropixels
+// One macropixel of the ball buffer is about 1/128 of the field width
+// and the detection is accurate to about half a macropixel.
+constexpr float measurementVariance = 3e-5f;
+// Random acceleration of the ball per frame
+constexpr float accelerationVariance = 1e-5f;
+// Velocity variance when there is only one measurement:
+// the ball can move up to ~0.1 field widths per frame
+constexpr float unknownVelocityVariance = 1e-2f;
+// Measurements further away than this (squared, in standard deviations,
+// summed over x and y) restart the filter
+constexpr float gateDistance = 16.0f;
+// How long the position is extrapolated without measurements
+constexpr float maxCoastTime = 3.0f / 40.0f;
+
+void BallFilter::configure(float fps, int bufferWidth) {
+    // The velocity in field units per frame scales with 1/fps, and a
+    // random acceleration adds a velocity variance that scales with 1/fps^3
+    float t = 40.0f / fps;
+    float m = 160.0f / (float)bufferWidth;
+    noise.measurementVariance = measurementVariance * m * m;
+    noise.accelerationVariance = accelerationVariance * t * t * t;
+    noise.unknownVelocityVariance = unknownVelocityVariance * t * t;
+    maxCoastFrames = (int)(maxCoastTime * fps + 0.5f);
+    if (maxCoastFrames < 1)
+        maxCoastFrames = 1;
+}
+
+void BallFilter::Axis::init(float z, float v, const Noise& noise) {
+    pos = z;
+    vel = v;
+    P00 = noise.measurementVariance;
+    P01 = 0.0f;
+    P11 = (v == 0.0f ? noise.unknownVelocityVariance
+                     : 2.0f * noise.measurementVariance + noise.accelerationVariance);
+}
+
+// pos += vel, with a random acceleration
+void BallFilter::Axis::predict(const Noise& noise) {
+    pos += vel;
+    P00 += 2.0f * P01 + P11 + 0.25f * noise.accelerationVariance;
+    P01 += P11 + 0.5f * noise.accelerationVariance;
+    P11 += noise.accelerationVariance;
+}
+
+void BallFilter::Axis::update(float z, const Noise& noise) {
+    float S = innovation_variance(noise);
+    float K0 = P00 / S;
+    float K1 = P01 / S;
+    float innovation = z - pos;
+    pos += K0 * innovation;
+    vel += K1 * innovation;
+    P11 -= K1 * P01;
+    P00 *= (1.0f - K0);
+    P01 *= (1.0f - K0);
+}
+
+float BallFilter::Axis::innovation_variance(const Noise& noise) const {
+    return P00 + noise.measurementVariance;
+}
+
+float BallFilter::Axis::variance_at(int frames) const {
+    float t = (float)frames;
+    return P00 + 2.0f * t * P01 + t * t * P11;
+}
+
+void BallFilter::reset() {
+    initialized = false;
+    missing = 0;
+    measurements = 0;
+}
+
+void BallFilter::predict() {
+    if (!initialized)
+        return;
+    x.predict(noise);
+    y.predict(noise);
+    ++missing;
+}
+
+bool BallFilter::update(POINT z) {
+    if (!initialized || missing > maxCoastFrames) {
+        x.init(z.x, 0.0f, noise);
+        y.init(z.y, 0.0f, noise);
+        initialized = true;
+        last = z;
+        missing = 0;
+        measurements = 1;
+        return false;
+    }
+
+    float dx = z.x - x.pos;
+    float dy = z.y - y.pos;
+    float distance = dx * dx / x.innovation_variance(noise) + dy * dy / y.innovation_variance(noise);
+    if (distance > gateDistance) {
+        // Restart, with the velocity since the last measurement
+        float frames = (float)(missing > 0 ? missing : 1);
+        x.init(z.x, (z.x - last.x) / frames, noise);
+        y.init(z.y, (z.y - last.y) / frames, noise);
+        last = z;
+        missing = 0;
+        measurements = 2;
+        return false;
+    }
+
+    x.update(z.x, noise);
+    y.update(z.y, noise);
+    last = z;
+    missing = 0;
+    ++measurements;
+    return true;
+}
+
+POINT BallFilter::position_at(int frames) const {
+    return {x.pos + (float)frames * x.vel, y.pos + (float)frames * y.vel};
+}
+
+POINT BallFilter::variance_at(int frames) const {
+    return {x.variance_at(frames), y.variance_at(frames)};
+}
@@ -0,0 +1,90 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#pragma once
+
+#include "geometry.h" // for POINT
+
+//
+// Constant-velocity Kalman filter for the ball position
+//
+// Works in field coordinates, with one step per frame, so the velocity
+// is in field units per frame.
+// The x and y directions are independent, so instead of one filter with
+// a 4x4 covariance this is two filters with a 2x2 covariance each.
+//
+// A measurement that is far outside the predicted range (the ball was
+// hit by a player, or a false detection) restarts the filter at that
+// measurement, with the velocity taken from the last two positions.
+//
+// The noise parameters were tuned at 40 fps with a ball buffer of 160
+// macropixels wide, and are scaled for other framerates and sizes
+// with configure().
+//
+class BallFilter {
+  public:
+    BallFilter() { configure(40.0f, 160); }
+
+    // Advance one frame, call this every frame before update()
+    void predict();
+
+    // Add the measured position of this frame
+    // Returns false when the filter was restarted
+    bool update(POINT measurement);
+
+    void reset();
+
+    // Framerate of the camera and width of the ball buffer in macropixels
+    // This does not reset the filter, so it can be called every frame.
+    void configure(float fps, int bufferWidth);
+
+    // Whether there is a position estimate: the ball was measured at
+    // most max_coast_frames() frames ago. In between measurements the
+    // position is extrapolated with the velocity.
+    bool tracking() const { return initialized && missing <= maxCoastFrames; }
+    // Whether there is a velocity estimate, i.e. at least two measurements
+    // since the last restart
+    bool has_velocity() const { return tracking() && measurements >= 2; }
+
+    POINT position() const { return {x.pos, y.pos}; }
+    POINT velocity() const { return {x.vel, y.vel}; }
+
+    // Extrapolated position and its variance, `frames` frames from now
+    POINT position_at(int frames) const;
+    POINT variance_at(int frames) const;
+
+    // Frames since the last measurement
+    int frames_missing() const { return missing; }
+
+    // About 75 milliseconds
+    int max_coast_frames() const { return maxCoastFrames; }
+
+  private:
+    // All in field coordinates, per frame
+    struct Noise {
+        float measurementVariance;
+        float accelerationVariance;
+        float unknownVelocityVariance;
+    };
+
+    struct Axis {
+        float pos;
+        float vel;
+        float P00, P01, P11; // Covariance (symmetric)
+
+        void init(float z, float v, const Noise& noise);
+        void predict(const Noise& noise);
+        void update(float z, const Noise& noise);
+        float innovation_variance(const Noise& noise) const;
+        float variance_at(int frames) const;
+    };
+
+    Noise noise;
+    int maxCoastFrames;
+    Axis x, y;
+    POINT last; // Last measurement
+    bool initialized = false;
+    int missing = 0;
+    int measurements = 0;
+};
@@ -0,0 +1,75 @@
+// Last pass of the search for the ball on the GPU: the weighted average
+// position of the (2*RADIUS+1)^2 macropixels around the brightest one,
+// like search_ball in analysis.cpp. The output is 2x1 texels:
+//     0: the average x (RG) and y (BA) in 1/32 macropixels, low byte first
+//     1: R: the intensity of the brightest macropixel,
+//        GBA: the sum of the intensities (0-255) in the window, low byte first
+// which is read out and given to analysis_process_ball_result.
+//
+// tex is the ball buffer, tex_max the 1x1 output of ballmax.frag.
+// RADIUS is defined by core.cpp in front of this file.
+// tex_unit is the size of a ball buffer texel, tex_size the number of used texels.
+
+#ifndef RADIUS
+#define RADIUS 5
+#endif
+// Texels left and right of the one with the brightest macropixel
+#define TEXELS ((RADIUS + 3) / 4)
+
+uniform sampler2D tex;
+uniform sampler2D tex_max;
+uniform vec2 tex_unit;
+uniform vec2 tex_size;
+
+vec2 decode_position(vec4 c) {
+    vec4 b = floor(c * 255.0 + 0.5);
+    float highy = floor(b.a / 16.0);
+    float highx = b.a - 16.0 * highy;
+    return vec2(b.g + 256.0 * highx, b.b + 256.0 * highy);
+}
+
+// A value in [0, 2^24) as 3 bytes, low byte first
+vec3 split_bytes(float v) {
+    float b2 = floor(v / 65536.0);
+    v -= 65536.0 * b2;
+    float b1 = floor(v / 256.0);
+    return vec3(v - 256.0 * b1, b1, b2) / 255.0;
+}
+
+void main(void) {
+    vec4 m = texture2D(tex_max, vec2(0.5, 0.5));
+    vec2 p = decode_position(m);
+
+    // The window, clamped to the buffer, inclusive
+    vec2 w0 = max(p - float(RADIUS), vec2(0.0, 0.0));
+    vec2 w1 = min(p + float(RADIUS), vec2(4.0 * tex_size.x, tex_size.y) - 1.0);
+
+    // Positions relative to w0, so that the sums stay exact in a float
+    float weight = 0.0;
+    vec2 sum = vec2(0.0, 0.0);
+    float tx0 = floor(p.x / 4.0);
+    for (int j = -RADIUS; j <= RADIUS; ++j) {
+        for (int i = -TEXELS; i <= TEXELS; ++i) {
+            vec2 t = vec2(tx0 + float(i), p.y + float(j));
+            vec4 v = texture2D(tex, (t + 0.5) * tex_unit);
+            for (int k = 0; k < 4; ++k) {
+                float x = 4.0 * t.x + float(k);
+                if (x >= w0.x && x <= w1.x && t.y >= w0.y && t.y <= w1.y) {
+                    float value = floor(v[k] * 255.0 + 0.5);
+                    weight += value;
+                    sum += value * vec2(x - w0.x, t.y - w0.y);
+                }
+            }
+        }
+    }
+
+    if (gl_FragCoord.x < 1.0) {
+        vec2 avg = (weight > 0.0 ? w0 + sum / weight : vec2(0.0, 0.0));
+        vec2 q = min(floor(avg * 32.0 + 0.5), 65535.0);
+        vec2 high = floor(q / 256.0);
+        vec2 low = q - 256.0 * high;
+        gl_FragColor = vec4(low.x, high.x, low.y, high.y) / 255.0;
+    } else {
+        gl_FragColor = vec4(m.r, split_bytes(weight));
+    }
+}
@@ -0,0 +1,76 @@
+// Search for the brightest macropixel of the ball buffer on the GPU, by
+// reducing it to a 1x1 texture in a few passes (see Optimizations.md).
+// Every output texel covers BLOCK x BLOCK input texels.
+//
+// The first pass reads the ball buffer, where every texel holds 4
+// horizontally adjacent macropixels (RGBA), so an output covers
+// 4*BLOCK x BLOCK macropixels. Only the macropixels in `area` count.
+// Its output, and that of every later pass (with MERGE defined), is the
+// brightest macropixel with its position, in macropixels:
+//     R: intensity, G: x % 256, B: y % 256, A: x / 256 + 16 * (y / 256)
+// Of equally bright ones the lowest y and then the lowest x is taken,
+// just like find_max in analysis.cpp does.
+//
+// BLOCK and MERGE are defined by core.cpp in front of this file.
+// tex_unit is the size of an input texel, the input can be a VCSM texture
+// of which only the bottom-left tex_size texels are used.
+// area is [xbegin, ybegin, xend, yend) in macropixels.
+
+#ifndef BLOCK
+#define BLOCK 4
+#endif
+
+uniform sampler2D tex;
+uniform vec2 tex_unit;
+uniform vec2 tex_size;
+uniform vec4 area;
+
+vec4 encode(float value, vec2 p) {
+    vec2 high = floor(p / 256.0);
+    vec2 low = p - 256.0 * high;
+    return vec4(value, low.x / 255.0, low.y / 255.0, (high.x + 16.0 * high.y) / 255.0);
+}
+
+vec2 decode_position(vec4 c) {
+    vec4 b = floor(c * 255.0 + 0.5);
+    float highy = floor(b.a / 16.0);
+    float highx = b.a - 16.0 * highy;
+    return vec2(b.g + 256.0 * highx, b.b + 256.0 * highy);
+}
+
+void main(void) {
+    vec2 origin = floor(gl_FragCoord.xy) * float(BLOCK);
+#ifdef MERGE
+    float best = -1.0;
+#else
+    float best = 0.0;
+#endif
+    vec2 bestPos = vec2(0.0, 0.0);
+    for (int j = 0; j < BLOCK; ++j) {
+        for (int i = 0; i < BLOCK; ++i) {
+            vec2 t = origin + vec2(float(i), float(j));
+            if (t.x < tex_size.x && t.y < tex_size.y) {
+                vec4 v = texture2D(tex, (t + 0.5) * tex_unit);
+#ifdef MERGE
+                float value = floor(v.r * 255.0 + 0.5);
+                vec2 p = decode_position(v);
+                if (value > best || (value == best && (p.y < bestPos.y || (p.y == bestPos.y && p.x < bestPos.x)))) {
+                    best = value;
+                    bestPos = p;
+                }
+#else
+                // Scanned row by row, so the first one is the lowest
+                for (int k = 0; k < 4; ++k) {
+                    float value = floor(v[k] * 255.0 + 0.5);
+                    vec2 p = vec2(4.0 * t.x + float(k), t.y);
+                    if (value > best && p.x >= area.x && p.x < area.z && p.y >= area.y && p.y < area.w) {
+                        best = value;
+                        bestPos = p;
+                    }
+                }
+#endif
+            }
+        }
+    }
+    gl_FragColor = encode(max(best, 0.0) / 255.0, bestPos);
+}
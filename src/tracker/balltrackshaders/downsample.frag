@@ -1,35 +1,50 @@
-// Ouput is 8X smaller in both directions!
-// We will use GL_LINEAR so that the GPU samples 4 texels at once.
-// The center of the output pixel (=texcoord) is at the intersection
-// of four input pixels.
+// Ouput is DOWNSAMPLE times smaller in both directions!
+// DOWNSAMPLE is 4, 8 or 16 and is defined by core.cpp in front of this file.
+// We will use GL_LINEAR so that the GPU samples 2 texels at once.
 // tex_unit is size of input texel
-// In the height dimension, where we have one output:
+// In the height dimension, where we have one output,
+// the center of the output pixel (=texcoord) is at the intersection
+// of two input pixels. For DOWNSAMPLE 8:
 // tex_unit:-8 -7 -6 -5 -4 -3 -2 -1  0  1  2  3  4  5  6  7  8
 // Input:    |--|--|--|--|--|--|--|--|--|--|--|--|--|--|--|--|
 // texcoord:             |-----------*-----------|
 // samples:              |--*--|--*--|--*--|--*--|
 //
-// In the width dimension, where we have four *outputs*:
+// In the width dimension, where we have four *outputs*,
+// every output covers DOWNSAMPLE/4 input texels. For DOWNSAMPLE 8:
 // tex_unit: -4   -3   -2   -1    0    1    2    3    4
 // Input:     |RGBA|RGBA|RGBA|RGBA|RGBA|RGBA|RGBA|RGBA|
 // texcoord:  |-------------------*-------------------|
 // samples:   |----R----|----G----|----B----|----A----|
+// For DOWNSAMPLE 4 every output is exactly one input texel, so there
+// is one sample in the center of it.
+
+#ifndef DOWNSAMPLE
+#define DOWNSAMPLE 8
+#endif
+#if DOWNSAMPLE >= 8
+#define XSAMPLES (DOWNSAMPLE / 8)
+#else
+#define XSAMPLES 1
+#endif
+#define YSAMPLES (DOWNSAMPLE / 2)
 
 uniform sampler2D tex;
 varying vec2 texcoord;
 uniform vec2 tex_unit;
 void main(void) {
-    int x = -3;
     for (int i = 0; i < 4; ++i) {
+        float x = (float(i) - 1.5) * float(DOWNSAMPLE / 4) - float(XSAMPLES - 1);
         float avg = 0.0;
-        for (int y = -3; y <= 3; y += 2) {
-            vec4 v = texture2D(tex, texcoord + vec2(x, y) * tex_unit);
-            avg += v[0];
-            avg += v[1];
-            avg += v[2];
-            avg += v[3];
+        for (int y = 1 - YSAMPLES; y < YSAMPLES; y += 2) {
+            for (int k = 0; k < XSAMPLES; ++k) {
+                vec4 v = texture2D(tex, texcoord + vec2(x + float(2 * k), float(y)) * tex_unit);
+                avg += v[0];
+                avg += v[1];
+                avg += v[2];
+                avg += v[3];
+            }
         }
-        gl_FragColor[i] = 0.0625 * avg;
-        x += 2;
+        gl_FragColor[i] = avg / float(4 * XSAMPLES * YSAMPLES);
     }
 }
@@ -0,0 +1,56 @@
+// Row and column sums of the field buffer, so that only these have to be
+// read out for analysis_process_field_result instead of the whole buffer.
+// The field buffer has WIDTH x HEIGHT texels, of 4 horizontally adjacent
+// macropixels each (RGBA). The output has two rows:
+//     y = 0: at x, the sum of macropixel column x, for x < 4 * WIDTH
+//     y = 1: at x, the sum of macropixel row x, for x < HEIGHT
+// Only macropixels above 20 (in 0-255) are counted, to ignore noise,
+// just like analysis_process_field_buffer does.
+// Every sum is written as 3 bytes (RGB), low byte first.
+//
+// WIDTH and HEIGHT are defined by core.cpp in front of this file.
+// tex_unit is the size of an input texel.
+
+#ifndef WIDTH
+#define WIDTH 40
+#endif
+#ifndef HEIGHT
+#define HEIGHT 90
+#endif
+
+uniform sampler2D tex;
+uniform vec2 tex_unit;
+
+// The 4 macropixels of a texel, in 0-255, and 0 when at most 20
+vec4 macropixels(vec2 t) {
+    vec4 v = floor(texture2D(tex, (t + 0.5) * tex_unit) * 255.0 + 0.5);
+    return v * vec4(greaterThan(v, vec4(20.0)));
+}
+
+// A value in [0, 2^24) as 3 bytes, low byte first
+vec3 split_bytes(float v) {
+    float b2 = floor(v / 65536.0);
+    v -= 65536.0 * b2;
+    float b1 = floor(v / 256.0);
+    return vec3(v - 256.0 * b1, b1, b2) / 255.0;
+}
+
+void main(void) {
+    float x = floor(gl_FragCoord.x);
+    float sum = 0.0;
+    if (gl_FragCoord.y < 1.0) {
+        if (x >= float(4 * WIDTH))
+            discard;
+        // Channel x % 4 of texel column x / 4
+        float tx = floor(x / 4.0);
+        vec4 channel = vec4(equal(vec4(x - 4.0 * tx), vec4(0.0, 1.0, 2.0, 3.0)));
+        for (int y = 0; y < HEIGHT; ++y)
+            sum += dot(macropixels(vec2(tx, float(y))), channel);
+    } else {
+        if (x >= float(HEIGHT))
+            discard;
+        for (int i = 0; i < WIDTH; ++i)
+            sum += dot(macropixels(vec2(float(i), x)), vec4(1.0));
+    }
+    gl_FragColor = vec4(split_bytes(sum), 0.0);
+}
@@ -1,5 +1,4 @@
-uniform vec4 col;
-varying vec2 texcoord;
+varying vec4 col;
 void main(void) {
     gl_FragColor = col;
 }
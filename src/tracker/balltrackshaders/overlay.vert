@@ -0,0 +1,8 @@
+// Lines of the overlay, with a color for every vertex (see LineBatch)
+attribute vec2 vertex;
+attribute vec4 color;
+varying vec4 col;
+void main(void) {
+   col = color;
+   gl_Position = vec4(vertex, 0.0, 1.0);
+}
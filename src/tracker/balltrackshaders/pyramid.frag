@@ -0,0 +1,25 @@
+// One level of the downsample pyramid: ouput is 2 times smaller in both directions.
+// Every texel holds 4 horizontally adjacent macropixels (RGBA), so one output
+// texel covers 2x2 input texels: R,G come from the left one and B,A from the right one.
+// tex_unit is size of input texel
+// The center of the output pixel (=texcoord) is at the corner of four
+// input texels. With GL_LINEAR, a sample in the middle of a texel in the
+// width direction averages the two rows in the height direction:
+// tex_unit: -1    0    1
+// Input:     |RGBA|RGBA|
+// texcoord:  |----*----|
+// samples:     *    *
+//
+// The levels are VCSM textures with a power-of-two size, of which only the
+// bottom-left part is used. tex_scale is the size of that part, in texture coordinates.
+
+uniform sampler2D tex;
+varying vec2 texcoord;
+uniform vec2 tex_unit;
+uniform vec2 tex_scale;
+void main(void) {
+    vec2 center = texcoord * tex_scale;
+    vec4 left = texture2D(tex, center + vec2(-0.5, 0.0) * tex_unit);
+    vec4 right = texture2D(tex, center + vec2(0.5, 0.0) * tex_unit);
+    gl_FragColor = 0.5 * vec4(left[0] + left[1], left[2] + left[3], right[0] + right[1], right[2] + right[3]);
+}
@@ -0,0 +1,332 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <semaphore.h>
+
+// Head and tail are kept on separate cache lines so that
+// the producer and consumer thread do not invalidate each other's cache
+constexpr int CACHE_LINE_SIZE = 64;
+
+//
+// Lock-free ring of 32-bit values, for one producer and several consumers
+//
+// push() may only be called by the producer thread.
+// pop() may be called by any thread: BufferQueue pops from the consumer
+// thread, and from the producer thread to drop the oldest value when the
+// ring is full. That is why pop() uses a compare-exchange: whoever gets
+// there first gets the value.
+// Nothing ever blocks; push() and pop() return false instead.
+//
+class SpmcRing {
+  public:
+    explicit SpmcRing(uint32_t depth) : depth(depth) {
+        // Counters wrap around at 2^32 so the slot count has to be a power of two
+        uint32_t count = 1;
+        while (count < depth)
+            count *= 2;
+        mask = count - 1;
+        slots = std::vector<std::atomic<uint32_t>>(count);
+    }
+
+    bool push(uint32_t value) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= depth)
+            return false;
+        slots[t & mask].store(value, std::memory_order_relaxed);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(uint32_t& value) {
+        uint32_t h = head.load(std::memory_order_acquire);
+        while (h != tail.load(std::memory_order_acquire)) {
+            value = slots[h & mask].load(std::memory_order_relaxed);
+            // On failure, h is updated to the new head and we try again
+            if (head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel))
+                return true;
+        }
+        return false;
+    }
+
+    uint32_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+  private:
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> head{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> tail{0};
+    alignas(CACHE_LINE_SIZE) std::vector<std::atomic<uint32_t>> slots;
+    uint32_t depth;
+    uint32_t mask;
+};
+
+//
+// Queue of pixelbuffers from the GL thread (producer)
+// to the analysis thread (consumer), built from two SpmcRings:
+// one with full buffers and one with empty buffers.
+//
+// There are `depth + 2` buffers, so that the producer always has an empty
+// buffer to write to while the queue holds `depth` full buffers and the
+// consumer is busy with one more.
+//
+// When the queue is full, acquire() returns 0, unless `dropOldest` is set.
+// In that case the oldest full buffer is dropped and reused, so that the
+// producer never has to wait for the consumer.
+//
+// Every buffer also carries a 64-bit tag, used to pass the source frame
+// along for tracing.
+//
+class BufferQueue {
+  public:
+    BufferQueue(int depth, int bufferSize, bool dropOldest)
+        : full(depth), empty(depth + 2), depth(depth), dropOldest(dropOldest) {
+        for (int i = 0; i < depth + 2; ++i) {
+            buffers.push_back((uint8_t*)malloc(bufferSize));
+            tags.push_back(-1);
+            empty.push(i);
+        }
+    }
+
+    ~BufferQueue() {
+        for (auto buf : buffers)
+            free(buf);
+    }
+
+    // Returns false if a buffer could not be allocated
+    bool valid() const {
+        for (auto buf : buffers)
+            if (!buf)
+                return false;
+        return true;
+    }
+
+    //
+    // Producer side
+    //
+
+    // Get an empty buffer to write to
+    uint8_t* acquire() {
+        if (!dropOldest && full.size() >= (uint32_t)depth)
+            return 0;
+        uint32_t index;
+        if (spareBuffer >= 0) {
+            index = spareBuffer;
+            spareBuffer = -1;
+        } else if (!empty.pop(index)) {
+            return 0;
+        }
+        writeBuffer = index;
+        return buffers[index];
+    }
+
+    // Hand the acquired buffer to the consumer
+    // The type is an arbitrary value (< 2^16) that is passed along with it
+    void publish(int type, int64_t tag = -1) {
+        tags[writeBuffer] = tag;
+        uint32_t value = (uint32_t)writeBuffer | ((uint32_t)type << 16);
+        if (!full.push(value)) {
+            // Only possible with dropOldest
+            uint32_t oldest;
+            if (full.pop(oldest)) {
+                spareBuffer = oldest & 0xffff;
+                droppedCount.fetch_add(1, std::memory_order_relaxed);
+            }
+            full.push(value);
+        }
+        writeBuffer = -1;
+        publishedCount.fetch_add(1, std::memory_order_relaxed);
+
+        uint32_t size = full.size();
+        if (size > maxQueued.load(std::memory_order_relaxed))
+            maxQueued.store(size, std::memory_order_relaxed);
+    }
+
+    //
+    // Consumer side
+    //
+
+    // Take the oldest full buffer, or 0 if there is none
+    uint8_t* pop(int* type, int64_t* tag = 0) {
+        uint32_t value;
+        if (!full.pop(value))
+            return 0;
+        readBuffer = value & 0xffff;
+        *type = (int)(value >> 16);
+        if (tag)
+            *tag = tags[readBuffer];
+        return buffers[readBuffer];
+    }
+
+    // Give the popped buffer back to the producer
+    void release() {
+        empty.push(readBuffer);
+        readBuffer = -1;
+    }
+
+    //
+    // Statistics, can be read from any thread
+    //
+
+    uint32_t queued() const { return full.size(); }
+    uint32_t max_queued() const { return maxQueued.load(std::memory_order_relaxed); }
+    uint32_t published() const { return publishedCount.load(std::memory_order_relaxed); }
+    uint32_t dropped() const { return droppedCount.load(std::memory_order_relaxed); }
+
+  private:
+    SpmcRing full;
+    SpmcRing empty;
+    std::vector<uint8_t*> buffers;
+    std::vector<int64_t> tags; // Written before the index is pushed, so no atomics needed
+    int depth;
+    bool dropOldest;
+
+    int writeBuffer = -1; // Only used by producer
+    int spareBuffer = -1; // Only used by producer
+    int readBuffer = -1;  // Only used by consumer
+
+    std::atomic<uint32_t> publishedCount{0};
+    std::atomic<uint32_t> droppedCount{0};
+    std::atomic<uint32_t> maxQueued{0};
+};
+
+// Number of read out buffers that can wait for the analysis thread
+// At 120 fps this covers a hiccup of ~65 ms of the analysis thread
+constexpr int PIXELBUFFER_QUEUE_DEPTH = 8;
+
+// Copy `rows` rows of `rowBytes` bytes out of a buffer with `srcStride`
+// bytes per row, like the power-of-two VCSM textures, into a packed buffer
+inline void copy_rows(uint8_t* dst, const uint8_t* src, int rowBytes, int rows, int srcStride) {
+    for (int y = 0; y < rows; ++y) {
+        memcpy(dst, src, rowBytes);
+        src += srcStride;
+        dst += rowBytes;
+    }
+}
+
+//
+// The handoff of pixelbuffers from the GL thread to the analysis thread:
+// a BufferQueue and the two wakeup signals around it.
+//
+// The GL thread calls send() for every readout. It waits when the queue is
+// full (without dropOldest), fills the buffer and wakes up the analysis thread.
+// The analysis thread calls wait_published(), then pop() and release()
+// until the queue is empty.
+// The GL thread only sleeps while it waits for the analysis thread, and is
+// woken up again when a buffer is released. Other things the analysis thread
+// gives back (like the zero copy texture sets) use wait_for_consumer() and
+// notify_released() the same way.
+//
+// Used by core.cpp, and by trackerbench to time the same code.
+//
+class PixelbufferHandoff {
+  public:
+    PixelbufferHandoff(int depth, int bufferSize, bool dropOldest)
+        : queue(depth, bufferSize, dropOldest) {
+        sem_init(&semFullCount, 0, 0);
+        sem_init(&semReleased, 0, 0);
+    }
+
+    ~PixelbufferHandoff() {
+        sem_destroy(&semFullCount);
+        sem_destroy(&semReleased);
+    }
+
+    // Returns false if a buffer could not be allocated
+    bool valid() const { return queue.valid(); }
+
+    //
+    // GL thread
+    //
+
+    // Blocks until `ready()` is true. The analysis thread calls
+    // notify_released after it gives something back, and the flag
+    // is set before the last check, so that wakeup can not be missed.
+    template <typename Ready>
+    void wait_for_consumer(Ready ready) {
+        while (!ready()) {
+            glWaiting.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ready())
+                sem_wait_retry(&semReleased);
+            glWaiting.store(false);
+        }
+    }
+
+    // Claim an empty buffer
+    // This can only fail without dropOldest, in which case we wait
+    uint8_t* acquire() {
+        uint8_t* buf = 0;
+        wait_for_consumer([&] { return (buf = queue.acquire()) != 0; });
+        return buf;
+    }
+
+    // Hand the acquired buffer to the analysis thread and wake it up
+    void publish(int type, int64_t tag) {
+        queue.publish(type, tag);
+        sem_post(&semFullCount);
+    }
+
+    // Acquire a buffer, let `fill(buf)` write to it and publish it
+    template <typename Fill>
+    void send(int type, int64_t tag, Fill fill) {
+        uint8_t* buf = acquire();
+        fill(buf);
+        publish(type, tag);
+    }
+
+    //
+    // Analysis thread
+    //
+
+    // Wait till there is a full buffer, or wake_consumer was called.
+    // The queue can still be empty after this, when the GL thread has
+    // dropped a buffer.
+    void wait_published() { sem_wait_retry(&semFullCount); }
+
+    // Wake up wait_published without a buffer, for stopping the thread
+    void wake_consumer() { sem_post(&semFullCount); }
+
+    uint8_t* pop(int* type, int64_t* tag) { return queue.pop(type, tag); }
+
+    // Give the popped buffer back to the GL thread
+    void release() {
+        queue.release();
+        notify_released();
+    }
+
+    // Something was given back to the GL thread
+    // Wakes it up when it is waiting in wait_for_consumer
+    void notify_released() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (glWaiting.exchange(false))
+            sem_post(&semReleased);
+    }
+
+    //
+    // Statistics, can be read from any thread
+    //
+
+    uint32_t max_queued() const { return queue.max_queued(); }
+    uint32_t published() const { return queue.published(); }
+    uint32_t dropped() const { return queue.dropped(); }
+
+  private:
+    static void sem_wait_retry(sem_t* sem) {
+        while (sem_wait(sem) != 0 && errno == EINTR) {
+        }
+    }
+
+    BufferQueue queue;
+    sem_t semFullCount;      // GL -> analysis wakeup signal
+    sem_t semReleased;       // analysis -> GL wakeup signal, only when glWaiting
+    std::atomic<bool> glWaiting{false}; // The GL thread waits for a buffer or something else
+};
@@ -3,52 +3,23 @@ Copyright (c) 2018, Tom Bannink
 MIT License
 */
 #include "core.h"
+#include "pipeline.h"
 #include "util.h"
+#include "readout.h"
 #include "analysis.h"
+#include "bufferqueue.h"
+#include "trace.h"
+#include <atomic>
 #include <cstring>
 #include <cstdio>
 #include <sys/time.h>
 #define VCOS_LOG_CATEGORY (&balltrack_log_category)
 #include "interface/vcos/vcos.h" // For threads and semaphores
-#include "interface/vcsm/user-vcsm.h" // For creating the videocore-shared-memory texture
 VCOS_LOG_CAT_T balltrack_log_category;
 
-// Update the size of the (green) field bounding box every X frames
-constexpr int FieldUpdateDelay = 20;
-
-// Whether to use bigger (more finegrained, but slower) textures
-#define BIGTEX
-
 // Debug feature, debugs a few frames to tga files.
 //#define DO_FRAMEDUMPS
 
-// Divisions by 2 of 720p with correct aspect ratio
-// 1280,720
-//  640,360
-//  320,180
-//  160, 90
-//   80, 45
-
-// Every step maintains the same aspect ratio
-// -- Source is 720p
-const int width0  = 1280;
-const int height0 = 720;
-#ifdef BIGTEX
-// -- Phase 1: from source to tex1: color filter on every pixel
-const int width1  = 1280 / 4; // RGBA can store 4 values at once
-const int height1 = 720;
-// -- Phase 2: from tex1 to tex2: average 8x8 pixels to 1 pixel
-const int width2  = 160 / 4;
-const int height2 = 90;
-#else
-// -- Phase 1: from source to tex1: 2x2 sampler-average, then color filter
-const int width1  = 640 / 4; // RGBA can store 4 values at once
-const int height1 = 360;
-// -- Phase 2: from tex1 to tex2: average 8x8 pixels to 1 pixel
-const int width2  = 80 / 4;
-const int height2 = 45;
-#endif
-
 
 //
 // Textures
@@ -64,11 +35,30 @@ const int height2 = 45;
 // So it takes 3 frames before the source data gets to the readout phase,
 // but every transformation can now be done in parallel, instead of in series
 //
+// The coarser levels of the downsample pyramid are made right after tex2,
+// in the same frame, since every level needs the one before:
+// tex2[0] -> level1[0] -> level2[0] -> ...
+// and they are read out together with tex2[1]
+// With zero copy readout, there are more than two of these, see below.
+//
 // For the field textures, we do not need this, since this only happens
-// every n frames, so we can simply do:
-// Frame n-2: source    -> tex1field
-// Frame n-1: tex1field -> tex2field
-// Frame n  : tex2field -> readout
+// every few frames. All passes are done in one frame, followed by a fence:
+// Frame n  : source -> tex1field -> tex2field -> fieldsums, insert fence
+// Frame n+k: fieldsums -> readout, as soon as the fence is signaled
+// Only the row and column sums of tex2field are read out, see fieldsums.frag
+
+// With fence readout, the ball passes are not spread over frames, but
+// rendered right after each other, followed by a fence:
+// Frame n  : source -> tex1 -> tex2[i] -> levels or ball search, fence[i]
+// Frame n+1: tex2[i] -> readout, when fence[i] is signaled
+// This is one frame less than above. There are 3 sets then, so the GPU can
+// be one frame behind before the GL thread has to wait for a fence.
+
+// With the ball search on the GPU, the ball buffer is reduced to its
+// brightest macropixel in a few passes, in the same frame:
+// tex2[0] -> max1 -> max2 -> ... -> 1x1
+// tex2[0] + 1x1 -> result[0]
+// and result[1] is read out instead of tex2[1]
 
 // These are swapped around every frame
 Texture* texColorFilter_read = 0;
@@ -78,8 +68,8 @@ ReadoutTexture* texDownscaled_write = 0;
 
 Texture* texColorFilter[2];
 Texture* texColorFilterField;
-ReadoutTexture* texDownscaled[2];
-ReadoutTexture* texDownscaledField;
+Texture* texDownscaledField;
+ReadoutTexture* texFieldSums;
 
 #ifdef DO_DIFF
 Texture* rtt_copytex;
@@ -89,20 +79,56 @@ Texture* rtt_copytex;
 Texture* texFramedump;
 #endif
 
-enum PixelBufferType { BUFFERTYPE_BALL = 0, BUFFERTYPE_FIELD = 1 };
-
-constexpr int PIXELBUFFER_COUNT = 4;
-PixelBufferType pixelbufferType[PIXELBUFFER_COUNT];
-uint8_t* pixelbuffers[PIXELBUFFER_COUNT]; // For reading out result
+// BUFFERTYPE_BALL_TEXTURES has no pixels, but the index of a set of
+// pyramid textures that the analysis thread reads itself (zero copy)
+// BUFFERTYPE_BALL_RESULT is the readout of the ball search on the GPU
+// BUFFERTYPE_FIELD_SUMS is the readout of the field row and column sums
+enum PixelBufferType {
+    BUFFERTYPE_BALL = 0,
+    BUFFERTYPE_FIELD = 1,
+    BUFFERTYPE_BALL_TEXTURES = 2,
+    BUFFERTYPE_BALL_RESULT = 3,
+    BUFFERTYPE_FIELD_SUMS = 4,
+};
 
-int nextEmptyBuffer = 0; // For writing buffers
-int nextFullBuffer = 0;  // For reading buffers
+// See bufferqueue.h for PIXELBUFFER_QUEUE_DEPTH
+// When the analysis thread falls behind and the queue is full:
+// true:  drop the oldest buffer in the queue, so the GL thread never waits
+// false: the GL thread waits until the analysis thread takes a buffer
+constexpr bool PIXELBUFFER_DROP_OLDEST = false;
+PixelbufferHandoff* pixelbufferHandoff = 0; // For reading out result
+
+// Levels of the downsample pyramid, level 0 is texDownscaled
+// Normally there are two sets that are swapped every frame.
+// With zero copy readout, the analysis thread reads the textures in place
+// instead of a copy. Then there is a set for every buffer of the queue, and
+// the GPU only renders to a set again when the analysis thread is done with it.
+// Dropped buffers would never give their set back, so this needs
+// PIXELBUFFER_DROP_OLDEST to be false.
+constexpr int MaxPyramidSets = PIXELBUFFER_QUEUE_DEPTH + 2;
+ReadoutTexture* texPyramid[MaxPyramidSets][MaxPyramidLevels];
+ReadoutTexture** texPyramid_read = 0;
+ReadoutTexture** texPyramid_write = 0;
+std::atomic<bool> texPyramidInUse[MaxPyramidSets]; // Set by GL thread, cleared by analysis thread
+ReadoutTexture* texBallResult[MaxPyramidSets]; // With gpuSearch, goes with the pyramid sets
+int pyramidSets = 2;
+int pyramidReadSet = 0;
+int pyramidWriteSet = 1;
+bool zeroCopy = false;
+
+// Fence readout, see above. Used when EGL_KHR_fence_sync is available,
+// otherwise the sets are read out with the frame delays.
+bool fenceReadoutRequested = true;
+bool fenceReadout = false;
+RenderFence pyramidFence[MaxPyramidSets];
+// Sets that are rendered to but not yet read out, oldest first
+int fencedSets[MaxPyramidSets];
+int fencedSetCount = 0;
 
 void* analysis_thread(void *arg);
-int analysis_stop = 0;
+std::atomic<int> analysis_stop{0};
 VCOS_THREAD_T analysis_thread_handle;
-VCOS_SEMAPHORE_T semEmptyCount; // analysis -> GL signal
-VCOS_SEMAPHORE_T semFullCount;  // GL -> analysis signal
+bool analysisThreadStarted = false; // Only used by the GL thread
 
 
 GLfloat quad_varray[] = {
@@ -111,10 +137,26 @@ GLfloat quad_varray[] = {
 };
 
 GLuint quad_vbo; // vertex buffer object
-GLuint fbo;      // frame buffer object for render-to-texture
+GLuint fbo;      // frame buffer object for render-to-texture, with FBO_SINGLE
+
+// How a render-to-texture target is bound, see Optimizations.md
+// FBO_SINGLE:      one FBO, and the target is attached to it for every pass
+// FBO_PER_TEXTURE: every target has its own FBO that stays attached
+// FBO_BENCHMARK:   switch between the two every FboBenchmarkFrames frames,
+//                  and print the frame times of both
+int fboMode = FBO_SINGLE;
+FramebufferCache framebufferCache;
+
+// How the ball and field textures are read out, see readout.h
+int readoutRequested = READOUT_AUTO;
 
 bool allInitialized = false;
 
+// Measured render framerate, the clock of the analysis
+float stableFPS = 40;
+bool measureFPS = true;
+float render_fps() { return stableFPS; }
+
 
 // Autogenerated file containing all shaders
 #include "balltrackshaders/allshaders.h"
@@ -124,7 +166,7 @@ ShaderProgram shader_colorfilter_ball =
     .display_name = "colorfilter_ball",
     .vertex_source = (char*)vshader_vert,
     .fragment_source = (char*)colorfilterball_frag,
-    .uniforms = {ShaderUniform("tex", 0), ShaderUniform("tex_unit", 1.0f / (float)width0, 1.0f / (float)height0)},
+    .uniforms = {ShaderUniform("tex", 0), ShaderUniform("tex_unit")}, // See set_pipeline_uniforms
     .attribute_names = {"vertex"},
 };
 
@@ -133,7 +175,7 @@ ShaderProgram shader_colorfilter_field =
     .display_name = "colorfilter_field",
     .vertex_source = (char*)vshader_vert,
     .fragment_source = (char*)colorfilterfield_frag,
-    .uniforms = {ShaderUniform("tex", 0), ShaderUniform("tex_unit", 1.0f / (float)width0, 1.0f / (float)height0)},
+    .uniforms = {ShaderUniform("tex", 0), ShaderUniform("tex_unit")}, // See set_pipeline_uniforms
     .attribute_names = {"vertex"},
 };
 
@@ -142,7 +184,43 @@ ShaderProgram shader_downsample =
     .display_name = "downsample",
     .vertex_source = (char*)vshader_vert,
     .fragment_source = (char*)downsample_frag,
-    .uniforms = {ShaderUniform("tex", 0), ShaderUniform("tex_unit", 1.0f / (float)width1, 1.0f / (float)height1)},
+    .uniforms = {ShaderUniform("tex", 0), ShaderUniform("tex_unit")}, // See set_pipeline_uniforms
+    .attribute_names = {"vertex"},
+};
+
+// One for every level of the pyramid after the first, since tex_unit
+// depends on the size. See set_pipeline_uniforms
+ShaderProgram shader_pyramid[MaxPyramidLevels];
+
+// Ball search on the GPU, see ballmax.frag and ballcentroid.frag
+// Every pass of ballmax makes the texture BallMaxBlock times smaller.
+constexpr int BallMaxBlock = 4;
+constexpr int MaxBallMaxLevels = 6;
+bool gpuSearch = false;
+int ballMaxLevels = 0;
+Texture* texBallMax[MaxBallMaxLevels];
+ShaderProgram shader_ballmax[MaxBallMaxLevels]; // See set_pipeline_uniforms
+ShaderProgram shader_ballcentroid =
+{
+    .display_name = "ballcentroid",
+    .vertex_source = (char*)vshader_vert,
+    .fragment_source = (char*)ballcentroid_frag,
+    .uniforms = {
+        ShaderUniform("tex", 0),
+        ShaderUniform("tex_max", 1),
+        ShaderUniform("tex_unit"), // See set_pipeline_uniforms
+        ShaderUniform("tex_size"),
+    },
+    .attribute_names = {"vertex"},
+};
+
+// Field row and column sums, see set_pipeline_uniforms
+ShaderProgram shader_fieldsums =
+{
+    .display_name = "fieldsums",
+    .vertex_source = (char*)vshader_vert,
+    .fragment_source = (char*)fieldsums_frag,
+    .uniforms = {ShaderUniform("tex", 0), ShaderUniform("tex_unit")},
     .attribute_names = {"vertex"},
 };
 
@@ -165,21 +243,24 @@ ShaderProgram shader_debug =
         ShaderUniform("tex_dbg1", 1),
         ShaderUniform("tex_dbg2", 2),
         ShaderUniform("tex_dbg3", 3),
-        ShaderUniform("pixelwidth1", 1.0f / (float)width1),
-        ShaderUniform("pixelwidth2", 1.0f / (float)width2),
-        ShaderUniform("pixelwidth3", 1.0f / (float)width2),
+        ShaderUniform("pixelwidth1"), // See set_pipeline_uniforms
+        ShaderUniform("pixelwidth2"),
+        ShaderUniform("pixelwidth3"),
     },
     .attribute_names = {"vertex"},
 };
 
-ShaderProgram shader_fixedcolor =
+// The lines of analysis_draw are collected in overlayLines,
+// and drawn at the end of the frame with one draw call
+ShaderProgram shader_overlay =
 {
-    .display_name = "fixedcolor",
-    .vertex_source = (char*)vshader_vert,
-    .fragment_source = (char*)fixedcolor_frag,
-    .uniforms = { ShaderUniform("col") },
-    .attribute_names = {"vertex"},
+    .display_name = "overlay",
+    .vertex_source = (char*)overlay_vert,
+    .fragment_source = (char*)overlay_frag,
+    .attribute_names = {"vertex", "color"},
 };
+LineBatch overlayLines;
+bool overlayEnabled = true;
 
 #ifdef DO_YUV
 ShaderProgram shader_yuv =
@@ -217,22 +298,510 @@ void replace_sampler_string(const char* text) {
     }
 }
 
+// The texture sizes are only known at runtime,
+// so the uniforms that depend on them are set before building
+char downsampleDefines[32];
+
+// Size of the texture that holds width x height texels for readout,
+// VCSM textures have a power-of-two size
+void readout_texture_size(int width, int height, int* texWidth, int* texHeight) {
+    *texWidth = width;
+    *texHeight = height;
+    if (readout_shared_memory()) {
+        *texWidth = SharedMemTexture::pot_size(width);
+        *texHeight = SharedMemTexture::pot_size(height);
+    }
+}
+
+// Size of level `level` of the ball search, in texels
+void ball_max_size(int level, int* width, int* height) {
+    *width = pipeline.width2;
+    *height = pipeline.height2;
+    for (int i = 0; i <= level; ++i) {
+        *width = (*width + BallMaxBlock - 1) / BallMaxBlock;
+        *height = (*height + BallMaxBlock - 1) / BallMaxBlock;
+    }
+}
+
+void set_ball_search_uniforms() {
+    static char ballMaxDefines[2][64];
+    static char centroidDefines[64];
+    sprintf(ballMaxDefines[0], "#define BLOCK %d\n", BallMaxBlock);
+    sprintf(ballMaxDefines[1], "#define BLOCK %d\n#define MERGE\n", BallMaxBlock);
+    sprintf(centroidDefines, "#define RADIUS %d\n", analysis_ball_window_radius(4 * pipeline.width2));
+
+    static const char* ballMaxNames[MaxBallMaxLevels] = {"ballmax0", "ballmax1", "ballmax2", "ballmax3", "ballmax4", "ballmax5"};
+    int texWidth, texHeight;
+    readout_texture_size(pipeline.width2, pipeline.height2, &texWidth, &texHeight);
+    int width = pipeline.width2;
+    int height = pipeline.height2;
+    ballMaxLevels = 0;
+    for (int level = 0; level < MaxBallMaxLevels && (level == 0 || width > 1 || height > 1); ++level) {
+        // Size of the source, and of the texture that holds it
+        if (level > 0) {
+            ball_max_size(level - 1, &width, &height);
+            texWidth = width;
+            texHeight = height;
+        }
+        ShaderProgram& shader = shader_ballmax[level];
+        shader.display_name = ballMaxNames[level];
+        shader.vertex_source = (char*)vshader_vert;
+        shader.fragment_source = (char*)ballmax_frag;
+        shader.fragment_defines = ballMaxDefines[level == 0 ? 0 : 1];
+        shader.uniforms[0] = ShaderUniform("tex", 0);
+        shader.uniforms[1] = ShaderUniform("tex_unit", 1.0f / (float)texWidth, 1.0f / (float)texHeight);
+        shader.uniforms[2] = ShaderUniform("tex_size", (float)width, (float)height);
+        shader.uniforms[3] = ShaderUniform(level == 0 ? "area" : 0); // Set every frame
+        shader.attribute_names[0] = "vertex";
+        ++ballMaxLevels;
+        ball_max_size(level, &width, &height);
+    }
+
+    readout_texture_size(pipeline.width2, pipeline.height2, &texWidth, &texHeight);
+    shader_ballcentroid.fragment_defines = centroidDefines;
+    shader_ballcentroid.uniforms[2] = ShaderUniform("tex_unit", 1.0f / (float)texWidth, 1.0f / (float)texHeight);
+    shader_ballcentroid.uniforms[3] = ShaderUniform("tex_size", (float)pipeline.width2, (float)pipeline.height2);
+}
+
+void set_pipeline_uniforms() {
+    ShaderUniform texUnit0("tex_unit", 1.0f / (float)pipeline.width0, 1.0f / (float)pipeline.height0);
+    shader_colorfilter_ball.uniforms[1] = texUnit0;
+    shader_colorfilter_field.uniforms[1] = texUnit0;
+    shader_downsample.uniforms[1] = ShaderUniform("tex_unit", 1.0f / (float)pipeline.width1, 1.0f / (float)pipeline.height1);
+    shader_debug.uniforms[4] = ShaderUniform("pixelwidth1", 1.0f / (float)pipeline.width1);
+    shader_debug.uniforms[5] = ShaderUniform("pixelwidth2", 1.0f / (float)pipeline.width2);
+    shader_debug.uniforms[6] = ShaderUniform("pixelwidth3", 1.0f / (float)pipeline.width2);
+
+    sprintf(downsampleDefines, "#define DOWNSAMPLE %d\n", pipeline.downsampleFactor);
+    shader_downsample.fragment_defines = downsampleDefines;
+
+    static char fieldSumsDefines[64];
+    sprintf(fieldSumsDefines, "#define WIDTH %d\n#define HEIGHT %d\n", pipeline.width2, pipeline.height2);
+    shader_fieldsums.fragment_defines = fieldSumsDefines;
+    shader_fieldsums.uniforms[1] = ShaderUniform("tex_unit", 1.0f / (float)pipeline.width2, 1.0f / (float)pipeline.height2);
+
+    static const char* pyramidNames[MaxPyramidLevels] = {"pyramid0", "pyramid1", "pyramid2", "pyramid3"};
+    for (int level = 1; level < pipeline.levels; ++level) {
+        // Size of the source level, and of the texture that holds it
+        int width = pipeline_level_width(pipeline, level - 1);
+        int height = pipeline_level_height(pipeline, level - 1);
+        int texWidth, texHeight;
+        readout_texture_size(width, height, &texWidth, &texHeight);
+        ShaderProgram& shader = shader_pyramid[level];
+        shader.display_name = pyramidNames[level];
+        shader.vertex_source = (char*)vshader_vert;
+        shader.fragment_source = (char*)pyramid_frag;
+        shader.uniforms[0] = ShaderUniform("tex", 0);
+        shader.uniforms[1] = ShaderUniform("tex_unit", 1.0f / (float)texWidth, 1.0f / (float)texHeight);
+        shader.uniforms[2] = ShaderUniform("tex_scale", (float)width / (float)texWidth, (float)height / (float)texHeight);
+        shader.attribute_names[0] = "vertex";
+    }
+
+    if (gpuSearch)
+        set_ball_search_uniforms();
+}
+
+int build_shaders() {
+    set_pipeline_uniforms();
+
+    if (shader_colorfilter_ball.build())
+        return -1;
+    if (shader_colorfilter_field.build())
+        return -1;
+    if (shader_downsample.build())
+        return -1;
+    if (shader_fieldsums.build())
+        return -1;
+    for (int level = 1; level < pipeline.levels; ++level) {
+        if (shader_pyramid[level].build())
+            return -1;
+    }
+    if (gpuSearch) {
+        for (int level = 0; level < ballMaxLevels; ++level) {
+            if (shader_ballmax[level].build())
+                return -1;
+        }
+        if (shader_ballcentroid.build())
+            return -1;
+    }
+#ifdef DEBUG_TEXTURES
+    if (shader_debug.build())
+        return -1;
+#endif
+    if (shader_simple.build())
+        return -1;
+    if (shader_overlay.build())
+        return -1;
+#ifdef DO_YUV
+    if (shader_yuv.build())
+        return -1;
+#endif
+#ifdef DO_DIFF
+    if (shader_diff.build())
+        return -1;
+#endif
+    return 0;
+}
+
+// Frames since the render-to-texture targets were created
+int pipelineFrameNumber = -5;
+// Frames since the last field update was started
+int fieldUpdateFrames = 0;
+// Tells when the field passes are done and texFieldSums can be read out.
+// Without fence sync, wait 4 frames, like the frame delays of before.
+RenderFence fieldFence(4);
+
+int create_textures() {
+    printf("Pipeline: source %dx%d, color filter %dx%d texels, downsampled %dx%d texels, search level %dx%d texels\n",
+           pipeline.width0, pipeline.height0, pipeline.width1, pipeline.height1,
+           pipeline.width2, pipeline.height2, pipeline.width3, pipeline.height3);
+
+    // Buffers to read out pixels from last texture
+    // With a pyramid, the last level follows right after it
+    uint32_t buffer_size = pipeline.width2 * pipeline.height2 * 4;
+    if (pipeline.levels > 1)
+        buffer_size += pipeline.width3 * pipeline.height3 * 4;
+    pixelbufferHandoff = new PixelbufferHandoff(PIXELBUFFER_QUEUE_DEPTH, buffer_size, PIXELBUFFER_DROP_OLDEST);
+    if (!pixelbufferHandoff->valid()) {
+        printf("Could not allocate pixelbuffer.\n");
+        return -1;
+    }
+
+    zeroCopy = readout_zero_copy();
+    if (zeroCopy && PIXELBUFFER_DROP_OLDEST) {
+        printf("WARNING: Zero copy readout does not work with PIXELBUFFER_DROP_OLDEST, copying instead.\n");
+        zeroCopy = false;
+    }
+    fenceReadout = (fenceReadoutRequested && RenderFence::supported());
+    printf("Ball readout: %s\n", fenceReadout ? "after a fence" : "with frame delays");
+    pyramidSets = (zeroCopy ? MaxPyramidSets : (fenceReadout ? 3 : 2));
+    fencedSetCount = 0;
+
+    printf("Creating render-to-texture targets\n");
+    for (int i = 0; i < 2; ++i)
+        texColorFilter[i] = new Texture(pipeline.width1, pipeline.height1, GL_LINEAR);
+    for (int i = 0; i < pyramidSets; ++i) {
+        texPyramid[i][0] = readout_create_texture(pipeline.width2, pipeline.height2, GL_LINEAR);
+        for (int level = 1; level < pipeline.levels; ++level)
+            texPyramid[i][level] = readout_create_texture(pipeline_level_width(pipeline, level),
+                                                            pipeline_level_height(pipeline, level), GL_LINEAR);
+        texPyramidInUse[i].store(false);
+        pyramidFence[i].reset();
+        if (gpuSearch)
+            texBallResult[i] = readout_create_texture(2, 1);
+    }
+    if (gpuSearch) {
+        for (int level = 0; level < ballMaxLevels; ++level) {
+            int width, height;
+            ball_max_size(level, &width, &height);
+            texBallMax[level] = new Texture(width, height, GL_NEAREST);
+        }
+    }
+    texColorFilter_read = texColorFilter[0];
+    texColorFilter_write = texColorFilter[1];
+    pyramidReadSet = 0;
+    pyramidWriteSet = 1;
+    texPyramid_read = texPyramid[pyramidReadSet];
+    texPyramid_write = texPyramid[pyramidWriteSet];
+    texDownscaled_read = texPyramid_read[0];
+    texDownscaled_write = texPyramid_write[0];
+
+    texColorFilterField = new Texture(pipeline.width1, pipeline.height1, GL_LINEAR);
+    texDownscaledField = new Texture(pipeline.width2, pipeline.height2, GL_NEAREST);
+    // Column sums in the first row, row sums in the second
+    int fieldSumsWidth = (4 * pipeline.width2 > pipeline.height2 ? 4 * pipeline.width2 : pipeline.height2);
+    texFieldSums = readout_create_texture(fieldSumsWidth, 2);
+
+#ifdef DO_DIFF
+    rtt_copytex = new Texture(pipeline.width0, pipeline.height0, GL_NEAREST);
+#endif
+#ifdef DO_FRAMEDUMPS
+    texFramedump = new Texture(pipeline.width0, pipeline.height0, GL_NEAREST);
+#endif
+
+    // The new textures are empty, so the pipeline starts over
+    pipelineFrameNumber = -5;
+    fieldUpdateFrames = 0;
+    fieldFence.reset();
+    return 0;
+}
+
+void delete_textures() {
+    if (pixelbufferHandoff) {
+        printf("Analysis queue: %u buffers, %u dropped, at most %u waiting.\n",
+               pixelbufferHandoff->published(), pixelbufferHandoff->dropped(),
+               pixelbufferHandoff->max_queued());
+        delete pixelbufferHandoff;
+        pixelbufferHandoff = 0;
+    }
+
+    // The FBOs have the textures attached
+    framebufferCache.clear();
+
+    for (int i = 0; i < 2; ++i) {
+        if (texColorFilter[i])
+            delete texColorFilter[i];
+        texColorFilter[i] = 0;
+    }
+    for (int i = 0; i < MaxPyramidSets; ++i) {
+        pyramidFence[i].reset();
+        for (int level = 0; level < MaxPyramidLevels; ++level) {
+            if (texPyramid[i][level])
+                delete texPyramid[i][level];
+            texPyramid[i][level] = 0;
+        }
+        if (texBallResult[i])
+            delete texBallResult[i];
+        texBallResult[i] = 0;
+    }
+    for (int level = 0; level < MaxBallMaxLevels; ++level) {
+        if (texBallMax[level])
+            delete texBallMax[level];
+        texBallMax[level] = 0;
+    }
+    if (texColorFilterField)
+        delete texColorFilterField;
+    if (texDownscaledField)
+        delete texDownscaledField;
+    if (texFieldSums)
+        delete texFieldSums;
+    texColorFilterField = 0;
+    texDownscaledField = 0;
+    texFieldSums = 0;
+    fieldFence.reset();
+
+#ifdef DO_DIFF
+    if (rtt_copytex)
+        delete rtt_copytex;
+    rtt_copytex = 0;
+#endif
+#ifdef DO_FRAMEDUMPS
+    if (texFramedump)
+        delete texFramedump;
+    texFramedump = 0;
+#endif
+}
+
+//
+// FBO benchmark
+// Both modes run on the same footage, in turns of FboBenchmarkFrames frames.
+// For every frame it measures how long balltrack_core_process_image takes,
+// which is where the GL calls wait when the driver flushes, and the time
+// until the next frame, which includes eglSwapBuffers.
+//
+constexpr int FboBenchmarkFrames = 200;
+
+struct FboTimings {
+    int frames = 0;
+    long long processTime = 0; // microseconds
+    long long frameTime = 0;
+};
+FboTimings fboTimings[2]; // FBO_SINGLE, FBO_PER_TEXTURE
+int fboBenchmarkMode = FBO_SINGLE; // Current mode of the benchmark
+int fboBenchmarkCount = 0;         // Frames in the current mode
+long long fboFrameStart = 0;       // Start of the current frame, 0 when it is not measured
+
+void print_fbo_benchmark() {
+    if (fboTimings[0].frames == 0 && fboTimings[1].frames == 0)
+        return;
+    const char* names[2] = {"single FBO", "FBO per texture"};
+    for (int i = 0; i < 2; ++i) {
+        const FboTimings& t = fboTimings[i];
+        if (t.frames == 0)
+            continue;
+        printf("FBO benchmark: %-16s %6d frames, process_image %.3f ms, frame %.3f ms\n", names[i], t.frames,
+               0.001 * (double)t.processTime / t.frames, 0.001 * (double)t.frameTime / t.frames);
+    }
+}
+
+// Called at the start of balltrack_core_process_image
+void fbo_benchmark_begin_frame() {
+    if (fboMode != FBO_BENCHMARK)
+        return;
+    long long now = time_us();
+    if (fboFrameStart)
+        fboTimings[fboBenchmarkMode].frameTime += now - fboFrameStart;
+    fboFrameStart = now;
+
+    if (++fboBenchmarkCount > FboBenchmarkFrames) {
+        fboBenchmarkMode = (fboBenchmarkMode == FBO_SINGLE ? FBO_PER_TEXTURE : FBO_SINGLE);
+        fboBenchmarkCount = 0;
+        // The first frame after a switch is not counted
+        fboFrameStart = 0;
+        if (fboBenchmarkMode == FBO_SINGLE)
+            print_fbo_benchmark();
+    }
+}
+
+// Called at the end of balltrack_core_process_image
+void fbo_benchmark_end_frame() {
+    if (fboMode != FBO_BENCHMARK || !fboFrameStart)
+        return;
+    FboTimings& t = fboTimings[fboBenchmarkMode];
+    t.processTime += time_us() - fboFrameStart;
+    t.frames++;
+}
+
+// Bind the framebuffer that renders to `target`
+void bind_render_target(Texture* target) {
+    int mode = (fboMode == FBO_BENCHMARK ? fboBenchmarkMode : fboMode);
+    if (mode == FBO_PER_TEXTURE) {
+        framebufferCache.bind(target);
+    } else {
+        GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, fbo));
+        GLCHK(glFramebufferTexture2DOES(GL_FRAMEBUFFER_OES, GL_COLOR_ATTACHMENT0_OES, GL_TEXTURE_2D, target->id, 0));
+    }
+}
+
+void balltrack_core_set_fbo_mode(int mode)
+{
+    if (mode != FBO_SINGLE && mode != FBO_PER_TEXTURE && mode != FBO_BENCHMARK) {
+        printf("Unknown FBO mode %d, use 0, 1 or 2.\n", mode);
+        return;
+    }
+    if (mode == FBO_BENCHMARK) {
+        fboBenchmarkMode = FBO_SINGLE;
+        fboBenchmarkCount = 0;
+        fboFrameStart = 0;
+        fboTimings[0] = FboTimings();
+        fboTimings[1] = FboTimings();
+    }
+    fboMode = mode;
+}
+
+int balltrack_core_set_gpu_search(int enabled)
+{
+    if (allInitialized) {
+        printf("The ball search can only be moved to the GPU before balltrack_core_init.\n");
+        return -1;
+    }
+    gpuSearch = (enabled != 0);
+    return 0;
+}
+
+void balltrack_core_set_overlay(int enabled)
+{
+    overlayEnabled = (enabled != 0);
+}
+
+int balltrack_core_set_fence_readout(int enabled)
+{
+    if (allInitialized) {
+        printf("The fence readout can only be set before balltrack_core_init.\n");
+        return -1;
+    }
+    fenceReadoutRequested = (enabled != 0);
+    return 0;
+}
+
+int balltrack_core_set_readout(int method)
+{
+    if (allInitialized) {
+        printf("The readout method can only be set before balltrack_core_init.\n");
+        return -1;
+    }
+    readoutRequested = method;
+    return 0;
+}
+
+// Choose the readout method for the ball buffer size.
+// This renders to temporary textures, so it is done before
+// creating the real ones, and their FBOs are dropped after.
+void calibrate_readout() {
+    readout_calibrate(pipeline.width2, pipeline.height2);
+    framebufferCache.clear();
+}
+
+// Start an analysis thread
+// For every readout, the GL thread takes a free buffer from the
+// lock-free pixelbufferHandoff and reads into there.
+// Then the analysis thread can consume the buffers from there,
+// while the GL thread continues. See PixelbufferHandoff for the wakeups.
+int start_analysis_thread() {
+    VCOS_STATUS_T status;
+
+    analysis_stop = 0;
+    status = vcos_thread_create(&analysis_thread_handle, "analysis-thread", NULL, analysis_thread, 0);
+    if (status != VCOS_SUCCESS) {
+        printf("Failed to start balltrack analysis thread %d\n", status);
+        return -1;
+    }
+    analysisThreadStarted = true;
+    return 0;
+}
+
+// Waits until the analysis thread has processed all queued buffers
+void stop_analysis_thread() {
+    if (!analysisThreadStarted)
+        return;
+    analysisThreadStarted = false;
+    analysis_stop = 1;
+    pixelbufferHandoff->wake_consumer();
+    vcos_thread_join(&analysis_thread_handle, NULL);
+}
+
+// Builds the shaders, textures and analysis thread for the current
+// pipeline, after balltrack_core_init. On failure, whatever was
+// built is removed again.
+int rebuild_pipeline() {
+    calibrate_readout();
+    if (build_shaders()) {
+        cleanupShaders();
+        return -1;
+    }
+    if (create_textures() || start_analysis_thread()) {
+        delete_textures();
+        cleanupShaders();
+        return -1;
+    }
+    return 0;
+}
+
+int balltrack_core_configure(int width, int height, int filterScale,
+                             int downsampleFactor, int searchFactor)
+{
+    PipelineConfig config = pipeline;
+    if (pipeline_config_init(&config, width, height, filterScale, downsampleFactor, searchFactor))
+        return -1;
+    if (!allInitialized) {
+        // Used by balltrack_core_init
+        pipeline = config;
+        return 0;
+    }
+
+    // Rebuild everything that depends on the sizes.
+    // The analysis thread is stopped first, so that it does not
+    // get any buffers of the old size after the switch.
+    allInitialized = false;
+    stop_analysis_thread();
+    delete_textures();
+    cleanupShaders();
+    PipelineConfig previous = pipeline;
+    pipeline = config;
+    if (rebuild_pipeline() == 0) {
+        allInitialized = true;
+        return 0;
+    }
+
+    // Go back to the configuration that worked before
+    printf("Could not build the pipeline for %dx%d, going back to %dx%d.\n",
+           config.width0, config.height0, previous.width0, previous.height0);
+    pipeline = previous;
+    if (rebuild_pipeline()) {
+        printf("ERROR: Could not build the previous pipeline either, the tracker is stopped.\n");
+        return -1;
+    }
+    allInitialized = true;
+    return -1;
+}
+
 int balltrack_core_init(int externalSamplerExtension, int flipY)
 {
     vcos_log_register("Balltracker", VCOS_LOG_CATEGORY);
     vcos_log_set_level(VCOS_LOG_CATEGORY, VCOS_LOG_INFO);
 
-#ifdef USE_VCSM
-    // Initialize VideoCore Shared Memory
-    // So that we can readout the result of the GPU using the CPU,
-    // directly accessing the memory instead of using glReadPixels.
-    // This should be faster, however, it access to `dev/vcsm`.
-    if (vcsm_init()) {
-        printf("ERROR: Could not access /dev/vcsm (VideoCore Shared Memory).\n");
-        printf("       Use sudo or read the README for better ways to access /dev/vcsm.\n");
+    if (readout_init(readoutRequested, bind_render_target))
         return -1;
-    }
-#endif
 
     const char* glRenderer = (const char*)glGetString(GL_RENDERER);
     printf("OpenGL renderer string: %s\n", glRenderer);
@@ -265,64 +834,20 @@ int balltrack_core_init(int externalSamplerExtension, int flipY)
         //balltrack_shader_3.vertex_source = BALLTRACK_VSHADER_YFLIP_SOURCE;
     }
 
-    if (shader_colorfilter_ball.build())
-        return -1;
-    if (shader_colorfilter_field.build())
-        return -1;
-    if (shader_downsample.build())
-        return -1;
-#ifdef DEBUG_TEXTURES
-    if (shader_debug.build())
-        return -1;
-#endif
-    if (shader_simple.build())
-        return -1;
-    if (shader_fixedcolor.build())
-        return -1;
-#ifdef DO_YUV
-    if (shader_yuv.build())
-        return -1;
-#endif
-#ifdef DO_DIFF
-    if (shader_diff.build())
-        return -1;
-#endif
-
-    // Buffer to read out pixels from last texture
-    uint32_t buffer_size = width2 * height2 * 4;
-    for (int i = 0; i < PIXELBUFFER_COUNT; ++i) {
-        pixelbuffers[i] = (uint8_t*)malloc(buffer_size);
-        if (!pixelbuffers[i]) {
-            printf("Could not allocate pixelbuffer.\n");
-            return -1;
-        }
-    }
-
     // Create frame buffer object for render-to-texture
     printf("Generating framebuffer object\n");
     GLCHK(glGenFramebuffersOES(1, &fbo));
     GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, fbo));
     GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, 0)); // unbind it
 
-    printf("Creating render-to-texture targets\n");
-    for (int i = 0; i < 2; ++i) {
-        texColorFilter[i] = new Texture(width1, height1, GL_LINEAR);
-        texDownscaled[i] = new ReadoutTexture(width2, height2);
-    }
-    texColorFilter_read = texColorFilter[0];
-    texColorFilter_write = texColorFilter[1];
-    texDownscaled_read = texDownscaled[0];
-    texDownscaled_write = texDownscaled[1];
+    // The shaders depend on the readout method, for the texture sizes
+    calibrate_readout();
 
-    texColorFilterField = new Texture(width1, height1, GL_LINEAR);
-    texDownscaledField = new ReadoutTexture(width2, height2);
+    if (build_shaders())
+        return -1;
 
-#ifdef DO_DIFF
-    rtt_copytex = new Texture(width0, height0, GL_NEAREST);
-#endif
-#ifdef DO_FRAMEDUMPS
-    texFramedump = new Texture(width0, height0, GL_NEAREST);
-#endif
+    if (create_textures())
+        return -1;
 
     printf("Creating vertex-buffer object\n");
     GLCHK(glGenBuffers(1, &quad_vbo));
@@ -334,31 +859,11 @@ int balltrack_core_init(int externalSamplerExtension, int flipY)
     GLCHK(glDisable(GL_DEPTH_TEST));
     GLCHK(glLineWidth(4.0f));
 
-    // Create a binary and N-ary semaphore and start an analysis thread
-    // Also allocate N pixelbuffers
-    // For every glReadPixels, use semaphores to get a free buffer
-    // and read into there.
-    // Then the analysis thread can consume the buffers from there,
-    // while the GL thread continues.
-    VCOS_STATUS_T status;
-
-    status = vcos_semaphore_create(&semFullCount, "analysis_fullcount", 0);
-    if (status != VCOS_SUCCESS) {
-        printf("Failed to create balltrack semaphore %d\n", status);
-        return -1;
-    }
+    analysis_set_clock(render_fps);
+    analysis_init();
 
-    status = vcos_semaphore_create(&semEmptyCount, "analysis_emptycount", PIXELBUFFER_COUNT);
-    if (status != VCOS_SUCCESS) {
-        printf("Failed to create balltrack semaphore %d\n", status);
+    if (start_analysis_thread())
         return -1;
-    }
-
-    status = vcos_thread_create(&analysis_thread_handle, "analysis-thread", NULL, analysis_thread, 0);
-    if (status != VCOS_SUCCESS) {
-        printf("Failed to start balltrack analysis thread %d\n", status);
-        return -1;
-    }
 
     allInitialized = true;
     return 0;
@@ -369,146 +874,219 @@ void balltrack_core_term()
     allInitialized = false;
 
     // Wait for analysis thread to finish
-    analysis_stop = 1;
-    vcos_thread_join(&analysis_thread_handle, NULL);
-    vcos_semaphore_delete(&semFullCount);
-    vcos_semaphore_delete(&semEmptyCount);
+    stop_analysis_thread();
+    analysis_term();
 
     cleanupShaders();
 
-    for (int i = 0; i < PIXELBUFFER_COUNT; ++i) {
-        if (pixelbuffers[i])
-            free(pixelbuffers[i]);
-    }
+    TRACE_DUMP("/tmp/balltrack_trace.json");
+
+    print_fbo_benchmark();
 
     GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, 0));
     GLCHK(glDeleteFramebuffersOES(1, &fbo));
 
-    for (int i = 0; i < 2; ++i) {
-        if (texColorFilter[i])
-            delete texColorFilter[i];
-        if (texDownscaled[i])
-            delete texDownscaled[i];
-        texColorFilter[i] = 0;
-        texDownscaled[i] = 0;
-    }
-    if (texColorFilterField)
-        delete texColorFilterField;
-    if (texDownscaledField)
-        delete texDownscaledField;
-    texColorFilterField = 0;
-    texDownscaledField = 0;
-
-#ifdef DO_DIFF
-    if (rtt_copytex)
-        delete rtt_copytex;
-#endif
+    delete_textures();
+    readout_term();
 
     GLCHK(glDeleteBuffers(1, &quad_vbo));
+    overlayLines.release();
     return;
 }
 
 
+// Analyse the ball textures in place, for zero copy readout
+void process_ball_textures(ReadoutTexture** levels) {
+    ReadoutTexture* tex = levels[0];
+    ReadoutTexture* coarse = (pipeline.levels > 1 ? levels[pipeline.levels - 1] : 0);
+    uint8_t* pixels = readout_lock(tex);
+    uint8_t* coarsePixels = (coarse ? readout_lock(coarse) : 0);
+    if (pixels && (coarsePixels || !coarse)) {
+        analysis_process_ball_buffer(pixels, 4 * pipeline.width2, pipeline.height2,
+                                     coarsePixels, pipeline.searchFactor / pipeline.downsampleFactor,
+                                     4 * tex->potWidth, (coarse ? 4 * coarse->potWidth : 0));
+    }
+    readout_unlock(coarsePixels);
+    readout_unlock(pixels);
+}
+
+// The result of the ball search on the GPU, in place, for zero copy readout
+void process_ball_result_texture(ReadoutTexture* tex) {
+    uint8_t* pixels = readout_lock(tex);
+    if (pixels)
+        analysis_process_ball_result(pixels, 4 * pipeline.width2, pipeline.height2);
+    readout_unlock(pixels);
+}
+
+// Whether a pyramid set other than `except` is not with the analysis thread
+bool pyramid_set_available(int except) {
+    for (int set = 0; set < pyramidSets; ++set) {
+        if (set != except && !texPyramidInUse[set].load(std::memory_order_acquire))
+            return true;
+    }
+    return false;
+}
+
 void* analysis_thread(void *arg)
 {
     printf("Balltrack analysis thread started.\n");
+    TRACE_THREAD_NAME("analysis");
     while (analysis_stop == 0) {
         // Wait for GL thread till there is a full buffer
-        vcos_semaphore_wait(&semFullCount);
-
-        // Get the buffer
-        auto type = pixelbufferType[nextFullBuffer];
-        uint8_t* buffer = pixelbuffers[nextFullBuffer];
-        ++nextFullBuffer;
-        if (nextFullBuffer == PIXELBUFFER_COUNT)
-            nextFullBuffer = 0;
-
-        // Process the buffer
-        if (type == BUFFERTYPE_BALL)
-            analysis_process_ball_buffer(buffer, 4 * width2, height2);
-        else
-            analysis_process_field_buffer(buffer, 4 * width2, height2);
-
-        // Notify GL thread that a buffer is available
-        vcos_semaphore_post(&semEmptyCount);
+        pixelbufferHandoff->wait_published();
+
+        // Get the buffers. The queue can also be empty here,
+        // when the GL thread has dropped a buffer.
+        int type;
+        int64_t frame;
+        uint8_t* buffer;
+        while ((buffer = pixelbufferHandoff->pop(&type, &frame))) {
+            TRACE_FRAME(frame);
+            // Process the buffer
+            if (type == BUFFERTYPE_BALL) {
+                TRACE_BEGIN("process_ball_buffer");
+                const uint8_t* coarse = 0;
+                if (pipeline.levels > 1)
+                    coarse = buffer + 4 * pipeline.width2 * pipeline.height2;
+                analysis_process_ball_buffer(buffer, 4 * pipeline.width2, pipeline.height2,
+                                             coarse, pipeline.searchFactor / pipeline.downsampleFactor);
+                TRACE_END("process_ball_buffer");
+            } else if (type == BUFFERTYPE_BALL_RESULT) {
+                TRACE_BEGIN("process_ball_buffer");
+                analysis_process_ball_result(buffer, 4 * pipeline.width2, pipeline.height2);
+                TRACE_END("process_ball_buffer");
+            } else if (type == BUFFERTYPE_BALL_TEXTURES) {
+                TRACE_BEGIN("process_ball_buffer");
+                int set;
+                memcpy(&set, buffer, sizeof(set));
+                if (gpuSearch)
+                    process_ball_result_texture(texBallResult[set]);
+                else
+                    process_ball_textures(texPyramid[set]);
+                texPyramidInUse[set].store(false, std::memory_order_release);
+                TRACE_END("process_ball_buffer");
+            } else if (type == BUFFERTYPE_FIELD_SUMS) {
+                TRACE_BEGIN("process_field_buffer");
+                analysis_process_field_result(buffer, 4 * pipeline.width2, pipeline.height2);
+                TRACE_END("process_field_buffer");
+            } else {
+                TRACE_BEGIN("process_field_buffer");
+                analysis_process_field_buffer(buffer, 4 * pipeline.width2, pipeline.height2);
+                TRACE_END("process_field_buffer");
+            }
+
+            // Give the buffer back to the GL thread
+            pixelbufferHandoff->release();
+        }
     }
     printf("Balltrack analysis thread ending.\n");
     return 0;
 }
 
 // Readout the buffer and send it to the analysis thread
-void send_buffer_to_analysis(PixelBufferType buffertype, ReadoutTexture* tex) {
-    int width = width2;
-    int height = height2;
-    uint8_t* buf = 0;
-
-    // Wait for analysis thread for an empty buffer
-    vcos_semaphore_wait(&semEmptyCount);
-
-    // Claim it
-    buf = pixelbuffers[nextEmptyBuffer];
-    pixelbufferType[nextEmptyBuffer] = buffertype;
-    ++nextEmptyBuffer;
-    if (nextEmptyBuffer == PIXELBUFFER_COUNT)
-        nextEmptyBuffer = 0;
-
-#ifdef USE_VCSM
-    // Not needed anymore, since we read the texture that was written in the previous frame
-    //GLCHK(glFinish());
-
-    // Make the buffer CPU addressable with host cache enabled
-    VCSM_CACHE_TYPE_T cache_type;
-    uint8_t* vcsm_buffer = (uint8_t*)vcsm_lock_cache(tex->vcsm_info.vcsm_handle, VCSM_CACHE_TYPE_HOST, &cache_type);
-    if (!vcsm_buffer) {
-        printf("ERROR: Failed to lock VCSM buffer.\n");
-    } else {
-        // Copy it into the available buffer
-        // vcsm_buffer has size tex.potWidth x tex.potHeight
-        // so we have to take that into account
-        uint8_t* src = vcsm_buffer;
-        uint8_t* dst = buf;
-        for (int y = 0; y < tex->height; ++y) {
-            memcpy(dst, src, 4 * tex->width);
-            src += 4 * tex->potWidth;
-            dst += 4 * tex->width;
-        }
+// `coarse` is the last level of the pyramid, it is put after `tex` in the buffer
+void send_buffer_to_analysis(PixelBufferType buffertype, ReadoutTexture* tex, ReadoutTexture* coarse = 0) {
+    TRACE_BEGIN("readout");
+    pixelbufferHandoff->send(buffertype, tex->frame, [=](uint8_t* buf) {
+        readout_texture(tex, buf);
+        if (coarse)
+            readout_texture(coarse, buf + 4 * tex->width * tex->height);
+    });
+    TRACE_END("readout");
+}
 
-        // Release the locked texture memory to flush the CPU cache and allow GPU to use it
-        vcsm_unlock_ptr(vcsm_buffer);
+// Send the pyramid textures of `set` to the analysis thread without a readout
+// It gives them back by clearing texPyramidInUse
+void send_textures_to_analysis(int set) {
+    TRACE_BEGIN("readout");
+    pixelbufferHandoff->send(BUFFERTYPE_BALL_TEXTURES, texPyramid[set][0]->frame, [=](uint8_t* buf) {
+        memcpy(buf, &set, sizeof(set));
+        texPyramidInUse[set].store(true, std::memory_order_release);
+    });
+    TRACE_END("readout");
+}
+
+// Read out the ball buffer of `set`, or the result of the ball search,
+// or give the textures to the analysis thread with zero copy
+void send_pyramid_set(int set) {
+    if (zeroCopy) {
+        send_textures_to_analysis(set);
+    } else if (gpuSearch) {
+        send_buffer_to_analysis(BUFFERTYPE_BALL_RESULT, texBallResult[set]);
+    } else {
+        ReadoutTexture* coarse = (pipeline.levels > 1 ? texPyramid[set][pipeline.levels - 1] : 0);
+        send_buffer_to_analysis(BUFFERTYPE_BALL, texPyramid[set][0], coarse);
     }
-#else
-    GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, fbo));
-    GLCHK(glFramebufferTexture2DOES(GL_FRAMEBUFFER_OES, GL_COLOR_ATTACHMENT0_OES, GL_TEXTURE_2D, tex->id, 0));
-    GLCHK(glViewport(0, 0, tex->width, tex->height));
-    GLCHK(glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buf));
-#endif
+}
 
-    // Notify analysis thread
-    vcos_semaphore_post(&semFullCount);
+// With fence readout: read out the oldest `count` fenced sets
+void send_fenced_sets(int count) {
+    for (int i = 0; i < count; ++i)
+        send_pyramid_set(fencedSets[i]);
+    fencedSetCount -= count;
+    memmove(fencedSets, fencedSets + count, fencedSetCount * sizeof(fencedSets[0]));
 }
 
+// With fence readout: read out the sets that the GPU has finished, in order
+void send_finished_sets() {
+    int count = 0;
+    while (count < fencedSetCount && pyramidFence[fencedSets[count]].signaled())
+        ++count;
+    send_fenced_sets(count);
+}
 
-// x,y are coordinates in [-1,1]x[-1,1] range
-void draw_line_strip(POINT* xys, int count, uint32_t color) {
-    if (count == 0)
-        return;
+// With fence readout: the next set that is not waiting for its readout.
+// When the GPU is too far behind, wait for the oldest one.
+int next_fenced_set() {
+    for (;;) {
+        for (int i = 1; i <= pyramidSets; ++i) {
+            int set = (pyramidWriteSet + i) % pyramidSets;
+            if (!pyramidFence[set].pending() && !texPyramidInUse[set].load(std::memory_order_acquire))
+                return set;
+        }
+        if (fencedSetCount > 0) {
+            TRACE_BEGIN("fence_wait");
+            pyramidFence[fencedSets[0]].wait();
+            TRACE_END("fence_wait");
+            send_fenced_sets(1);
+        } else {
+            // Zero copy, all sets are with the analysis thread
+            pixelbufferHandoff->wait_for_consumer([] { return pyramid_set_available(-1); });
+        }
+    }
+}
 
-    float r, g, b, a;
-    r = (1.0/255.0) * ((color      ) & 0xff);
-    g = (1.0/255.0) * ((color >>  8) & 0xff);
-    b = (1.0/255.0) * ((color >> 16) & 0xff);
-    a = (1.0/255.0) * ((color >> 24) & 0xff);
+// The textures that were rendered to in the previous frame are now read out,
+// and the next set is rendered to. With zero copy readout, the sets that
+// the analysis thread still has are skipped. When it falls behind, all of
+// them can be in use, and then we wait, like for a pixelbuffer.
+// With fence readout, the previous set is read out when it is finished.
+void rotate_pyramid() {
+    pyramidReadSet = pyramidWriteSet;
+    if (fenceReadout) {
+        pyramidWriteSet = next_fenced_set();
+    } else if (!zeroCopy) {
+        pyramidWriteSet = 1 - pyramidReadSet;
+    } else {
+        int readSet = pyramidReadSet;
+        pixelbufferHandoff->wait_for_consumer([=] { return pyramid_set_available(readSet); });
+        int next = pyramidReadSet;
+        do {
+            next = (next + 1) % pyramidSets;
+        } while (texPyramidInUse[next].load(std::memory_order_acquire));
+        pyramidWriteSet = next;
+    }
+    texPyramid_read = texPyramid[pyramidReadSet];
+    texPyramid_write = texPyramid[pyramidWriteSet];
+    texDownscaled_read = texPyramid_read[0];
+    texDownscaled_write = texPyramid_write[0];
+}
 
-    ShaderProgram* shader = &shader_fixedcolor;
-    GLCHK(glUseProgram(shader->program));
-    GLCHK(glUniform4f(shader->uniforms[0].location, r, g, b, a));
 
-    // Unbind the vertex buffer --> use client memory
-    GLCHK(glBindBuffer(GL_ARRAY_BUFFER, 0));
-    GLCHK(glEnableVertexAttribArray(shader->attribute_locations[0]));
-    GLCHK(glVertexAttribPointer(shader->attribute_locations[0], 2, GL_FLOAT, GL_FALSE, 0, (GLfloat*)xys));
-    // Draw
-    GLCHK(glDrawArrays(GL_LINE_STRIP, 0, count));
+// x,y are coordinates in [-1,1]x[-1,1] range
+// The lines are drawn at the end of the frame, see overlayLines
+void draw_line_strip(POINT* xys, int count, uint32_t color) {
+    overlayLines.add_line_strip((const GLfloat*)xys, count, color);
 }
 
 // x,y are coordinates in [-1,1]x[-1,1] range
@@ -529,12 +1107,17 @@ void draw_square(float xmin, float xmax, float ymin, float ymax, uint32_t color)
 }
 
 // If target.id is zero, then target is the screen
-int render_pass(ShaderProgram* shader, Texture* source, Texture* target) {
+// The trace only shows how long it takes to submit the pass,
+// the GPU executes it later.
+// With a ROI, the complete target is cleared but only
+// the pixels inside the ROI are rendered.
+int render_pass(ShaderProgram* shader, Texture* source, Texture* target, const ROI* roi = 0) {
+    TRACE_BEGIN(shader->display_name);
+    target->frame = source->frame;
     GLCHK(glUseProgram(shader->program));
     if (target->id) {
         // Enable Render-to-texture and set the output texture
-        GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, fbo));
-        GLCHK(glFramebufferTexture2DOES(GL_FRAMEBUFFER_OES, GL_COLOR_ATTACHMENT0_OES, GL_TEXTURE_2D, target->id, 0));
+        bind_render_target(target);
         GLCHK(glViewport(0, 0, target->width, target->height));
         // According to the open source GL driver for the VC4 chip,
         // [ https://github.com/anholt/mesa/wiki/VC4-Performance-Tricks ],
@@ -553,14 +1136,39 @@ int render_pass(ShaderProgram* shader, Texture* source, Texture* target) {
     GLCHK(glBindBuffer(GL_ARRAY_BUFFER, quad_vbo));
     GLCHK(glEnableVertexAttribArray(shader->attribute_locations[0]));
     GLCHK(glVertexAttribPointer(shader->attribute_locations[0], 2, GL_FLOAT, GL_FALSE, 0, 0));
+    if (roi) {
+        int x0, y0, x1, y1;
+        roi_to_pixels(*roi, target->width, target->height, &x0, &y0, &x1, &y1);
+        GLCHK(glEnable(GL_SCISSOR_TEST));
+        GLCHK(glScissor(x0, y0, x1 - x0, y1 - y0));
+    }
     // Draw
     GLCHK(glDrawArrays(GL_TRIANGLES, 0, 6));
+    if (roi)
+        GLCHK(glDisable(GL_SCISSOR_TEST));
+    TRACE_END(shader->display_name);
     return 0;
 }
 
+// Reduce the ball buffer to the result of the ball search
+void render_ball_search(ReadoutTexture* ballBuffer, ReadoutTexture* result) {
+    int xbegin, xend, ybegin, yend;
+    analysis_ball_search_area(4 * pipeline.width2, pipeline.height2, &xbegin, &xend, &ybegin, &yend);
+    GLCHK(glUseProgram(shader_ballmax[0].program));
+    GLCHK(glUniform4f(shader_ballmax[0].uniforms[3].location, (float)xbegin, (float)ybegin, (float)xend, (float)yend));
+
+    render_pass(&shader_ballmax[0], ballBuffer, texBallMax[0]);
+    for (int level = 1; level < ballMaxLevels; ++level)
+        render_pass(&shader_ballmax[level], texBallMax[level - 1], texBallMax[level]);
+
+    GLCHK(glActiveTexture(GL_TEXTURE1));
+    GLCHK(glBindTexture(GL_TEXTURE_2D, texBallMax[ballMaxLevels - 1]->id));
+    render_pass(&shader_ballcentroid, ballBuffer, result);
+}
+
 template <typename T>
 void swap(T& a, T& b) {
-    T& tmp = a;
+    T tmp = a;
     a = b;
     b = tmp;
 }
@@ -573,13 +1181,17 @@ int balltrack_core_process_image(int width, int height, GLuint srctex, GLuint sr
         return -1;
 
     update_render_fps();
+    fbo_benchmark_begin_frame();
 
-    static int frameNumber = -5;
-    ++frameNumber;
+    int frameNumber = ++pipelineFrameNumber;
 
     // Width,height is the size of the preview window on screen
     auto input = TextureWrapper(srctex, 0, 0, srctype);
     auto screen = TextureWrapper(0, width, height, 0);
+#ifdef FRAME_TRACING
+    // Set by the caller, so that the textures can carry it along
+    input.frame = trace_get_frame();
+#endif
 
 #ifdef DO_FRAMEDUMPS
     if (frameNumber >= 100 && (frameNumber % 20) == 0) {
@@ -601,38 +1213,62 @@ int balltrack_core_process_image(int width, int height, GLuint srctex, GLuint sr
     render_pass(&shader_simple, &input, rtt_copytex);
 #endif
 
-    // Every X steps, we update the size of the green field bounding box
-    static int fieldUpdateSteps = FieldUpdateDelay; // Countdown
-    if (fieldUpdateSteps == 5) {
+    // Every few frames, we update the size of the green field bounding box
+    // Apparently it can happen that a render operation is not completed,
+    // *even two frames later* !! So the sums are only read out when the
+    // fence after the field passes is signaled.
+    // This problem does not happen for the ball buffers because
+    // Frame 1:  in -> a1
+    //           a2 -> b1       <---
+    //           b2 -> readout
+    // Frame 2:  in -> a2       <--- This call writes to a2, meaning the (a2->b1) must be finished
+    //           a1 -> b2
+    //           b1 -> readout  <--- So this one should be fine
+    ++fieldUpdateFrames;
+    if (fieldFence.pending()) {
+        if (fieldFence.signaled())
+            send_buffer_to_analysis(BUFFERTYPE_FIELD_SUMS, texFieldSums);
+    } else if (fieldUpdateFrames >= FieldUpdateInterval) {
         render_pass(&shader_colorfilter_field, &input, texColorFilterField);
-    } else if(fieldUpdateSteps == 4) {
         render_pass(&shader_downsample, texColorFilterField, texDownscaledField);
-    } else if(fieldUpdateSteps == 0) {
-        // There is an extra gap of a few frames there because
-        // apparently it can happen that the previous render operation
-        // is not completed, *even two frames later* !!
-        // I think this problem does not happen for the ball buffers because
-        // Frame 1:  in -> a1
-        //           a2 -> b1       <---
-        //           b2 -> readout
-        // Frame 2:  in -> a2       <--- This call writes to a2, meaning the (a2->b1) must be finished
-        //           a1 -> b2
-        //           b1 -> readout  <--- So this one should be fine
-        send_buffer_to_analysis(BUFFERTYPE_FIELD, texDownscaledField);
-        fieldUpdateSteps = FieldUpdateDelay;
-    }
-    --fieldUpdateSteps;
+        render_pass(&shader_fieldsums, texDownscaledField, texFieldSums);
+        fieldFence.insert();
+        fieldUpdateFrames = 0;
+    }
 
     // The read texture of last frame now becomes the write texture
     // and vice versa
     swap(texColorFilter_write, texColorFilter_read);
-    swap(texDownscaled_write, texDownscaled_read);
+    if (fenceReadout)
+        send_finished_sets();
+    rotate_pyramid();
 
     // Ball color filter, downsample, and readout in parallel
-    render_pass(&shader_colorfilter_ball, &input, texColorFilter_write);
-    render_pass(&shader_downsample, texColorFilter_read, texDownscaled_write);
-    if (frameNumber >= 0) // The first 3 frames there is no valid buffer yet
-        send_buffer_to_analysis(BUFFERTYPE_BALL, texDownscaled_read);
+    // While the ball is tracked, the color filter only runs around
+    // its predicted position. This texture is analysed 3 frames
+    // after the last frame that the analysis thread has seen,
+    // or 2 with fence readout.
+    ROI roi;
+    if (analysis_predict_roi(&roi, fenceReadout ? 2 : 3))
+        render_pass(&shader_colorfilter_ball, &input, texColorFilter_write, &roi);
+    else
+        render_pass(&shader_colorfilter_ball, &input, texColorFilter_write);
+    // With fence readout, the downsample pass takes the color filter of this frame
+    render_pass(&shader_downsample, fenceReadout ? texColorFilter_write : texColorFilter_read, texDownscaled_write);
+    if (gpuSearch) {
+        // The pyramid is not needed, the GPU searches the complete buffer
+        render_ball_search(texDownscaled_write, texBallResult[pyramidWriteSet]);
+    } else {
+        for (int level = 1; level < pipeline.levels; ++level)
+            render_pass(&shader_pyramid[level], texPyramid_write[level - 1], texPyramid_write[level]);
+    }
+    if (fenceReadout) {
+        // Read out in a later frame, see send_finished_sets
+        pyramidFence[pyramidWriteSet].insert();
+        fencedSets[fencedSetCount++] = pyramidWriteSet;
+    } else if (frameNumber >= 0) { // The first 3 frames there is no valid buffer yet
+        send_pyramid_set(pyramidReadSet);
+    }
 
     // Last render pass: render to screen
 #ifdef DEBUG_TEXTURES
@@ -671,15 +1307,31 @@ int balltrack_core_process_image(int width, int height, GLuint srctex, GLuint sr
 #endif
 
     // Draw field and ball positions on top
-    // TODO: This is currently quite slow
-    analysis_draw();
+    if (overlayEnabled) {
+        TRACE_BEGIN("analysis_draw");
+        analysis_draw();
+        overlayLines.draw(&shader_overlay);
+        TRACE_END("analysis_draw");
+    }
 
+    fbo_benchmark_end_frame();
     return 0;
 }
 
-float stableFPS = 40; // Used in analysis.cpp
+void balltrack_core_set_fps(float fps)
+{
+    stableFPS = fps;
+}
+
+void balltrack_core_set_fps_measurement(int enabled)
+{
+    measureFPS = (enabled != 0);
+}
 
 void update_render_fps() {
+    if (!measureFPS)
+        return;
+
     static int frame_count = 0;
     static long long time_start = 0;
 
@@ -6,7 +6,11 @@ MIT License
 #ifndef BALLTRACKCORE_H
 #define BALLTRACKCORE_H
 
+#ifdef CPU_PIPELINE
+#include <stdint.h>
+#else
 #include <GLES/gl.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,11 +28,106 @@ extern "C" {
 //
 int balltrack_core_init(int externalSamplerExtension, int flipY);
 
+//
+// Set the resolution of the tracker pipeline (see pipeline.h)
+// The default is 1280x720 with the BIGTEX sizes.
+//
+// Call this before balltrack_core_init, or later from the same
+// thread as balltrack_core_process_* to rebuild the textures for
+// another camera mode (e.g. 640x480 at 90 fps).
+//
+// @param width, height Size of the source frames
+// @param filterScale   1: color filter on every source pixel
+//                      2: color filter on 2x2 averages (4 times less work)
+// @param downsampleFactor  Size of the macropixels of the ball buffer,
+//                      in color filter pixels: 4, 8 or 16
+// @param searchFactor  Size of the macropixels of the coarsest level of the
+//                      downsample pyramid, where the ball is searched first:
+//                      downsampleFactor times 1 (no pyramid), 2, 4 or 8
+// A filterScale, downsampleFactor or searchFactor of 0 keeps the current one.
+//
+// Returns -1 when these sizes are not supported, or when the pipeline
+// could not be rebuilt for them, and then the previous configuration
+// stays in use. If even that can not be rebuilt, the tracker stops
+// processing frames and only balltrack_core_term can be called.
+//
+int balltrack_core_configure(int width, int height, int filterScale,
+                             int downsampleFactor, int searchFactor);
+
+#ifdef CPU_PIPELINE
+//
+// Process an RGBA image from memory, on the CPU (see core_cpu.cpp)
+// Rows are stored bottom-to-top, like OpenGL textures and `dump_frame`
+//
+int balltrack_core_process_frame(const uint8_t* rgba, int width, int height);
+
+#else
 //
 // Process an image
 //
 int balltrack_core_process_image(int width, int height, GLuint srctex, GLuint srctype);
 
+//
+// How the render-to-texture targets are bound (see Optimizations.md)
+// FBO_SINGLE       One framebuffer object, and the target texture is attached
+//                  to it for every render pass (the default)
+// FBO_PER_TEXTURE  Every target texture has its own framebuffer object
+// FBO_BENCHMARK    Switch between the two every 200 frames, and print the
+//                  frame times of both every 400 frames and at the end
+//
+enum { FBO_SINGLE = 0, FBO_PER_TEXTURE = 1, FBO_BENCHMARK = 2 };
+void balltrack_core_set_fbo_mode(int mode);
+
+//
+// How the ball and field textures are read out into CPU memory:
+// 0 (auto), 1 (glReadPixels), 2 (VCSM) or 3 (VCSM mapped), see readout.h
+// Auto times the available methods at startup and takes the fastest.
+// Call this before balltrack_core_init, returns -1 afterwards.
+//
+int balltrack_core_set_readout(int method);
+
+//
+// Search the ball on the GPU, instead of reading out the ball buffer
+// and searching it in the analysis thread. The GPU reduces it to the
+// brightest macropixel and the average position around it, so only
+// 8 bytes are read out. Call this before balltrack_core_init.
+//
+int balltrack_core_set_gpu_search(int enabled);
+
+//
+// Render all ball passes of a frame right after each other and read them
+// out as soon as an EGL_KHR_fence_sync fence says they are done, one frame
+// earlier than with the fixed frame delays. This is the default, and
+// without the extension the frame delays are used anyway.
+// Call this before balltrack_core_init.
+//
+int balltrack_core_set_fence_readout(int enabled);
+
+//
+// Whether the render framerate is measured and used for the analysis
+// (the default). Footage that is decoded as fast as possible does not
+// run at the framerate it was recorded with, so then disable this and
+// give that framerate with balltrack_core_set_fps.
+//
+void balltrack_core_set_fps_measurement(int enabled);
+
+//
+// Whether the field, goals and ball positions are drawn on top of the
+// camera image (the default). Without anyone watching the screen,
+// this saves the overlay draw call. Can be changed at any time.
+//
+void balltrack_core_set_overlay(int enabled);
+#endif
+
+//
+// Framerate of the camera or footage
+// The GPU version measures the render framerate, and this is only the
+// starting value, so that durations are right from the first frame.
+// Frames from memory can be processed at any speed, so the CPU version
+// only uses this value.
+//
+void balltrack_core_set_fps(float fps);
+
 // Cleanup
 void balltrack_core_term();
 
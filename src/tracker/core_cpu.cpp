@@ -0,0 +1,212 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#include "core.h"
+#include "tracker.h"
+#include "cpufilter.h"
+#include "trace.h"
+#include <cstdio>
+#include <cstdlib>
+
+//
+// Headless version of core.cpp
+//
+// It runs the same passes as the GPU version, with the same texture sizes:
+// source -> color filter -> downsample -> pyramid -> analysis
+// but on the CPU, on frames that are already in memory.
+// This does not need VideoCore, EGL or GLES so it also runs on a normal PC.
+//
+// Everything happens in series on the calling thread:
+// there is no 3-frame pipeline delay and no separate analysis thread,
+// so processing the same frames always gives the same result.
+// All state is in a Tracker (tracker.h), and the balltrack_core_
+// functions use a default one.
+//
+
+Tracker::Tracker(Analysis* analysis) : sizes(pipeline), analysisPtr(analysis)
+{
+    if (!analysisPtr) {
+        ownAnalysis = new Analysis();
+        analysisPtr = ownAnalysis;
+    }
+}
+
+Tracker::~Tracker()
+{
+    free_buffers();
+    delete ownAnalysis;
+}
+
+int Tracker::allocate_buffers()
+{
+    texColorFilter = (uint8_t*)malloc(sizes.width1 * sizes.height1 * 4);
+    texColorFilterField = (uint8_t*)malloc(sizes.width1 * sizes.height1 * 4);
+    texDownscaled = (uint8_t*)malloc(sizes.width2 * sizes.height2 * 4);
+    texDownscaledField = (uint8_t*)malloc(sizes.width2 * sizes.height2 * 4);
+    if (!texColorFilter || !texColorFilterField || !texDownscaled || !texDownscaledField) {
+        printf("Could not allocate CPU pipeline buffers.\n");
+        return -1;
+    }
+    texPyramid[0] = texDownscaled;
+    for (int level = 1; level < sizes.levels; ++level) {
+        texPyramid[level] = (uint8_t*)malloc(pipeline_level_width(sizes, level) * pipeline_level_height(sizes, level) * 4);
+        if (!texPyramid[level]) {
+            printf("Could not allocate CPU pipeline buffers.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void Tracker::free_buffers()
+{
+    free(texColorFilter);
+    free(texColorFilterField);
+    free(texDownscaled);
+    free(texDownscaledField);
+    texColorFilter = 0;
+    texColorFilterField = 0;
+    texDownscaled = 0;
+    texDownscaledField = 0;
+    // Level 0 is texDownscaled
+    for (int level = 1; level < MaxPyramidLevels; ++level) {
+        free(texPyramid[level]);
+        texPyramid[level] = 0;
+    }
+    texPyramid[0] = 0;
+}
+
+int Tracker::configure(int width, int height, int filterScale,
+                       int downsampleFactor, int searchFactor)
+{
+    PipelineConfig config = sizes;
+    if (pipeline_config_init(&config, width, height, filterScale, downsampleFactor, searchFactor))
+        return -1;
+    sizes = config;
+    if (!initialized)
+        return 0;
+    free_buffers();
+    if (allocate_buffers()) {
+        initialized = false;
+        return -1;
+    }
+    return 0;
+}
+
+int Tracker::init()
+{
+    if (allocate_buffers())
+        return -1;
+    initialized = true;
+    return 0;
+}
+
+void Tracker::term()
+{
+    initialized = false;
+    free_buffers();
+}
+
+void Tracker::set_fps(float fps)
+{
+    analysisPtr->set_fps(fps);
+}
+
+int Tracker::process_frame(const uint8_t* rgba, int width, int height)
+{
+    if (!initialized)
+        return -1;
+
+    Analysis& analysis = *analysisPtr;
+
+    // Every X steps, we update the size of the green field bounding box
+    // Same countdown as the GPU version, but here the
+    // result is ready immediately so there is no extra gap
+    if (fieldUpdateSteps == 0) {
+        TRACE_BEGIN("colorfilter_field");
+        cpu_colorfilter_field(rgba, width, height, texColorFilterField, sizes.width1, sizes.height1);
+        TRACE_END("colorfilter_field");
+        TRACE_BEGIN("downsample_field");
+        cpu_downsample(texColorFilterField, sizes.width1, sizes.height1, texDownscaledField, sizes.width2, sizes.height2);
+        TRACE_END("downsample_field");
+        TRACE_BEGIN("process_field_buffer");
+        analysis.process_field_buffer(texDownscaledField, 4 * sizes.width2, sizes.height2);
+        TRACE_END("process_field_buffer");
+        fieldUpdateSteps = FieldUpdateDelay;
+    }
+    --fieldUpdateSteps;
+
+    // While the ball is tracked, the color filter only runs around its
+    // predicted position. There is no pipeline delay here, so this is
+    // the frame right after the last analysed one.
+    TRACE_BEGIN("colorfilter_ball");
+    ROI roi;
+    if (analysis.predict_roi(&roi, 1)) {
+        int x0, y0, x1, y1;
+        roi_to_pixels(roi, sizes.width1, sizes.height1, &x0, &y0, &x1, &y1);
+        cpu_colorfilter_ball(rgba, width, height, texColorFilter, sizes.width1, sizes.height1, x0, y0, x1, y1);
+    } else {
+        cpu_colorfilter_ball(rgba, width, height, texColorFilter, sizes.width1, sizes.height1);
+    }
+    TRACE_END("colorfilter_ball");
+    TRACE_BEGIN("downsample");
+    cpu_downsample(texColorFilter, sizes.width1, sizes.height1, texDownscaled, sizes.width2, sizes.height2);
+    TRACE_END("downsample");
+    TRACE_BEGIN("pyramid");
+    for (int level = 1; level < sizes.levels; ++level)
+        cpu_pyramid(texPyramid[level - 1], pipeline_level_width(sizes, level - 1), pipeline_level_height(sizes, level - 1),
+                    texPyramid[level], pipeline_level_width(sizes, level), pipeline_level_height(sizes, level));
+    TRACE_END("pyramid");
+    TRACE_BEGIN("process_ball_buffer");
+    const uint8_t* coarse = (sizes.levels > 1 ? texPyramid[sizes.levels - 1] : 0);
+    analysis.process_ball_buffer(texDownscaled, 4 * sizes.width2, sizes.height2,
+                                 coarse, sizes.searchFactor / sizes.downsampleFactor);
+    TRACE_END("process_ball_buffer");
+
+    return 0;
+}
+
+//
+// The C interface of core.h, for the one camera or file of a program
+//
+
+Tracker defaultTracker(analysis_default());
+
+int balltrack_core_configure(int width, int height, int filterScale,
+                             int downsampleFactor, int searchFactor)
+{
+    if (defaultTracker.configure(width, height, filterScale, downsampleFactor, searchFactor))
+        return -1;
+    pipeline = defaultTracker.config();
+    return 0;
+}
+
+// The arguments only matter for the GPU version
+int balltrack_core_init(int externalSamplerExtension, int flipY)
+{
+    if (defaultTracker.init())
+        return -1;
+
+    analysis_init();
+    return 0;
+}
+
+void balltrack_core_term()
+{
+    analysis_term();
+
+    defaultTracker.term();
+
+    TRACE_DUMP("/tmp/balltrack_trace.json");
+}
+
+void balltrack_core_set_fps(float fps)
+{
+    defaultTracker.set_fps(fps);
+}
+
+int balltrack_core_process_frame(const uint8_t* rgba, int width, int height)
+{
+    return defaultTracker.process_frame(rgba, width, height);
+}
@@ -0,0 +1,435 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#include "cpufilter.h"
+#include <cmath>
+#include <cstring>
+#include <vector>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// One GL_LINEAR texture lookup along a single axis:
+// the two texels that get interpolated and the weight of the second one
+struct LinearTap {
+    int i0;
+    int i1;
+    float w1;
+};
+
+int clamp_to_edge(int i, int size) {
+    if (i < 0)
+        return 0;
+    if (i >= size)
+        return size - 1;
+    return i;
+}
+
+// `pos` is the sample position in texel units, i.e. texcoord * size
+LinearTap linear_tap(double pos, int size) {
+    double x = pos - 0.5;
+    double f = std::floor(x);
+    LinearTap t;
+    t.i0 = clamp_to_edge((int)f, size);
+    t.i1 = clamp_to_edge((int)f + 1, size);
+    t.w1 = (float)(x - f);
+    return t;
+}
+
+// Equivalent of texture2D on an RGBA texture with GL_LINEAR.
+// Result is in [0,1] range.
+void sample_linear(const uint8_t* tex, int width, const LinearTap& tx,
+                   const LinearTap& ty, float* col) {
+    const uint8_t* p00 = tex + 4 * (ty.i0 * width + tx.i0);
+    const uint8_t* p01 = tex + 4 * (ty.i0 * width + tx.i1);
+    const uint8_t* p10 = tex + 4 * (ty.i1 * width + tx.i0);
+    const uint8_t* p11 = tex + 4 * (ty.i1 * width + tx.i1);
+    float wx = tx.w1;
+    float wy = ty.w1;
+    for (int c = 0; c < 4; ++c) {
+        float top = (1.0f - wx) * p00[c] + wx * p01[c];
+        float bot = (1.0f - wx) * p10[c] + wx * p11[c];
+        col[c] = (1.0f / 255.0f) * ((1.0f - wy) * top + wy * bot);
+    }
+}
+
+// Conversion of gl_FragColor to an 8-bit texture value
+uint8_t to_unorm8(float f) {
+    if (f <= 0.0f)
+        return 0;
+    if (f >= 1.0f)
+        return 255;
+    return (uint8_t)(f * 255.0f + 0.5f);
+}
+
+// Weights of the neural network in colorfilterball.frag
+// GLSL matrices are column-major, so every line here is one column
+const float weights0[4][4] = {
+    { -34.5803f,-222.2452f,  -7.2026f,-198.8427f}, // column 1
+    {-133.4599f,   8.2426f,-185.2599f, -38.5274f}, // column 2
+    { 181.7046f, 224.2931f, 111.3470f, 227.9662f}, // column 3
+    {  16.9938f,  -0.9921f,   1.5175f,   5.4740f}, // last column (biases)
+};
+const float weights1[4] = {42.2840f, 4.9263f, 1.5692f, 24.5940f};
+const float b1 = -9.4811f;
+
+// Scalar version of the network, also used for the remainder of the SIMD loops.
+// The SIMD versions below do the exact same float operations in
+// the same order, so all versions give bit-identical results.
+uint8_t pixelnet_ball(float r, float g, float b) {
+    // two-layer neural network
+    // The last column of weights0 is multiplied by alpha, which is 1.0
+    float neuron = b1;
+    for (int n = 0; n < 4; ++n) {
+        float h = weights0[0][n] * r + weights0[1][n] * g + weights0[2][n] * b + weights0[3][n];
+        h = (h > 0.0f ? h : 0.0f); // ReLu
+        neuron = neuron + weights1[n] * h;
+    }
+    // Thresholded instead of a sigmoid, like the shader
+    return (neuron < 0.0f ? 255 : 0);
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+// 16 pixels per iteration
+int pixelnet_ball_neon(const float* r, const float* g, const float* b, uint8_t* out, int count) {
+    float32x4_t w0[4][4];
+    float32x4_t w1[4];
+    for (int n = 0; n < 4; ++n) {
+        for (int c = 0; c < 4; ++c)
+            w0[c][n] = vdupq_n_f32(weights0[c][n]);
+        w1[n] = vdupq_n_f32(weights1[n]);
+    }
+    const float32x4_t bias = vdupq_n_f32(b1);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint16x4_t masks[4];
+        for (int k = 0; k < 4; ++k) {
+            float32x4_t vr = vld1q_f32(r + i + 4 * k);
+            float32x4_t vg = vld1q_f32(g + i + 4 * k);
+            float32x4_t vb = vld1q_f32(b + i + 4 * k);
+            float32x4_t neuron = bias;
+            for (int n = 0; n < 4; ++n) {
+                // Separate multiply and add (no vmla/vfma) to match the scalar version
+                float32x4_t h = vmulq_f32(w0[0][n], vr);
+                h = vaddq_f32(h, vmulq_f32(w0[1][n], vg));
+                h = vaddq_f32(h, vmulq_f32(w0[2][n], vb));
+                h = vaddq_f32(h, w0[3][n]);
+                h = vmaxq_f32(h, zero);
+                neuron = vaddq_f32(neuron, vmulq_f32(w1[n], h));
+            }
+            masks[k] = vmovn_u32(vcltq_f32(neuron, zero));
+        }
+        uint8x8_t lo = vmovn_u16(vcombine_u16(masks[0], masks[1]));
+        uint8x8_t hi = vmovn_u16(vcombine_u16(masks[2], masks[3]));
+        vst1q_u8(out + i, vcombine_u8(lo, hi));
+    }
+    return i;
+}
+#endif
+
+#if defined(__SSE2__)
+// 16 pixels per iteration
+int pixelnet_ball_sse(const float* r, const float* g, const float* b, uint8_t* out, int count) {
+    __m128 w0[4][4];
+    __m128 w1[4];
+    for (int n = 0; n < 4; ++n) {
+        for (int c = 0; c < 4; ++c)
+            w0[c][n] = _mm_set1_ps(weights0[c][n]);
+        w1[n] = _mm_set1_ps(weights1[n]);
+    }
+    const __m128 bias = _mm_set1_ps(b1);
+    const __m128 zero = _mm_setzero_ps();
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i masks[4];
+        for (int k = 0; k < 4; ++k) {
+            __m128 vr = _mm_loadu_ps(r + i + 4 * k);
+            __m128 vg = _mm_loadu_ps(g + i + 4 * k);
+            __m128 vb = _mm_loadu_ps(b + i + 4 * k);
+            __m128 neuron = bias;
+            for (int n = 0; n < 4; ++n) {
+                __m128 h = _mm_mul_ps(w0[0][n], vr);
+                h = _mm_add_ps(h, _mm_mul_ps(w0[1][n], vg));
+                h = _mm_add_ps(h, _mm_mul_ps(w0[2][n], vb));
+                h = _mm_add_ps(h, w0[3][n]);
+                h = _mm_max_ps(h, zero);
+                neuron = _mm_add_ps(neuron, _mm_mul_ps(w1[n], h));
+            }
+            masks[k] = _mm_castps_si128(_mm_cmplt_ps(neuron, zero));
+        }
+        // Masks are 0 or -1, so signed saturation keeps them 0x00 or 0xff
+        __m128i lo = _mm_packs_epi32(masks[0], masks[1]);
+        __m128i hi = _mm_packs_epi32(masks[2], masks[3]);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi16(lo, hi));
+    }
+    return i;
+}
+
+// 16 pixels per iteration, as two 8-wide vectors.
+// Only AVX2, not FMA, so that the multiply and add are not fused.
+__attribute__((target("avx2")))
+int pixelnet_ball_avx2(const float* r, const float* g, const float* b, uint8_t* out, int count) {
+    __m256 w0[4][4];
+    __m256 w1[4];
+    for (int n = 0; n < 4; ++n) {
+        for (int c = 0; c < 4; ++c)
+            w0[c][n] = _mm256_set1_ps(weights0[c][n]);
+        w1[n] = _mm256_set1_ps(weights1[n]);
+    }
+    const __m256 bias = _mm256_set1_ps(b1);
+    const __m256 zero = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i halves[4];
+        for (int k = 0; k < 2; ++k) {
+            __m256 vr = _mm256_loadu_ps(r + i + 8 * k);
+            __m256 vg = _mm256_loadu_ps(g + i + 8 * k);
+            __m256 vb = _mm256_loadu_ps(b + i + 8 * k);
+            __m256 neuron = bias;
+            for (int n = 0; n < 4; ++n) {
+                __m256 h = _mm256_mul_ps(w0[0][n], vr);
+                h = _mm256_add_ps(h, _mm256_mul_ps(w0[1][n], vg));
+                h = _mm256_add_ps(h, _mm256_mul_ps(w0[2][n], vb));
+                h = _mm256_add_ps(h, w0[3][n]);
+                h = _mm256_max_ps(h, zero);
+                neuron = _mm256_add_ps(neuron, _mm256_mul_ps(w1[n], h));
+            }
+            __m256i mask = _mm256_castps_si256(_mm256_cmp_ps(neuron, zero, _CMP_LT_OQ));
+            halves[2 * k] = _mm256_castsi256_si128(mask);
+            halves[2 * k + 1] = _mm256_extracti128_si256(mask, 1);
+        }
+        __m128i lo = _mm_packs_epi32(halves[0], halves[1]);
+        __m128i hi = _mm_packs_epi32(halves[2], halves[3]);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi16(lo, hi));
+    }
+    return i;
+}
+#endif
+
+float filter_field(const float* col) {
+    float value = std::fmax(col[0], std::fmax(col[1], col[2]));
+    float chroma = value - std::fmin(col[0], std::fmin(col[1], col[2]));
+    float sat = (value > 0.0f ? (chroma / value) : 0.0f);
+    float greenfilter = 0.0f;
+    if (col[1] == value) {
+        float hue = (col[2] - col[0]) / chroma;
+        if (hue > 0.0f && hue < 0.9f && sat > 0.15f && value > 0.10f && value < 0.70f) {
+            greenfilter = 1.0f;
+        }
+    }
+    return greenfilter;
+}
+
+// The color filters sample the source four times per output texel,
+// at -3,-1,1,3 source pixels from the center in the width direction.
+std::vector<LinearTap> colorfilter_taps(int srcWidth, int dstWidth) {
+    std::vector<LinearTap> xtaps(4 * dstWidth);
+    for (int x = 0; x < dstWidth; ++x) {
+        double center = (x + 0.5) * srcWidth / dstWidth;
+        for (int i = 0; i < 4; ++i)
+            xtaps[4 * x + i] = linear_tap(center + (2 * i - 3), srcWidth);
+    }
+    return xtaps;
+}
+
+template <float (*Filter)(const float*)>
+void colorfilter_pass(const uint8_t* src, int srcWidth, int srcHeight,
+                      uint8_t* dst, int dstWidth, int dstHeight) {
+    std::vector<LinearTap> xtaps = colorfilter_taps(srcWidth, dstWidth);
+
+    uint8_t* out = dst;
+    float col[4];
+    for (int y = 0; y < dstHeight; ++y) {
+        LinearTap ty = linear_tap((y + 0.5) * srcHeight / dstHeight, srcHeight);
+        for (int x = 0; x < 4 * dstWidth; ++x) {
+            sample_linear(src, srcWidth, xtaps[x], ty, col);
+            // The camera source has no alpha channel, so alpha is always 1.0
+            col[3] = 1.0f;
+            *out++ = to_unorm8(Filter(col));
+        }
+    }
+}
+
+PixelnetSimd& selected_simd() {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    static PixelnetSimd simd = PIXELNET_NEON;
+#elif defined(__SSE2__)
+    static PixelnetSimd simd = (cpu_pixelnet_supports(PIXELNET_AVX2) ? PIXELNET_AVX2 : PIXELNET_SSE2);
+#else
+    static PixelnetSimd simd = PIXELNET_SCALAR;
+#endif
+    return simd;
+}
+
+} // namespace
+
+bool cpu_pixelnet_supports(PixelnetSimd simd) {
+    switch (simd) {
+    case PIXELNET_SCALAR:
+        return true;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    case PIXELNET_NEON:
+        return true;
+#elif defined(__SSE2__)
+    case PIXELNET_SSE2:
+        return true;
+    case PIXELNET_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+bool cpu_pixelnet_select(PixelnetSimd simd) {
+    if (!cpu_pixelnet_supports(simd))
+        return false;
+    selected_simd() = simd;
+    return true;
+}
+
+void cpu_pixelnet_ball(const float* r, const float* g, const float* b,
+                       uint8_t* out, int count) {
+    int done = 0;
+    switch (selected_simd()) {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    case PIXELNET_NEON:
+        done = pixelnet_ball_neon(r, g, b, out, count);
+        break;
+#elif defined(__SSE2__)
+    case PIXELNET_AVX2:
+        done = pixelnet_ball_avx2(r, g, b, out, count);
+        break;
+    case PIXELNET_SSE2:
+        done = pixelnet_ball_sse(r, g, b, out, count);
+        break;
+#endif
+    default:
+        break;
+    }
+    for (int i = done; i < count; ++i)
+        out[i] = pixelnet_ball(r[i], g[i], b[i]);
+}
+
+// Same samples as colorfilter_pass, but first gathered into
+// separate r,g,b rows so that the network can be evaluated with SIMD.
+void cpu_colorfilter_ball(const uint8_t* src, int srcWidth, int srcHeight,
+                          uint8_t* dst, int dstWidth, int dstHeight) {
+    cpu_colorfilter_ball(src, srcWidth, srcHeight, dst, dstWidth, dstHeight,
+                         0, 0, dstWidth, dstHeight);
+}
+
+void cpu_colorfilter_ball(const uint8_t* src, int srcWidth, int srcHeight,
+                          uint8_t* dst, int dstWidth, int dstHeight,
+                          int x0, int y0, int x1, int y1) {
+    int rowLength = 4 * dstWidth;
+    if (x0 >= x1 || y0 >= y1) {
+        memset(dst, 0, rowLength * dstHeight);
+        return;
+    }
+
+    std::vector<LinearTap> xtaps = colorfilter_taps(srcWidth, dstWidth);
+    std::vector<float> rgb(3 * rowLength);
+    float* r = &rgb[0];
+    float* g = &rgb[rowLength];
+    float* b = &rgb[2 * rowLength];
+
+    uint8_t* out = dst;
+    float col[4];
+    for (int y = 0; y < dstHeight; ++y) {
+        if (y < y0 || y >= y1) {
+            memset(out, 0, rowLength);
+            out += rowLength;
+            continue;
+        }
+        LinearTap ty = linear_tap((y + 0.5) * srcHeight / dstHeight, srcHeight);
+        for (int x = 4 * x0; x < 4 * x1; ++x) {
+            sample_linear(src, srcWidth, xtaps[x], ty, col);
+            r[x] = col[0];
+            g[x] = col[1];
+            b[x] = col[2];
+        }
+        memset(out, 0, 4 * x0);
+        cpu_pixelnet_ball(r + 4 * x0, g + 4 * x0, b + 4 * x0, out + 4 * x0, 4 * (x1 - x0));
+        memset(out + 4 * x1, 0, rowLength - 4 * x1);
+        out += rowLength;
+    }
+}
+
+void cpu_colorfilter_field(const uint8_t* src, int srcWidth, int srcHeight,
+                           uint8_t* dst, int dstWidth, int dstHeight) {
+    colorfilter_pass<filter_field>(src, srcWidth, srcHeight, dst, dstWidth, dstHeight);
+}
+
+// See downsample.frag: every output value is the average over
+// GL_LINEAR samples that each cover 2 texels in the height direction,
+// and in the width direction too when the factor is at least 8.
+// The factor is srcWidth / dstWidth, which is the same in both directions.
+void cpu_downsample(const uint8_t* src, int srcWidth, int srcHeight,
+                    uint8_t* dst, int dstWidth, int dstHeight) {
+    int factor = srcWidth / dstWidth;
+    int xcount = (factor >= 8 ? factor / 8 : 1); // Samples per output value
+    int ycount = factor / 2;
+    float scale = 1.0f / (float)(4 * xcount * ycount);
+
+    std::vector<LinearTap> xtaps(4 * dstWidth * xcount);
+    for (int x = 0; x < dstWidth; ++x) {
+        double center = (x + 0.5) * srcWidth / dstWidth;
+        for (int i = 0; i < 4; ++i) {
+            double channel = center + (i - 1.5) * (factor / 4);
+            for (int k = 0; k < xcount; ++k)
+                xtaps[(4 * x + i) * xcount + k] = linear_tap(channel + (2 * k - (xcount - 1)), srcWidth);
+        }
+    }
+
+    uint8_t* out = dst;
+    float col[4];
+    std::vector<LinearTap> ytaps(ycount);
+    for (int y = 0; y < dstHeight; ++y) {
+        double center = (y + 0.5) * srcHeight / dstHeight;
+        for (int j = 0; j < ycount; ++j)
+            ytaps[j] = linear_tap(center + (2 * j - (ycount - 1)), srcHeight);
+
+        for (int x = 0; x < 4 * dstWidth; ++x) {
+            float avg = 0.0f;
+            for (int j = 0; j < ycount; ++j) {
+                for (int k = 0; k < xcount; ++k) {
+                    sample_linear(src, srcWidth, xtaps[x * xcount + k], ytaps[j], col);
+                    avg += col[0] + col[1] + col[2] + col[3];
+                }
+            }
+            *out++ = to_unorm8(scale * avg);
+        }
+    }
+}
+
+// See pyramid.frag: two GL_LINEAR samples in the middle of the two texels
+// in the width direction, between the two rows in the height direction
+void cpu_pyramid(const uint8_t* src, int srcWidth, int srcHeight,
+                 uint8_t* dst, int dstWidth, int dstHeight) {
+    uint8_t* out = dst;
+    float left[4], right[4];
+    for (int y = 0; y < dstHeight; ++y) {
+        LinearTap ty = linear_tap((y + 0.5) * srcHeight / dstHeight, srcHeight);
+        for (int x = 0; x < dstWidth; ++x) {
+            double center = (x + 0.5) * srcWidth / dstWidth;
+            sample_linear(src, srcWidth, linear_tap(center - 0.5, srcWidth), ty, left);
+            sample_linear(src, srcWidth, linear_tap(center + 0.5, srcWidth), ty, right);
+            *out++ = to_unorm8(0.5f * (left[0] + left[1]));
+            *out++ = to_unorm8(0.5f * (left[2] + left[3]));
+            *out++ = to_unorm8(0.5f * (right[0] + right[1]));
+            *out++ = to_unorm8(0.5f * (right[2] + right[3]));
+        }
+    }
+}
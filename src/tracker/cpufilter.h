@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#pragma once
+
+#include <cstdint>
+
+//
+// CPU versions of the balltrack shaders, used by the headless pipeline.
+//
+// They take the same samples as the fragment shaders, including the
+// GL_LINEAR interpolation and GL_CLAMP_TO_EDGE behaviour of the GPU,
+// so their output matches the GPU textures up to float rounding.
+//
+// All buffers are RGBA with 4 bytes per texel, and rows are stored
+// bottom-to-top like OpenGL textures.
+// Sizes are in texels, so for the filter outputs one texel contains
+// four pixels, exactly like the GPU textures.
+//
+
+// The two-layer pixel network of colorfilterball.frag, on `count` pixels
+// given as separate r,g,b arrays in [0,1] range (alpha is taken as 1.0).
+// Writes 255 for ball pixels and 0 otherwise, like the thresholded shader.
+// Uses NEON on ARM and SSE2 or AVX2 on x86, 16 pixels per iteration,
+// with the same results as the scalar version.
+void cpu_pixelnet_ball(const float* r, const float* g, const float* b,
+                       uint8_t* out, int count);
+
+// The versions of cpu_pixelnet_ball. By default the fastest one that the
+// build and the CPU have is used; the tests select each of them in turn.
+enum PixelnetSimd { PIXELNET_SCALAR, PIXELNET_SSE2, PIXELNET_AVX2, PIXELNET_NEON };
+bool cpu_pixelnet_supports(PixelnetSimd simd);
+// Returns false, and changes nothing, when `simd` is not supported
+bool cpu_pixelnet_select(PixelnetSimd simd);
+
+// colorfilterball.frag
+void cpu_colorfilter_ball(const uint8_t* src, int srcWidth, int srcHeight,
+                          uint8_t* dst, int dstWidth, int dstHeight);
+
+// Same, but only the texels [x0,x1)x[y0,y1) are computed and the rest
+// is cleared, like a render pass with a scissor rectangle
+void cpu_colorfilter_ball(const uint8_t* src, int srcWidth, int srcHeight,
+                          uint8_t* dst, int dstWidth, int dstHeight,
+                          int x0, int y0, int x1, int y1);
+
+// colorfilterfield.frag
+void cpu_colorfilter_field(const uint8_t* src, int srcWidth, int srcHeight,
+                           uint8_t* dst, int dstWidth, int dstHeight);
+
+// downsample.frag, with a downsample factor of srcWidth / dstWidth (4, 8 or 16)
+void cpu_downsample(const uint8_t* src, int srcWidth, int srcHeight,
+                    uint8_t* dst, int dstWidth, int dstHeight);
+
+// pyramid.frag, from a level to the next one of half the size
+void cpu_pyramid(const uint8_t* src, int srcWidth, int srcHeight,
+                 uint8_t* dst, int dstWidth, int dstHeight);
@@ -0,0 +1,229 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#include "eventchannel.h"
+#include "bufferqueue.h" // for CACHE_LINE_SIZE
+#include "trace.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+namespace {
+
+struct Event {
+    EventHeader header;
+    uint8_t payload[EVENT_MAX_PAYLOAD];
+    int64_t traceFrame; // Frame of the sending thread for tracing, not sent
+};
+
+// An event in the pending bytes of the writer thread, until it is written.
+// Only then it is counted as sent.
+struct PendingEvent {
+    uint32_t size; // Header and payload
+    int64_t traceFrame;
+};
+
+// Number of queued events, must be a power of two
+constexpr uint32_t EVENT_QUEUE_SIZE = 256;
+// The writer thread sends everything that was queued every X ms
+constexpr int WRITER_PERIOD_MS = 5;
+// When there is no reader, try to open the pipe again after X ms
+constexpr int REOPEN_PERIOD_MS = 1000;
+// When the reader is slow, at most this many bytes are waiting in the writer
+// thread. After that the events stay in the queue, until that is full too.
+constexpr size_t MAX_PENDING_BYTES = 64 * 1024;
+
+// Single producer, single consumer ring like SpmcRing, but with the events inline
+Event events[EVENT_QUEUE_SIZE];
+alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> head{0}; // Written by writer thread
+alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> tail{0}; // Written by analysis thread
+alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> sentCount{0};
+std::atomic<uint32_t> droppedCount{0};
+
+std::string pipePath;
+EventSink eventSink = 0;
+void* eventSinkContext = 0;
+std::thread writerThread;
+std::atomic<bool> writerStop{false};
+
+uint64_t timestamp_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts); // vDSO, so no syscall
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The pending events will not be written, a partly written one neither
+void drop_pending(std::vector<uint8_t>& pending, std::deque<PendingEvent>& pendingEvents, size_t& frontWritten) {
+    droppedCount.fetch_add((uint32_t)pendingEvents.size(), std::memory_order_relaxed);
+    pending.clear();
+    pendingEvents.clear();
+    frontWritten = 0;
+}
+
+void writer_thread() {
+    // When the reader goes away, write() raises SIGPIPE which would stop the
+    // tracker. With SIGPIPE blocked in this thread it returns EPIPE instead.
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, 0);
+    TRACE_THREAD_NAME("events");
+
+    int fd = -1;
+    int reopenWait = 0;
+    std::vector<uint8_t> pending;
+    pending.reserve(MAX_PENDING_BYTES);
+    std::deque<PendingEvent> pendingEvents;
+    size_t frontWritten = 0; // Bytes of pendingEvents.front() that are written
+
+    while (true) {
+        bool stopping = writerStop.load();
+
+        if (fd < 0 && reopenWait <= 0) {
+            // This fails (ENXIO) when the webproxy is not reading
+            fd = open(pipePath.c_str(), O_WRONLY | O_NONBLOCK);
+            if (fd < 0)
+                reopenWait = REOPEN_PERIOD_MS;
+            drop_pending(pending, pendingEvents, frontWritten);
+        }
+
+        // Take everything from the queue
+        // Without reader the events are dropped, like they always were
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t t = tail.load(std::memory_order_acquire);
+        for (; h != t && pending.size() < MAX_PENDING_BYTES; ++h) {
+            const Event& e = events[h & (EVENT_QUEUE_SIZE - 1)];
+            if (fd >= 0) {
+                const uint8_t* bytes = (const uint8_t*)&e.header;
+                pending.insert(pending.end(), bytes, bytes + sizeof(EventHeader));
+                pending.insert(pending.end(), e.payload, e.payload + e.header.size);
+                pendingEvents.push_back({(uint32_t)(sizeof(EventHeader) + e.header.size), e.traceFrame});
+            } else {
+                droppedCount.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        head.store(h, std::memory_order_release);
+
+        // One write for the whole batch. When the pipe is full
+        // the rest is kept for the next round.
+        // The write is traced with the frame of the oldest event in it,
+        // and every event that is written completely gets an instant
+        // with its own frame.
+        if (fd >= 0 && !pending.empty()) {
+            TRACE_FRAME(pendingEvents.front().traceFrame);
+            TRACE_BEGIN("fifo_write");
+            ssize_t written = write(fd, pending.data(), pending.size());
+            TRACE_END("fifo_write");
+            if (written > 0) {
+                pending.erase(pending.begin(), pending.begin() + written);
+                frontWritten += written;
+                while (!pendingEvents.empty() && frontWritten >= pendingEvents.front().size) {
+                    frontWritten -= pendingEvents.front().size;
+                    TRACE_FRAME(pendingEvents.front().traceFrame);
+                    TRACE_INSTANT("event_written");
+                    pendingEvents.pop_front();
+                    sentCount.fetch_add(1, std::memory_order_relaxed);
+                }
+            } else if (written < 0 && errno != EAGAIN && errno != EINTR) {
+                // EPIPE: the reader is gone
+                close(fd);
+                fd = -1;
+                drop_pending(pending, pendingEvents, frontWritten);
+            }
+        }
+
+        if (stopping)
+            break;
+        usleep(WRITER_PERIOD_MS * 1000);
+        if (reopenWait > 0)
+            reopenWait -= WRITER_PERIOD_MS;
+    }
+
+    // What the reader did not take before the stop
+    drop_pending(pending, pendingEvents, frontWritten);
+    droppedCount.fetch_add(tail.load() - head.load(), std::memory_order_relaxed);
+    if (fd >= 0)
+        close(fd);
+}
+
+} // namespace
+
+int event_channel_init(const char* path) {
+    pipePath = path;
+    if (eventSink)
+        return 0;
+    writerStop = false;
+    writerThread = std::thread(writer_thread);
+    return 0;
+}
+
+void event_channel_term() {
+    if (!writerThread.joinable())
+        return;
+    writerStop = true;
+    writerThread.join();
+    printf("Event channel: %u events sent, %u dropped.\n", event_channel_sent(), event_channel_dropped());
+}
+
+void event_channel_set_sink(EventSink sink, void* context) {
+    eventSink = sink;
+    eventSinkContext = context;
+}
+
+bool event_sink_send(EventSink sink, void* context, EventType type, uint32_t frame, const void* payload, int size) {
+    if (size > EVENT_MAX_PAYLOAD)
+        return false;
+    EventHeader header = {EVENT_MAGIC, type, (uint16_t)size, frame, timestamp_us()};
+    sink(context, header, payload);
+    return true;
+}
+
+bool event_channel_send(EventType type, uint32_t frame, const void* payload, int size) {
+    if (eventSink) {
+        bool sent = event_sink_send(eventSink, eventSinkContext, type, frame, payload, size);
+        (sent ? sentCount : droppedCount).fetch_add(1, std::memory_order_relaxed);
+        return sent;
+    }
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (size > EVENT_MAX_PAYLOAD || t - head.load(std::memory_order_acquire) >= EVENT_QUEUE_SIZE) {
+        droppedCount.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    Event& e = events[t & (EVENT_QUEUE_SIZE - 1)];
+    e.header.magic = EVENT_MAGIC;
+    e.header.type = type;
+    e.header.size = (uint16_t)size;
+    e.header.frame = frame;
+    e.header.timestamp = timestamp_us();
+    memcpy(e.payload, payload, size);
+    e.traceFrame = trace_get_frame();
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+bool event_channel_send_message(uint32_t frame, const char* message) {
+    int size = (int)strlen(message);
+    // The messages used to be lines, the framing makes the newline unnecessary
+    if (size > 0 && message[size - 1] == '\n')
+        --size;
+    return event_channel_send(EVENT_MESSAGE, frame, message, size);
+}
+
+uint32_t event_channel_sent() {
+    return sentCount.load(std::memory_order_relaxed);
+}
+
+uint32_t event_channel_dropped() {
+    return droppedCount.load(std::memory_order_relaxed);
+}
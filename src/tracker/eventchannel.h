@@ -0,0 +1,89 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#pragma once
+
+#include <cstdint>
+
+//
+// Event channel to the webproxy (webproxy/webproxy.py)
+//
+// Events are put in a bounded lock-free queue by the analysis thread,
+// and a separate writer thread sends them in batches over the named pipe.
+// The pipe stays open as long as the webproxy is reading, and is reopened
+// when it goes away. Events are dropped when there is no reader or when
+// the queue is full, so the analysis thread never has to wait.
+//
+// Framing, all values little-endian:
+//
+//     EventHeader (16 bytes), followed by `size` bytes of payload
+//
+// EVENT_MESSAGE  The text messages of before ("RG 1", "SAVE", "MAXSPEED 12.3"),
+//                without newline.
+// EVENT_BALL     EventBall, for every analysed frame while the ball is tracked
+//                and once when it is lost.
+//
+
+constexpr uint8_t EVENT_MAGIC = 0xFB;
+
+enum EventType : uint8_t {
+    EVENT_MESSAGE = 1,
+    EVENT_BALL = 2,
+};
+
+struct EventHeader {
+    uint8_t magic;      // EVENT_MAGIC
+    uint8_t type;       // EventType
+    uint16_t size;      // Payload size in bytes
+    uint32_t frame;     // Analysis frame number
+    uint64_t timestamp; // Microseconds since the epoch, when the event was created
+};
+static_assert(sizeof(EventHeader) == 16, "EventHeader has to be packed");
+
+enum BallState : uint8_t {
+    BALL_LOST = 0,
+    BALL_MEASURED = 1,
+    BALL_EXTRAPOLATED = 2, // Not detected in this frame, position from the ball filter
+};
+
+struct EventBall {
+    float x;          // Field coordinates in [0,1]x[0,1], from the ball filter
+    float y;
+    float confidence; // 0 to 1, always 0 when the ball was not detected
+    uint8_t state;    // BallState
+    uint8_t reserved[3];
+};
+static_assert(sizeof(EventBall) == 16, "EventBall has to be packed");
+
+// Largest payload of an event
+constexpr int EVENT_MAX_PAYLOAD = 48;
+
+// Opens the writer thread, but not yet the pipe
+// With a sink, there is no writer thread and no pipe.
+int event_channel_init(const char* path);
+// Sends the events that are still queued and stops the writer thread
+void event_channel_term();
+
+// Only call these from one thread (the analysis thread)
+// They never block and do not make syscalls.
+// Returns false when the event was dropped because the queue was full.
+bool event_channel_send(EventType type, uint32_t frame, const void* payload, int size);
+bool event_channel_send_message(uint32_t frame, const char* message);
+
+// Instead of the pipe, give every event to `sink` right away, on the thread
+// that sends it. Nothing is queued or dropped, so this is for offline
+// replays (src/replay) and not for the live tracker.
+// Call this before event_channel_init, 0 goes back to the pipe.
+// `context` is given to the sink with every event.
+typedef void (*EventSink)(void* context, const EventHeader& header, const void* payload);
+void event_channel_set_sink(EventSink sink, void* context = 0);
+
+// Frame an event like event_channel_send, and give it to `sink` right away.
+// This does not need the event channel, so every Analysis can have its own
+// sink (see Analysis::set_event_sink). Returns false when it is too large.
+bool event_sink_send(EventSink sink, void* context, EventType type, uint32_t frame, const void* payload, int size);
+
+// Statistics
+uint32_t event_channel_sent();
+uint32_t event_channel_dropped();
@@ -0,0 +1,161 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#include "framereader.h"
+#include "tga.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+
+// TGA files store BGR(A), bottom-to-top by default
+bool load_tga_rgba(const char* filename, int* width, int* height, std::vector<uint8_t>& rgba) {
+    struct tga_header header;
+    unsigned char* image = load_tga(filename, &header);
+    if (!image)
+        return false;
+
+    int bytes = header.image_info.bpp / 8;
+    if (bytes != 3 && bytes != 4) {
+        printf("%s: unsupported TGA depth %d\n", filename, header.image_info.bpp);
+        free(image);
+        return false;
+    }
+    *width = header.image_info.width;
+    *height = header.image_info.height;
+    // Bit 5 of the descriptor: the first row is the top one
+    bool topOrigin = (header.image_info.descriptor & 0x20) != 0;
+    rgba.resize(4 * *width * *height);
+    const unsigned char* src = image;
+    for (int y = 0; y < *height; ++y) {
+        int row = (topOrigin ? *height - 1 - y : y);
+        uint8_t* dst = rgba.data() + 4 * row * *width;
+        for (int x = 0; x < *width; ++x) {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+            dst[3] = 255;
+            src += bytes;
+            dst += 4;
+        }
+    }
+    free(image);
+    return true;
+}
+
+static inline uint8_t clamp_byte(int x) {
+    return (uint8_t)(x < 0 ? 0 : (x > 255 ? 255 : x));
+}
+
+void i420_to_rgba(const uint8_t* yuv, int width, int height, uint8_t* rgba) {
+    const uint8_t* planeY = yuv;
+    const uint8_t* planeU = planeY + width * height;
+    const uint8_t* planeV = planeU + (width / 2) * (height / 2);
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* rowY = planeY + y * width;
+        const uint8_t* rowU = planeU + (y / 2) * (width / 2);
+        const uint8_t* rowV = planeV + (y / 2) * (width / 2);
+        uint8_t* dst = rgba + 4 * (height - 1 - y) * width;
+        for (int x = 0; x < width; ++x) {
+            // BT.601, Y in [16,235] and U,V in [16,240], in 8-bit fixed point
+            int c = 298 * (rowY[x] - 16);
+            int d = rowU[x / 2] - 128;
+            int e = rowV[x / 2] - 128;
+            dst[0] = clamp_byte((c + 409 * e + 128) >> 8);
+            dst[1] = clamp_byte((c - 100 * d - 208 * e + 128) >> 8);
+            dst[2] = clamp_byte((c + 516 * d + 128) >> 8);
+            dst[3] = 255;
+            dst += 4;
+        }
+    }
+}
+
+static int tga_filter(const struct dirent* entry) {
+    size_t length = strlen(entry->d_name);
+    return (length > 4 && !strcasecmp(entry->d_name + length - 4, ".tga"));
+}
+
+int FrameReader::open(const char* path, Format _format, int _width, int _height) {
+    close();
+    format = _format;
+    frames = 0;
+    width = _width;
+    height = _height;
+
+    if (format == TGA_DIRECTORY) {
+        struct dirent** entries;
+        int count = scandir(path, &entries, tga_filter, versionsort);
+        if (count < 0) {
+            printf("Unable to read directory %s\n", path);
+            return -1;
+        }
+        for (int i = 0; i < count; ++i) {
+            files.push_back(std::string(path) + "/" + entries[i]->d_name);
+            free(entries[i]);
+        }
+        free(entries);
+        if (files.empty()) {
+            printf("No .tga files in %s\n", path);
+            return -1;
+        }
+        // The size of the first frame
+        std::vector<uint8_t> first;
+        if (!load_tga_rgba(files[0].c_str(), &width, &height, first)) {
+            printf("Unable to load %s\n", files[0].c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+    if (width <= 0 || height <= 0 || (format == RAW_I420 && (width % 2 || height % 2))) {
+        printf("Invalid frame size %dx%d\n", width, height);
+        return -1;
+    }
+    file = fopen(path, "rb");
+    if (!file) {
+        printf("Unable to open %s\n", path);
+        return -1;
+    }
+    raw.resize(format == RAW_I420 ? width * height * 3 / 2 : width * height * 4);
+    return 0;
+}
+
+void FrameReader::close() {
+    if (file)
+        fclose(file);
+    file = 0;
+    files.clear();
+}
+
+bool FrameReader::next(std::vector<uint8_t>& rgba) {
+    if (format == TGA_DIRECTORY) {
+        if (frames >= (int)files.size())
+            return false;
+        int w, h;
+        const char* filename = files[frames].c_str();
+        if (!load_tga_rgba(filename, &w, &h, rgba)) {
+            printf("Unable to load %s\n", filename);
+            return false;
+        }
+        if (w != width || h != height) {
+            printf("%s is %dx%d instead of %dx%d\n", filename, w, h, width, height);
+            return false;
+        }
+        ++frames;
+        return true;
+    }
+
+    if (!file || fread(raw.data(), 1, raw.size(), file) != raw.size())
+        return false;
+    rgba.resize(4 * width * height);
+    if (format == RAW_I420) {
+        i420_to_rgba(raw.data(), width, height, rgba.data());
+    } else {
+        // Flip to bottom-to-top
+        for (int y = 0; y < height; ++y)
+            memcpy(&rgba[4 * (height - 1 - y) * width], &raw[4 * y * width], 4 * width);
+    }
+    ++frames;
+    return true;
+}
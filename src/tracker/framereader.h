@@ -0,0 +1,60 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+//
+// Recorded frames for the CPU pipeline (core_cpu.cpp), read from files
+//
+// All frames are given as RGBA with rows stored bottom-to-top,
+// like OpenGL textures and like balltrack_core_process_frame takes them.
+//
+// TGA_DIRECTORY  All .tga files of a directory, like the framedumps of
+//                core.cpp (DO_FRAMEDUMPS), in version order so that
+//                framedump_100.tga comes after framedump_20.tga.
+// RAW_RGBA       Frames of width x height RGBA pixels right after each other,
+//                with the rows top-to-bottom, e.g. from
+//                `ffmpeg -i replay.h264 -f rawvideo -pix_fmt rgba frames.rgba`
+// RAW_I420       The same with I420 (YUV 4:2:0 planar) frames, like
+//                `raspivid -raw` and `-pix_fmt yuv420p` write them.
+//                Converted with the BT.601 video range coefficients.
+//
+
+// Loads a TGA file (BGR or BGRA, as written by dump_frame) as RGBA,
+// with the rows bottom-to-top whatever the origin of the file is
+bool load_tga_rgba(const char* filename, int* width, int* height, std::vector<uint8_t>& rgba);
+
+// I420 frame with top-to-bottom rows to RGBA with bottom-to-top rows
+void i420_to_rgba(const uint8_t* yuv, int width, int height, uint8_t* rgba);
+
+class FrameReader {
+  public:
+    enum Format { TGA_DIRECTORY, RAW_RGBA, RAW_I420 };
+
+    FrameReader() {}
+    ~FrameReader() { close(); }
+
+    // For the raw formats, width x height is the frame size. For a TGA
+    // directory it is the size of the first file. Returns -1 on failure.
+    int open(const char* path, Format format, int width = 0, int height = 0);
+    void close();
+
+    // Reads the next frame, returns false at the end or on a read error
+    bool next(std::vector<uint8_t>& rgba);
+
+    int width = 0;
+    int height = 0;
+    int frames = 0; // Number of frames read so far
+
+  private:
+    Format format = RAW_RGBA;
+    FILE* file = 0;
+    std::vector<std::string> files; // TGA_DIRECTORY
+    std::vector<uint8_t> raw;
+};
@@ -0,0 +1,31 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#pragma once
+
+// Field is given in screen coordinates; [-1,1]x[-1,1] range, the OpenGL standard
+struct FIELD {
+    float xmin;
+    float xmax;
+    float ymin;
+    float ymax;
+
+    FIELD() : xmin(-0.9f), xmax(0.9f), ymin(-0.9f), ymax(0.9f) {};
+};
+
+// Region of interest, in the same [-1,1]x[-1,1] screen coordinates as FIELD
+struct ROI {
+    float xmin;
+    float xmax;
+    float ymin;
+    float ymax;
+};
+
+// All ball positions are given in field coordinates in [0,1]x[0,1] range, normalized by the green field size
+// So (0,y) is at the left edge of the field and (1,y) is at the right edge of the field.
+
+struct POINT {
+    float x;
+    float y;
+};
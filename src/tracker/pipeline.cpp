@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#include "pipeline.h"
+#include <cstdio>
+
+// Source is 720p
+// The ball is searched at 80x45 and measured at 320x180 (BIGTEX) or 160x90
+#ifdef BIGTEX
+PipelineConfig pipeline = {1280, 720, 1, 1280 / 4, 720, 4, 320 / 4, 180, 16, 3, 80 / 4, 45};
+#else
+PipelineConfig pipeline = {1280, 720, 2, 640 / 4, 360, 4, 160 / 4, 90, 8, 2, 80 / 4, 45};
+#endif
+
+int pipeline_config_init(PipelineConfig* config, int width, int height,
+                         int filterScale, int downsampleFactor, int searchFactor) {
+    if (filterScale == 0)
+        filterScale = config->filterScale;
+    if (downsampleFactor == 0)
+        downsampleFactor = config->downsampleFactor;
+    if (searchFactor == 0) {
+        // Keep the current one when it fits the new downsample factor
+        searchFactor = config->searchFactor;
+        if (searchFactor < downsampleFactor)
+            searchFactor = downsampleFactor;
+        if (searchFactor > (downsampleFactor << (MaxPyramidLevels - 1)))
+            searchFactor = (downsampleFactor << (MaxPyramidLevels - 1));
+    }
+    if (filterScale != 1 && filterScale != 2) {
+        printf("Unsupported filter scale %d, use 1 or 2.\n", filterScale);
+        return -1;
+    }
+    // downsample.frag takes 2x2 texels per sample with GL_LINEAR,
+    // and every output channel covers downsampleFactor/4 texels
+    if (downsampleFactor != 4 && downsampleFactor != 8 && downsampleFactor != 16) {
+        printf("Unsupported downsample factor %d, use 4, 8 or 16.\n", downsampleFactor);
+        return -1;
+    }
+    // Every level of the pyramid halves the size
+    int levels = 1;
+    while ((downsampleFactor << (levels - 1)) < searchFactor && levels < MaxPyramidLevels)
+        ++levels;
+    if (searchFactor != (downsampleFactor << (levels - 1))) {
+        printf("Unsupported search factor %d, use %d times 1, 2, 4 or 8.\n", searchFactor, downsampleFactor);
+        return -1;
+    }
+    // One RGBA texel of the last level covers 4 macropixels
+    int blockWidth = 4 * filterScale * searchFactor;
+    int blockHeight = filterScale * searchFactor;
+    if (width <= 0 || height <= 0 || width % blockWidth || height % blockHeight) {
+        printf("Source size %dx%d has to be a multiple of %dx%d for filter scale %d and search factor %d.\n",
+               width, height, blockWidth, blockHeight, filterScale, searchFactor);
+        return -1;
+    }
+
+    config->width0 = width;
+    config->height0 = height;
+    config->filterScale = filterScale;
+    config->width1 = width / filterScale / 4;
+    config->height1 = height / filterScale;
+    config->downsampleFactor = downsampleFactor;
+    config->width2 = config->width1 / downsampleFactor;
+    config->height2 = config->height1 / downsampleFactor;
+    config->searchFactor = searchFactor;
+    config->levels = levels;
+    config->width3 = pipeline_level_width(*config, levels - 1);
+    config->height3 = pipeline_level_height(*config, levels - 1);
+    return 0;
+}
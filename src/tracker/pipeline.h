@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#pragma once
+
+// Texture sizes of the tracker pipeline.
+// Shared by the GPU version (core.cpp) and the CPU version (core_cpu.cpp)
+// so that both run the exact same passes.
+
+// Update the size of the (green) field bounding box every X frames
+// With the CPU pipeline, core_cpu.cpp
+constexpr int FieldUpdateDelay = 20;
+// With the GPU pipeline, core.cpp, where only the row and column sums are
+// read out. At least this many frames apart, and never before the previous
+// update is read out. Every frame would cost as much as the ball color filter.
+constexpr int FieldUpdateInterval = 4;
+
+// Whether to run the ball color filter only in a window around the
+// predicted ball position while the ball is being tracked.
+// Can also be changed at runtime with analysis_set_roi_tracking
+//#define ROI_TRACKING
+
+// Whether to use bigger (more finegrained, but slower) textures by default.
+// The sizes can be changed at runtime with balltrack_core_configure (core.h)
+#define BIGTEX
+
+// Maximum number of levels of the downsample pyramid, including tex2
+constexpr int MaxPyramidLevels = 4;
+
+// Divisions by 2 of 720p with correct aspect ratio
+// 1280,720
+//  640,360
+//  320,180
+//  160, 90
+//   80, 45
+
+// Every step maintains the same aspect ratio
+struct PipelineConfig {
+    // -- Source image, e.g. 1280x720 or 640x480
+    int width0;
+    int height0;
+    // -- Phase 1: from source to tex1: color filter
+    // filterScale 1: on every pixel (BIGTEX)
+    // filterScale 2: on 2x2 sampler-averages
+    int filterScale;
+    int width1; // width0 / filterScale / 4, RGBA can store 4 values at once
+    int height1;
+    // -- Phase 2: from tex1 to tex2: average NxN pixels to 1 pixel
+    // N = downsampleFactor, which is 4, 8 or 16
+    // This is the ball buffer, where the ball position is measured.
+    int downsampleFactor;
+    int width2;
+    int height2;
+    // -- Phase 3: downsample pyramid, every level averages 2x2 pixels of
+    // the level before, until it averages searchFactor x searchFactor
+    // pixels of tex1. The ball is first searched in the last level,
+    // and then measured in tex2 around that.
+    // searchFactor is downsampleFactor (no pyramid) up to 8 * downsampleFactor
+    int searchFactor;
+    int levels; // Including tex2, so 1 means no pyramid
+    int width3; // Last level
+    int height3;
+};
+
+// The sizes that are currently used by the pipeline
+extern PipelineConfig pipeline;
+
+// Fills in all texture sizes of `config`
+// Returns -1 (and leaves `config` alone) when the source size is
+// not a multiple of the macropixel size or the factors are not supported.
+// Factors that are 0 are taken from `config`, so start with a copy of
+// the current one (e.g. `pipeline`).
+int pipeline_config_init(PipelineConfig* config, int width, int height,
+                         int filterScale, int downsampleFactor, int searchFactor);
+
+// Size of level `level` of the pyramid in texels, level 0 is tex2
+inline int pipeline_level_width(const PipelineConfig& config, int level) { return config.width2 >> level; }
+inline int pipeline_level_height(const PipelineConfig& config, int level) { return config.height2 >> level; }
@@ -0,0 +1,225 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#include "readout.h"
+#include "bufferqueue.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#ifdef USE_VCSM
+#include "interface/vcsm/user-vcsm.h" // For creating the videocore-shared-memory texture
+#endif
+
+static int requestedMethod = READOUT_AUTO;
+static int activeMethod = READOUT_AUTO; // Reads like READOUT_GLRP until calibrated
+static bool vcsmAvailable = false;
+static BindTargetFunc bindTarget = 0;
+
+// Number of readouts per method for the calibration
+constexpr int CalibrationFrames = 50;
+
+const char* readout_method_name(int method) {
+    switch (method) {
+    case READOUT_AUTO:
+        return "auto";
+    case READOUT_GLRP:
+        return "glReadPixels";
+    case READOUT_VCSM:
+        return "VCSM";
+    case READOUT_VCSM_MAPPED:
+        return "VCSM mapped";
+    case READOUT_VCSM_ZERO_COPY:
+        return "VCSM zero copy";
+    }
+    return "unknown";
+}
+
+int readout_init(int method, BindTargetFunc bind) {
+    if (method < READOUT_AUTO || method > READOUT_VCSM_ZERO_COPY) {
+        printf("Unknown readout method %d, use 0 (auto), 1 (glReadPixels), 2 (VCSM), 3 (VCSM mapped) or 4 (VCSM zero copy).\n", method);
+        return -1;
+    }
+    bindTarget = bind;
+    requestedMethod = method;
+    activeMethod = method;
+
+    bool needVcsm = (method == READOUT_VCSM || method == READOUT_VCSM_MAPPED || method == READOUT_VCSM_ZERO_COPY);
+#ifdef USE_VCSM
+    // Initialize VideoCore Shared Memory
+    // So that we can readout the result of the GPU using the CPU,
+    // directly accessing the memory instead of using glReadPixels.
+    // This needs access to `dev/vcsm`.
+    if (method != READOUT_GLRP) {
+        vcsmAvailable = (vcsm_init() == 0);
+        if (!vcsmAvailable) {
+            printf("%s: Could not access /dev/vcsm (VideoCore Shared Memory).\n", needVcsm ? "ERROR" : "WARNING");
+            printf("       Use sudo or read the README for better ways to access /dev/vcsm.\n");
+        }
+    }
+#endif
+    if (needVcsm && !vcsmAvailable) {
+#ifndef USE_VCSM
+        printf("ERROR: Readout method %s needs a build with USE_VCSM.\n", readout_method_name(method));
+#endif
+        return -1;
+    }
+    return 0;
+}
+
+void readout_term() {
+#ifdef USE_VCSM
+    if (vcsmAvailable)
+        vcsm_exit();
+#endif
+    vcsmAvailable = false;
+}
+
+int readout_method() {
+    return activeMethod;
+}
+
+bool readout_shared_memory() {
+    return (activeMethod == READOUT_VCSM || activeMethod == READOUT_VCSM_MAPPED ||
+            activeMethod == READOUT_VCSM_ZERO_COPY);
+}
+
+bool readout_zero_copy() {
+    return activeMethod == READOUT_VCSM_ZERO_COPY;
+}
+
+ReadoutTexture* readout_create_texture(int width, int height, GLint scaling) {
+    ReadoutTexture* tex = new ReadoutTexture(width, height, scaling, readout_shared_memory());
+#ifdef USE_VCSM
+    if (activeMethod == READOUT_VCSM_MAPPED && tex->id) {
+        VCSM_CACHE_TYPE_T cache_type;
+        tex->mapped = (uint8_t*)vcsm_lock_cache(tex->vcsm_info.vcsm_handle, VCSM_CACHE_TYPE_NONE, &cache_type);
+        if (!tex->mapped)
+            printf("ERROR: Failed to map VCSM buffer.\n");
+    }
+#endif
+    return tex;
+}
+
+#ifdef USE_VCSM
+// Copy the used part of the power-of-two buffer
+static void copy_pot_buffer(const ReadoutTexture* tex, const uint8_t* src, uint8_t* dst) {
+    copy_rows(dst, src, 4 * tex->width, tex->height, 4 * tex->potWidth);
+}
+#endif
+
+void readout_texture(ReadoutTexture* tex, uint8_t* dst) {
+    // No glFinish is needed for VCSM, since we read the
+    // texture that was written in the previous frame
+#ifdef USE_VCSM
+    if (activeMethod == READOUT_VCSM || activeMethod == READOUT_VCSM_ZERO_COPY) {
+        uint8_t* vcsm_buffer = readout_lock(tex);
+        if (!vcsm_buffer)
+            return;
+        copy_pot_buffer(tex, vcsm_buffer, dst);
+        readout_unlock(vcsm_buffer);
+        return;
+    }
+    if (activeMethod == READOUT_VCSM_MAPPED) {
+        if (tex->mapped)
+            copy_pot_buffer(tex, tex->mapped, dst);
+        return;
+    }
+#endif
+    bindTarget(tex);
+    GLCHK(glViewport(0, 0, tex->width, tex->height));
+    GLCHK(glReadPixels(0, 0, tex->width, tex->height, GL_RGBA, GL_UNSIGNED_BYTE, dst));
+}
+
+uint8_t* readout_lock(ReadoutTexture* tex) {
+#ifdef USE_VCSM
+    // Make the buffer CPU addressable with host cache enabled
+    VCSM_CACHE_TYPE_T cache_type;
+    uint8_t* vcsm_buffer = (uint8_t*)vcsm_lock_cache(tex->vcsm_info.vcsm_handle, VCSM_CACHE_TYPE_HOST, &cache_type);
+    if (!vcsm_buffer)
+        printf("ERROR: Failed to lock VCSM buffer.\n");
+    return vcsm_buffer;
+#else
+    return 0;
+#endif
+}
+
+void readout_unlock(uint8_t* pixels) {
+#ifdef USE_VCSM
+    // Release the locked texture memory to flush the CPU cache and allow GPU to use it
+    if (pixels)
+        vcsm_unlock_ptr(pixels);
+#endif
+}
+
+static void clear_texture(ReadoutTexture* tex, uint8_t value) {
+    float v = (1.0f / 255.0f) * (float)value;
+    bindTarget(tex);
+    GLCHK(glViewport(0, 0, tex->width, tex->height));
+    GLCHK(glClearColor(v, v, v, v));
+    GLCHK(glClear(GL_COLOR_BUFFER_BIT));
+}
+
+// Returns the time per readout in microseconds, or -1 when the
+// method does not read back what was rendered
+static long long calibrate_method(int method, int width, int height) {
+    activeMethod = method;
+    ReadoutTexture* tex[2] = {readout_create_texture(width, height), readout_create_texture(width, height)};
+    std::vector<uint8_t> buffer(4 * width * height);
+    long long result = -1;
+
+    // Check that the data arrives
+    bool ok = (tex[0]->id && tex[1]->id);
+    for (uint8_t value : {0x40, 0xc0}) {
+        if (!ok)
+            break;
+        clear_texture(tex[0], value);
+        GLCHK(glFinish());
+        readout_texture(tex[0], buffer.data());
+        ok = (buffer.front() == value && buffer.back() == value);
+    }
+
+    // Time it like the pipeline: render to one texture while
+    // reading the one that was rendered in the previous frame
+    if (ok) {
+        clear_texture(tex[1], 0);
+        long long start = time_us();
+        for (int i = 0; i < CalibrationFrames; ++i) {
+            clear_texture(tex[i % 2], (uint8_t)i);
+            readout_texture(tex[(i + 1) % 2], buffer.data());
+        }
+        GLCHK(glFinish());
+        result = (time_us() - start) / CalibrationFrames;
+    }
+
+    delete tex[0];
+    delete tex[1];
+    return result;
+}
+
+void readout_calibrate(int width, int height) {
+    if (requestedMethod != READOUT_AUTO)
+        return;
+
+    int best = READOUT_GLRP;
+    long long bestTime = -1;
+    for (int method = READOUT_GLRP; method <= READOUT_VCSM_MAPPED; ++method) {
+        if (method != READOUT_GLRP && !vcsmAvailable)
+            continue;
+        long long t = calibrate_method(method, width, height);
+        if (t < 0) {
+            printf("Readout calibration: %-12s does not work\n", readout_method_name(method));
+            continue;
+        }
+        printf("Readout calibration: %-12s %lld us for %dx%d texels\n", readout_method_name(method), t, width, height);
+        if (bestTime < 0 || t < bestTime) {
+            best = method;
+            bestTime = t;
+        }
+    }
+    GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, 0));
+    GLCHK(glClearColor(0.0f, 0.0f, 0.0f, 0.0f));
+
+    activeMethod = best;
+    printf("Readout method: %s\n", readout_method_name(activeMethod));
+}
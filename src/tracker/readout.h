@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#pragma once
+
+#include "util.h"
+
+//
+// Reading out the ball and field textures into CPU memory
+// (see Optimizations.md for benchmarks)
+//
+// READOUT_GLRP         glReadPixels on a normal texture. This flushes the
+//                      GL pipeline and waits for the copy.
+// READOUT_VCSM         The texture is in VideoCore shared memory. For every
+//                      readout it is locked with the CPU cache enabled,
+//                      copied and unlocked again.
+// READOUT_VCSM_MAPPED  The same texture, but locked once without CPU cache
+//                      when it is created, and kept mapped. GLES2 on the
+//                      VideoCore IV has no pixel buffer objects, and this is
+//                      the closest to a persistently mapped one: there are
+//                      no syscalls per readout, but every read goes to
+//                      uncached memory.
+// READOUT_VCSM_ZERO_COPY
+//                      VCSM textures for the ball buffer that are not copied
+//                      at all: the analysis thread locks them with the CPU
+//                      cache enabled and reads them in place. The tracker
+//                      then rotates over more ball textures, so that the GPU
+//                      never renders to one that is still being analysed.
+//                      Other textures are read out like READOUT_VCSM.
+// READOUT_AUTO         Time all of the above at startup, on textures of the
+//                      ball buffer size, and take the fastest one that reads
+//                      back the right data. This never picks zero copy,
+//                      because that also changes the tracker pipeline.
+//
+// VCSM needs a build with USE_VCSM and access to /dev/vcsm.
+//
+enum ReadoutMethod {
+    READOUT_AUTO = 0,
+    READOUT_GLRP = 1,
+    READOUT_VCSM = 2,
+    READOUT_VCSM_MAPPED = 3,
+    READOUT_VCSM_ZERO_COPY = 4,
+};
+
+// Binds a framebuffer object with `target` attached, for glReadPixels
+typedef void (*BindTargetFunc)(Texture* target);
+
+// Returns -1 when `method` is not available
+int readout_init(int method, BindTargetFunc bindTarget);
+void readout_term();
+
+// With READOUT_AUTO, choose the method for textures of width x height texels.
+// Call this with a current GL context, before creating the textures.
+void readout_calibrate(int width, int height);
+
+// The method in use, this is READOUT_AUTO until readout_calibrate was called
+int readout_method();
+const char* readout_method_name(int method);
+
+// Whether the textures have a power-of-two size of which only
+// the bottom-left part is used
+bool readout_shared_memory();
+
+// Texture that can be read out with the current method
+ReadoutTexture* readout_create_texture(int width, int height, GLint scaling = GL_NEAREST);
+
+// Copy the width x height texels of `tex` into `dst`
+void readout_texture(ReadoutTexture* tex, uint8_t* dst);
+
+// Whether the method is READOUT_VCSM_ZERO_COPY
+bool readout_zero_copy();
+
+// Make the shared memory of `tex` readable by the CPU in place, this may be
+// called from another thread than the GL thread.
+// Rows are 4 * tex->potWidth bytes apart. Returns 0 on failure.
+// The GPU should not render to `tex` until it is unlocked again.
+uint8_t* readout_lock(ReadoutTexture* tex);
+void readout_unlock(uint8_t* pixels);
@@ -0,0 +1,126 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#include "trace.h"
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+
+namespace {
+
+struct TraceEvent {
+    const char* name; // Has to be a static string
+    int64_t frame;
+    int64_t time;     // nanoseconds
+    char phase;
+};
+
+// Number of events kept per thread, must be a power of two.
+// The GL thread has about 16 events per frame, so this
+// holds the last ~100 seconds at 40 fps.
+constexpr uint32_t TRACE_CAPACITY = 1 << 16;
+
+// Only the owning thread writes to it
+struct ThreadTrace {
+    TraceEvent events[TRACE_CAPACITY];
+    std::atomic<uint32_t> count{0};
+    const char* name = 0;
+    int64_t frame = -1;
+    int tid = 0;
+    ThreadTrace* next = 0;
+};
+
+// All thread buffers, as a lock-free linked list.
+// They are never freed because the dump can happen after the thread ended.
+std::atomic<ThreadTrace*> allTraces{0};
+std::atomic<int> threadCount{0};
+
+thread_local ThreadTrace* threadTrace = 0;
+
+int64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+ThreadTrace* get_thread_trace() {
+    if (!threadTrace) {
+        ThreadTrace* trace = new ThreadTrace();
+        trace->tid = ++threadCount;
+        trace->next = allTraces.load();
+        while (!allTraces.compare_exchange_weak(trace->next, trace))
+            ;
+        threadTrace = trace;
+    }
+    return threadTrace;
+}
+
+} // namespace
+
+void trace_event(const char* name, char phase) {
+    ThreadTrace* trace = get_thread_trace();
+    uint32_t index = trace->count.load(std::memory_order_relaxed);
+    TraceEvent& e = trace->events[index & (TRACE_CAPACITY - 1)];
+    e.name = name;
+    e.frame = trace->frame;
+    e.time = now();
+    e.phase = phase;
+    trace->count.store(index + 1, std::memory_order_release);
+}
+
+void trace_set_frame(int64_t frame) {
+    get_thread_trace()->frame = frame;
+}
+
+int64_t trace_get_frame() {
+    return get_thread_trace()->frame;
+}
+
+void trace_set_thread_name(const char* name) {
+    get_thread_trace()->name = name;
+}
+
+int trace_dump(const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        printf("Unable to open %s\n", filename);
+        return -1;
+    }
+
+    // Timestamps are written relative to the oldest event
+    int64_t start = -1;
+    for (ThreadTrace* t = allTraces.load(); t; t = t->next) {
+        uint32_t count = t->count.load(std::memory_order_acquire);
+        uint32_t first = (count > TRACE_CAPACITY ? count - TRACE_CAPACITY : 0);
+        if (count > first) {
+            int64_t time = t->events[first & (TRACE_CAPACITY - 1)].time;
+            if (start < 0 || time < start)
+                start = time;
+        }
+    }
+
+    int total = 0;
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (ThreadTrace* t = allTraces.load(); t; t = t->next) {
+        if (t->name) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    (total ? ",\n" : ""), t->tid, t->name);
+            ++total;
+        }
+        uint32_t count = t->count.load(std::memory_order_acquire);
+        uint32_t first = (count > TRACE_CAPACITY ? count - TRACE_CAPACITY : 0);
+        for (uint32_t i = first; i < count; ++i) {
+            const TraceEvent& e = t->events[i & (TRACE_CAPACITY - 1)];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d%s,\"args\":{\"frame\":%lld}}",
+                    (total ? ",\n" : ""), e.name, e.phase, 0.001 * (e.time - start), t->tid,
+                    (e.phase == 'i' ? ",\"s\":\"t\"" : ""), (long long)e.frame);
+            ++total;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    printf("Wrote %d trace events to %s\n", total, filename);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#ifndef BALLTRACKTRACE_H
+#define BALLTRACKTRACE_H
+
+#include <stdint.h>
+
+//
+// Per-frame latency tracing
+//
+// Every thread records timestamped events into its own lock-free ring buffer,
+// which can be written out in the Chrome trace format (open it with
+// chrome://tracing or https://ui.perfetto.dev).
+//
+// Events belong to a frame: the current frame of the thread, set with
+// TRACE_FRAME. On the camera this is the MMAL buffer timestamp (pts), so
+// a frame can be followed from the camera through the GL passes and the
+// analysis thread up to the FIFO write of the event channel.
+//
+// Only enabled with FRAME_TRACING (see CMakeLists.txt), otherwise the
+// macros do nothing.
+//
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// phase is 'B' (begin), 'E' (end) or 'i' (instant), as in the Chrome format
+void trace_event(const char* name, char phase);
+
+// Set/get the frame that the events of this thread belong to
+void trace_set_frame(int64_t frame);
+int64_t trace_get_frame();
+
+// Name shown for this thread in the trace
+void trace_set_thread_name(const char* name);
+
+// Writes all events that are still in the ring buffers as Chrome trace JSON.
+// Should be called when the traced threads are idle, because events that
+// are recorded during the dump might be incomplete.
+int trace_dump(const char* filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef FRAME_TRACING
+#define TRACE_BEGIN(name) trace_event((name), 'B')
+#define TRACE_END(name) trace_event((name), 'E')
+#define TRACE_INSTANT(name) trace_event((name), 'i')
+#define TRACE_FRAME(frame) trace_set_frame(frame)
+#define TRACE_THREAD_NAME(name) trace_set_thread_name(name)
+#define TRACE_DUMP(filename) trace_dump(filename)
+#else
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_INSTANT(name) ((void)0)
+#define TRACE_FRAME(frame) ((void)(frame)) // Evaluated, so frame counters are not unused
+#define TRACE_THREAD_NAME(name) ((void)0)
+#define TRACE_DUMP(filename) ((void)0)
+#endif
+
+#endif /* BALLTRACKTRACE_H */
@@ -0,0 +1,61 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+#pragma once
+
+#include "analysis.h"
+#include "pipeline.h"
+#include <cstdint>
+
+//
+// One CPU tracker pipeline (see core_cpu.cpp) with its own buffers,
+// sizes and Analysis, for one stream of frames.
+// Trackers share no state, so several of them can run at the same time,
+// each on its own thread. The balltrack_core_ functions of the CPU
+// version use a default one, with the default Analysis.
+//
+class Tracker {
+  public:
+    // Without `analysis`, the tracker has its own
+    explicit Tracker(Analysis* analysis = 0);
+    ~Tracker();
+
+    Tracker(const Tracker&) = delete;
+    Tracker& operator=(const Tracker&) = delete;
+
+    // Like balltrack_core_configure, the default sizes are those of `pipeline`
+    int configure(int width, int height, int filterScale,
+                  int downsampleFactor, int searchFactor);
+    const PipelineConfig& config() const { return sizes; }
+
+    int init();
+    void term();
+
+    // Framerate of the frames, for the durations in the analysis
+    void set_fps(float fps);
+
+    // Like balltrack_core_process_frame
+    int process_frame(const uint8_t* rgba, int width, int height);
+
+    Analysis& analysis() { return *analysisPtr; }
+
+  private:
+    int allocate_buffers();
+    void free_buffers();
+
+    PipelineConfig sizes;
+    Analysis* analysisPtr;
+    Analysis* ownAnalysis = 0;
+    bool initialized = false;
+
+    // These replace the textures of the GPU version
+    uint8_t* texColorFilter = 0;
+    uint8_t* texColorFilterField = 0;
+    uint8_t* texDownscaled = 0;
+    uint8_t* texDownscaledField = 0;
+    // Levels of the downsample pyramid, level 0 is texDownscaled
+    uint8_t* texPyramid[MaxPyramidLevels] = {};
+
+    int fieldUpdateSteps = FieldUpdateDelay; // Countdown
+};
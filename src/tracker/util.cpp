@@ -1,11 +1,23 @@
 // Mostly taken from RaspiTexUtil
 #include "util.h"
 #include "tga.h"
+#include <cstddef>
 #include <cstdio>
+#include <cstring>
 #include <vector>
+#include <sys/time.h>
+#ifdef USE_VCSM
+#include "interface/vcsm/user-vcsm.h"
+#endif
 
-Texture::Texture(int w, int h, GLint scaling)
-    : width(w), height(h), type(GL_TEXTURE_2D) {
+Texture::Texture(int w, int h, GLint scaling) {
+    create(w, h, scaling);
+}
+
+void Texture::create(int w, int h, GLint scaling) {
+    width = w;
+    height = h;
+    type = GL_TEXTURE_2D;
     GLCHK(glGenTextures(1, &id));
     GLCHK(glBindTexture(GL_TEXTURE_2D, id));
     GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, scaling));
@@ -16,20 +28,26 @@ Texture::Texture(int w, int h, GLint scaling)
                        GL_UNSIGNED_BYTE, NULL));
 };
 
-SharedMemTexture::SharedMemTexture(int w, int h) : Texture() {
-    // Width and height must be a power of two between 64 and 2048
-    // So find the smallest pot that is at least w,h
+// Width and height must be a power of two between 64 and 2048
+// So find the smallest pot that is at least `size`
+int SharedMemTexture::pot_size(int size) {
+    for (int pot = 64; pot <= 2048; pot *= 2) {
+        if (pot >= size)
+            return pot;
+    }
+    return 0;
+}
+
+SharedMemTexture::SharedMemTexture(int w, int h, GLint scaling) : SharedMemTexture() {
+    create_shared(w, h, scaling);
+}
+
+void SharedMemTexture::create_shared(int w, int h, GLint scaling) {
     type = GL_TEXTURE_2D;
     width = w;
     height = h;
-    potWidth = 0;
-    potHeight = 0;
-    for (int pot = 64; pot <= 2048; pot *= 2) {
-        if (pot >= w && potWidth == 0)
-            potWidth = pot;
-        if (pot >= h && potHeight == 0)
-            potHeight = pot;
-    }
+    potWidth = pot_size(w);
+    potHeight = pot_size(h);
     vcsm_info.width = potWidth;
     vcsm_info.height = potHeight;
     eglImage =
@@ -42,6 +60,8 @@ SharedMemTexture::SharedMemTexture(int w, int h) : Texture() {
 
     GLCHK(glGenTextures(1, &id));
     GLCHK(glBindTexture(GL_TEXTURE_2D, id));
+    GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, scaling));
+    GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, scaling));
     GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
     GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
 
@@ -49,6 +69,151 @@ SharedMemTexture::SharedMemTexture(int w, int h) : Texture() {
     return;
 }
 
+ReadoutTexture::ReadoutTexture(int w, int h, GLint scaling, bool shared)
+    : SharedMemTexture(), sharedMemory(shared) {
+    if (shared) {
+        create_shared(w, h, scaling);
+    } else {
+        create(w, h, scaling);
+        potWidth = w;
+        potHeight = h;
+    }
+}
+
+ReadoutTexture::~ReadoutTexture() {
+#ifdef USE_VCSM
+    if (mapped)
+        vcsm_unlock_ptr(mapped);
+#endif
+}
+
+void FramebufferCache::bind(const Texture* target) {
+    // There are only a few targets, so a linear search is fine
+    for (const Entry& e : fbos) {
+        if (e.texture == target->id) {
+            GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, e.fbo));
+            return;
+        }
+    }
+    Entry e;
+    e.texture = target->id;
+    GLCHK(glGenFramebuffersOES(1, &e.fbo));
+    GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, e.fbo));
+    GLCHK(glFramebufferTexture2DOES(GL_FRAMEBUFFER_OES, GL_COLOR_ATTACHMENT0_OES, GL_TEXTURE_2D, target->id, 0));
+    GLenum status = glCheckFramebufferStatusOES(GL_FRAMEBUFFER_OES);
+    if (status != GL_FRAMEBUFFER_COMPLETE_OES)
+        printf("ERROR: Framebuffer for texture %u is not complete: 0x%x\n", target->id, status);
+    fbos.push_back(e);
+}
+
+void FramebufferCache::clear() {
+    if (fbos.empty())
+        return;
+    GLCHK(glBindFramebufferOES(GL_FRAMEBUFFER_OES, 0));
+    for (Entry& e : fbos)
+        GLCHK(glDeleteFramebuffersOES(1, &e.fbo));
+    fbos.clear();
+}
+
+bool RenderFence::supported() {
+    static int hasFenceSync = -1;
+    if (hasFenceSync < 0) {
+        const char* extensions = eglQueryString(eglGetDisplay(EGL_DEFAULT_DISPLAY), EGL_EXTENSIONS);
+        hasFenceSync = (extensions && strstr(extensions, "EGL_KHR_fence_sync")) ? 1 : 0;
+        printf("EGL_KHR_fence_sync is %s\n", hasFenceSync ? "available" : "not available, using frame delays");
+    }
+    return hasFenceSync == 1;
+}
+
+void RenderFence::insert() {
+    reset();
+    if (supported()) {
+        sync = eglCreateSyncKHR(eglGetDisplay(EGL_DEFAULT_DISPLAY), EGL_SYNC_FENCE_KHR, NULL);
+        // Make sure the fence gets to the GPU, or it could wait forever
+        GLCHK(glFlush());
+    }
+    framesLeft = fallbackFrames;
+    isPending = true;
+}
+
+bool RenderFence::signaled() {
+    if (!isPending)
+        return true;
+    if (sync != EGL_NO_SYNC_KHR) {
+        EGLint result = eglClientWaitSyncKHR(eglGetDisplay(EGL_DEFAULT_DISPLAY), sync, 0, 0);
+        if (result == EGL_CONDITION_SATISFIED_KHR) {
+            reset();
+            return true;
+        }
+        if (result != EGL_FALSE)
+            return false;
+        // On an error, fall back to the frame count
+    }
+    if (--framesLeft <= 0) {
+        reset();
+        return true;
+    }
+    return false;
+}
+
+void RenderFence::wait() {
+    if (!isPending)
+        return;
+    EGLint result = EGL_FALSE;
+    if (sync != EGL_NO_SYNC_KHR)
+        result = eglClientWaitSyncKHR(eglGetDisplay(EGL_DEFAULT_DISPLAY), sync,
+                                      EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+    if (result != EGL_CONDITION_SATISFIED_KHR)
+        GLCHK(glFinish());
+    reset();
+}
+
+void RenderFence::reset() {
+    if (sync != EGL_NO_SYNC_KHR)
+        eglDestroySyncKHR(eglGetDisplay(EGL_DEFAULT_DISPLAY), sync);
+    sync = EGL_NO_SYNC_KHR;
+    isPending = false;
+}
+
+void LineBatch::add_line_strip(const GLfloat* xys, int count, uint32_t color) {
+    // GL_LINES needs both ends of every segment
+    for (int i = 1; i < count; ++i) {
+        vertices.push_back({xys[2 * i - 2], xys[2 * i - 1], color});
+        vertices.push_back({xys[2 * i], xys[2 * i + 1], color});
+    }
+}
+
+void LineBatch::draw(const ShaderProgram* shader) {
+    if (vertices.empty())
+        return;
+    if (!vbo)
+        GLCHK(glGenBuffers(1, &vbo));
+
+    GLCHK(glUseProgram(shader->program));
+    GLCHK(glBindBuffer(GL_ARRAY_BUFFER, vbo));
+    // A new buffer every frame, so the driver does not have to
+    // wait until the GPU is done with the lines of the last frame
+    GLCHK(glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STREAM_DRAW));
+    GLuint position = shader->attribute_locations[0];
+    GLuint color = shader->attribute_locations[1];
+    GLCHK(glEnableVertexAttribArray(position));
+    GLCHK(glEnableVertexAttribArray(color));
+    GLCHK(glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x)));
+    GLCHK(glVertexAttribPointer(color, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, color)));
+    GLCHK(glDrawArrays(GL_LINES, 0, (GLsizei)vertices.size()));
+    // The other shaders only have the vertex attribute
+    GLCHK(glDisableVertexAttribArray(color));
+
+    vertices.clear();
+}
+
+void LineBatch::release() {
+    if (vbo)
+        GLCHK(glDeleteBuffers(1, &vbo));
+    vbo = 0;
+    vertices.clear();
+}
+
 std::vector<ShaderProgram*> loadedShaders;
 
 int ShaderProgram::build()
@@ -78,7 +243,12 @@ int ShaderProgram::build()
     }
 
     fs = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fs, 1, &fragment_source, NULL);
+    if (fragment_defines) {
+        const char* sources[2] = {fragment_defines, fragment_source};
+        glShaderSource(fs, 2, sources, NULL);
+    } else {
+        glShaderSource(fs, 1, &fragment_source, NULL);
+    }
     glCompileShader(fs);
 
     glGetShaderiv(fs, GL_COMPILE_STATUS, &status);
@@ -190,6 +360,12 @@ void brga_to_rgba(uint8_t *buffer, size_t size)
    }
 }
 
+long long time_us() {
+    struct timeval te;
+    gettimeofday(&te, NULL);
+    return te.tv_sec * 1000000LL + te.tv_usec;
+}
+
 int dump_frame(int width, int height, const char* filename) {
     FILE* output_file = fopen(filename, "wb");
     if (!output_file)
@@ -9,6 +9,8 @@
 // This is already included by eglext.h
 //#include "interface/khronos/include/EGL/eglext_brcm.h"
 #include <cstdio>
+#include <cstdint>
+#include <vector>
 
 #ifdef CHECK_GL_ERRORS
 #define GLCHK(X) \
@@ -44,6 +46,10 @@ class Texture {
     int width;
     int height;
     GLuint type; // Always GL_TEXTURE_2D, except GL_TEXTURE_EXTERNAL_OES for cam
+    int64_t frame = -1; // Camera frame of the contents, for tracing
+
+  protected:
+    void create(int w, int h, GLint scaling);
 };
 
 // Texture that does not delete in the deconstructor
@@ -61,7 +67,7 @@ class TextureWrapper : public Texture {
 class SharedMemTexture : public Texture {
   public:
     SharedMemTexture() : Texture(), eglImage(EGL_NO_IMAGE_KHR) {};
-    SharedMemTexture(int w, int h);
+    SharedMemTexture(int w, int h, GLint scaling = GL_NEAREST);
     virtual ~SharedMemTexture() {
         if (eglImage != EGL_NO_IMAGE_KHR)
             eglDestroyImageKHR(eglGetDisplay(EGL_DEFAULT_DISPLAY), (EGLImageKHR)eglImage);
@@ -69,16 +75,82 @@ class SharedMemTexture : public Texture {
 
     int potWidth;  // power-of-two width
     int potHeight; // power-of-two height
+
+    // The power-of-two size that is used for a width or height of `size`
+    static int pot_size(int size);
     egl_image_brcm_vcsm_info vcsm_info;
     EGLImageKHR eglImage;
+
+  protected:
+    void create_shared(int w, int h, GLint scaling);
 };
 
-#ifdef USE_VCSM
-typedef SharedMemTexture ReadoutTexture;
-#else
-typedef Texture ReadoutTexture;
-#endif
+// Texture that the CPU reads out, with one of the methods of readout.h
+// Without shared memory it is a normal texture, and then potWidth and
+// potHeight are simply width and height.
+class ReadoutTexture : public SharedMemTexture {
+  public:
+    ReadoutTexture(int w, int h, GLint scaling, bool shared);
+    virtual ~ReadoutTexture();
+
+    bool sharedMemory;
+    uint8_t* mapped = 0; // Kept locked by READOUT_VCSM_MAPPED, unlocked when deleted
+};
 
+//
+// One framebuffer object for every render-to-texture target
+// The texture stays attached to its FBO, so rendering to it
+// only needs a bind instead of a bind and an attach.
+//
+class FramebufferCache {
+  public:
+    ~FramebufferCache() { clear(); }
+
+    // Binds the FBO of `target`, and creates it the first time
+    void bind(const Texture* target);
+
+    // Deletes all FBOs. Call this before the textures are deleted,
+    // because a new texture can get the id of an old one.
+    void clear();
+
+    int size() const { return (int)fbos.size(); }
+
+  private:
+    struct Entry {
+        GLuint texture;
+        GLuint fbo;
+    };
+    std::vector<Entry> fbos;
+};
+
+//
+// Tells when the GL commands before insert() are done, without waiting
+// for them like glFinish does. Uses EGL_KHR_fence_sync when the driver
+// has it. Without it, the commands are assumed to be done after a fixed
+// number of calls to signaled(), so call that once per frame.
+//
+class RenderFence {
+  public:
+    explicit RenderFence(int fallbackFrames = 2) : fallbackFrames(fallbackFrames) {}
+    ~RenderFence() { reset(); }
+
+    // Whether EGL_KHR_fence_sync is there, call this with a current context
+    static bool supported();
+
+    void insert();
+    bool pending() const { return isPending; }
+    // Whether the commands are done, does not block
+    bool signaled();
+    // Blocks until the commands are done, with glFinish as fallback
+    void wait();
+    void reset();
+
+  private:
+    EGLSyncKHR sync = EGL_NO_SYNC_KHR;
+    int fallbackFrames;
+    int framesLeft = 0;
+    bool isPending = false;
+};
 
 class ShaderUniform {
   public:
@@ -109,6 +181,7 @@ class ShaderProgram {
     const char* display_name;    // For debug messages
     const char* vertex_source;   // Pointer to vertex shader source
     const char* fragment_source; // Pointer to fragment shader source
+    const char* fragment_defines = 0; // Optional, put in front of fragment_source
 
     // Array of uniforms for raspitex_build_shader_program to process
     ShaderUniform uniforms[16];
@@ -126,8 +199,40 @@ class ShaderProgram {
     GLint attribute_locations[16];
 };
 
+//
+// Lines that are drawn with a single draw call, for the overlay
+// Every vertex has its own color, so all lines of a frame can be collected
+// first and then uploaded to one streaming vertex buffer.
+//
+class LineBatch {
+  public:
+    ~LineBatch() { release(); }
+
+    // `count` x,y pairs in [-1,1]x[-1,1] range, color is 0xAABBGGRR
+    void add_line_strip(const GLfloat* xys, int count, uint32_t color);
+
+    // Draws all lines and starts a new batch.
+    // `shader` has the attributes vertex (x,y) and color.
+    void draw(const ShaderProgram* shader);
+
+    void clear() { vertices.clear(); }
+    // Deletes the vertex buffer, call this with a current context
+    void release();
+
+  private:
+    struct Vertex {
+        GLfloat x, y;
+        uint32_t color; // Read by GL as R,G,B,A bytes
+    };
+    std::vector<Vertex> vertices;
+    GLuint vbo = 0;
+};
+
 void cleanupShaders();
 
+// Wall clock time in microseconds, for the benchmarks
+long long time_us();
+
 int dump_frame(int width, int height, const char* filename);
 
 int dump_buffer_to_console(int width, int height);
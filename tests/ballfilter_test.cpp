@@ -0,0 +1,139 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+
+//
+// Checks the ball filter and how the analysis handles short dropouts of
+// the ball, with synthetic ball buffers. Run by ctest, the exit code is
+// 0 when all checks pass.
+//
+#include "../src/tracker/analysis.h"
+#include "../src/tracker/ballfilter.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAIL %s\n", what);
+        ++failures;
+    }
+}
+
+// Constant velocity: the filter follows it, and coasts through a short dropout
+void test_filter_coasting() {
+    BallFilter filter;
+    filter.configure(40.0f, 160);
+    for (int i = 0; i < 20; ++i) {
+        filter.predict();
+        filter.update({0.2f + 0.01f * i, 0.5f});
+    }
+    check(filter.has_velocity(), "filter has a velocity after 20 measurements");
+    check(std::fabs(filter.velocity().x - 0.01f) < 1e-3f, "filtered velocity is the ball velocity");
+
+    int coast = filter.max_coast_frames();
+    for (int i = 1; i <= coast; ++i) {
+        filter.predict();
+        check(filter.tracking(), "filter tracks during a short dropout");
+        check(std::fabs(filter.position().x - (0.39f + 0.01f * i)) < 2e-3f, "filter extrapolates the ball");
+    }
+    filter.predict();
+    check(!filter.tracking(), "filter stops tracking after max_coast_frames");
+    check(filter.frames_missing() == coast + 1, "frames_missing counts the dropout");
+
+    // A measurement far from the prediction restarts the filter
+    filter.update({0.9f, 0.1f});
+    check(!filter.has_velocity(), "a restart after a long dropout has no velocity");
+}
+
+// Feeds ball buffers of 160x90 macropixels to an Analysis with the
+// default field, and collects the messages that it sends
+class DropoutScene {
+  public:
+    DropoutScene() : buffer(width * height) {
+        analysis.set_event_sink(collect, this);
+        analysis.set_fps(40.0f);
+    }
+
+    // Ball at field coordinates x,y, or no ball
+    void frame(float x, float y, bool visible) {
+        std::fill(buffer.begin(), buffer.end(), 0);
+        if (visible) {
+            // The default field covers [-0.9,0.9] of the screen
+            float px = (0.05f + 0.9f * x) * width;
+            float py = (0.05f + 0.9f * y) * height;
+            for (int j = 0; j < height; ++j) {
+                for (int i = 0; i < width; ++i) {
+                    float dx = i + 0.5f - px;
+                    float dy = j + 0.5f - py;
+                    if (dx * dx + dy * dy < 4.0f)
+                        buffer[j * width + i] = 200;
+                }
+            }
+        }
+        analysis.process_ball_buffer(buffer.data(), width, height);
+    }
+
+    bool has_goal() const {
+        for (const auto& msg : messages)
+            if (msg.compare(0, 3, "RG ") == 0 || msg.compare(0, 3, "BG ") == 0)
+                return true;
+        return false;
+    }
+
+  private:
+    static void collect(void* context, const EventHeader& header, const void* payload) {
+        if (header.type == EVENT_MESSAGE)
+            ((DropoutScene*)context)->messages.emplace_back((const char*)payload, header.size);
+    }
+
+    static constexpr int width = 160;
+    static constexpr int height = 90;
+    Analysis analysis;
+    std::vector<uint8_t> buffer;
+    std::vector<std::string> messages;
+};
+
+// The ball rolls to the mouth of the goal and stops there, then it is
+// hidden for `dropout` frames and seen again, or not when `dropout` is 0
+bool goal_after_dropout(int dropout) {
+    DropoutScene scene;
+    float x = 0.5f;
+    for (int f = 0; f < 150; ++f)
+        scene.frame(x, 0.5f, true);
+    while (x > 0.05f) {
+        x -= 0.005f;
+        scene.frame(x, 0.5f, true);
+    }
+    for (int f = 0; f < 20; ++f)
+        scene.frame(x, 0.5f, true);
+    for (int f = 0; f < (dropout > 0 ? dropout : 40); ++f)
+        scene.frame(0.0f, 0.0f, false);
+    if (dropout > 0) {
+        for (int f = 0; f < 40; ++f)
+            scene.frame(x, 0.5f, true);
+    }
+    return scene.has_goal();
+}
+
+void test_dropout_goals() {
+    check(goal_after_dropout(0), "a ball that disappears in the goal is a goal");
+    // Just over the 15 frames of the goal check, but the first ones are interpolated
+    check(!goal_after_dropout(17), "a 17 frame dropout in front of the goal is not a goal");
+}
+
+int main() {
+    test_filter_coasting();
+    test_dropout_goals();
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("PASS ballfilter_test\n");
+    return 0;
+}
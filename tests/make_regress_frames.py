@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# Writes the synthetic footage that tests/analysis_regress.rec is recorded
+# from, as raw 640x480 RGBA frames (see framereader.h).
+#
+# A table that is not centered in the frame, so the field that the analysis
+# finds is not its default one, with a ball that
+#   - rolls around the center of the field,
+#   - is shot at the goal on the right and saved, so the analysis sends SAVE,
+#   - is shot across the field, so it sends FAST,
+#   - is shot into the goal on the left and disappears, so it sends RG.
+#
+# The recording has the ball and field buffers of the CPU pipeline for
+# 640x480 with a filterScale of 2, so 80x60 macropixels:
+#     make_regress_frames.py /tmp/regress.rgba
+#     trackreplay -q -c 640x480,2,4 -r tests/analysis_regress.rec -rgba 640x480 /tmp/regress.rgba
+# The expected events are in tests/analysis_regress.expected. After a change
+# that is meant to change them, update that file with
+#     trackregress -update tests/analysis_regress.rec tests/analysis_regress.expected
+#
+# Usage: make_regress_frames.py output.rgba
+#
+import math
+import sys
+
+WIDTH = 640
+HEIGHT = 480
+# The green field, in pixels from the top left, the rest is the gray table
+FIELD_LEFT = 90
+FIELD_RIGHT = 590
+FIELD_TOP = 40
+FIELD_BOTTOM = 420
+BALL_RADIUS = 7
+
+FIELD_COLOR = bytes((40, 120, 50, 255))
+TABLE_COLOR = bytes((200, 200, 200, 255))
+BALL_COLOR = bytes((250, 120, 20, 255))
+
+def background():
+    table_row = TABLE_COLOR * WIDTH
+    field_row = (TABLE_COLOR * FIELD_LEFT + FIELD_COLOR * (FIELD_RIGHT - FIELD_LEFT)
+                 + TABLE_COLOR * (WIDTH - FIELD_RIGHT))
+    rows = [field_row if FIELD_TOP <= y < FIELD_BOTTOM else table_row for y in range(HEIGHT)]
+    return bytearray(b"".join(rows))
+
+def frame(bg, x, y):
+    """Frame with the ball at x,y in [0,1] over the green field, or None for no ball"""
+    pixels = bytearray(bg)
+    if x is None:
+        return pixels
+    # The field coordinates go from the bottom up, like the buffers
+    px = FIELD_LEFT + x * (FIELD_RIGHT - FIELD_LEFT)
+    py = FIELD_BOTTOM - y * (FIELD_BOTTOM - FIELD_TOP)
+    for j in range(int(py) - BALL_RADIUS, int(py) + BALL_RADIUS + 1):
+        if not 0 <= j < HEIGHT:
+            continue
+        dy = j + 0.5 - py
+        if dy * dy >= BALL_RADIUS * BALL_RADIUS:
+            continue
+        dx = math.sqrt(BALL_RADIUS * BALL_RADIUS - dy * dy)
+        i0 = max(int(round(px - dx)), 0)
+        i1 = min(int(round(px + dx)), WIDTH)
+        if i0 < i1:
+            pixels[4 * (j * WIDTH + i0):4 * (j * WIDTH + i1)] = BALL_COLOR * (i1 - i0)
+    return pixels
+
+def positions():
+    # Rolling around the center
+    for f in range(120):
+        yield 0.5 + 0.1 * math.sin(f / 20.0), 0.5 + 0.1 * math.cos(f / 25.0)
+    # Shot at the goal on the right, saved and back
+    x = 0.5
+    while x < 0.9:
+        x += 0.1
+        yield x, 0.5
+    for f in range(30):
+        x -= 0.02
+        yield x, 0.5
+    # To the side of the field, and a fast shot across it
+    y = 0.5
+    while y < 0.9:
+        y += 0.02
+        yield x, y
+    while y > 0.2:
+        x += 0.15
+        y -= 0.35
+        yield x, y
+    for f in range(40):
+        yield x, y
+    # Shot into the goal on the left, and gone
+    while x > -0.1:
+        x -= 0.1
+        yield x, 0.5
+    for f in range(40):
+        yield None, None
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: make_regress_frames.py output.rgba")
+        return 1
+    bg = background()
+    with open(sys.argv[1], "wb") as out:
+        for x, y in positions():
+            out.write(frame(bg, x, y))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2018, Tom Bannink
+MIT License
+*/
+
+//
+// Checks that every SIMD version of cpu_pixelnet_ball gives exactly the
+// same output as the scalar version, on random colors and on all colors
+// that come straight from 8-bit texels. Run by ctest.
+//
+#include "../src/tracker/cpufilter.h"
+#include <cstdio>
+#include <random>
+#include <vector>
+
+int main() {
+    // Random colors, then a grid of 8-bit colors
+    constexpr int randomCount = 1 << 20;
+    std::vector<float> r, g, b;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int i = 0; i < randomCount; ++i) {
+        r.push_back(unit(rng));
+        g.push_back(unit(rng));
+        b.push_back(unit(rng));
+    }
+    for (int cr = 0; cr < 256; cr += 3) {
+        for (int cg = 0; cg < 256; cg += 3) {
+            for (int cb = 0; cb < 256; cb += 3) {
+                r.push_back(cr / 255.0f);
+                g.push_back(cg / 255.0f);
+                b.push_back(cb / 255.0f);
+            }
+        }
+    }
+    // Not a multiple of 16, so the scalar tail runs as well
+    r.push_back(0.5f);
+    g.push_back(0.25f);
+    b.push_back(0.125f);
+    int count = (int)r.size();
+
+    // With count = 1 the SIMD loops never run
+    std::vector<uint8_t> expected(count);
+    for (int i = 0; i < count; ++i)
+        cpu_pixelnet_ball(&r[i], &g[i], &b[i], &expected[i], 1);
+    int ballPixels = 0;
+    for (uint8_t v : expected)
+        ballPixels += (v != 0);
+
+    const struct {
+        PixelnetSimd simd;
+        const char* name;
+    } versions[] = {
+        {PIXELNET_SCALAR, "scalar"},
+        {PIXELNET_SSE2, "SSE2"},
+        {PIXELNET_AVX2, "AVX2"},
+        {PIXELNET_NEON, "NEON"},
+    };
+    int failures = 0;
+    std::vector<uint8_t> out(count);
+    for (const auto& version : versions) {
+        if (!cpu_pixelnet_select(version.simd)) {
+            printf("%s: not available\n", version.name);
+            continue;
+        }
+        cpu_pixelnet_ball(r.data(), g.data(), b.data(), out.data(), count);
+        int different = 0;
+        for (int i = 0; i < count; ++i) {
+            if (out[i] != expected[i]) {
+                if (different == 0)
+                    printf("FAIL %s pixel %d (%f, %f, %f): %d instead of %d\n", version.name, i,
+                           r[i], g[i], b[i], out[i], expected[i]);
+                ++different;
+            }
+        }
+        if (different) {
+            printf("FAIL %s: %d of %d pixels differ\n", version.name, different, count);
+            ++failures;
+        } else {
+            printf("%s: %d pixels the same, %d ball pixels\n", version.name, count, ballPixels);
+        }
+    }
+    if (ballPixels == 0 || ballPixels == count) {
+        printf("FAIL the colors do not test both outputs\n");
+        ++failures;
+    }
+    return (failures ? 1 : 0);
+}
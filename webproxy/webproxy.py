@@ -2,7 +2,10 @@
 
 from websocket_server import WebsocketServer
 
+import collections
+import json
 import os
+import struct
 import threading
 import time
 
@@ -55,15 +58,149 @@ def doReplay():
     replayprocess = subprocess.Popen(["./replay.sh"])
 
 
+# Everything that is sent to a client goes through its own ClientSender
+# thread, so a slow browser never delays the tracker events (the fifo thread)
+# or the other clients.
+#
+# Messages are sent in order, as soon as they come in.
+# Clients that sent "subscribe balls [interval_ms]" also get the live ball
+# positions of the last interval in one message:
+#     BALLS [[t_ms, x, y, confidence, state], ...]
+# When the client can not keep up, the oldest positions are dropped and the
+# interval is made longer.
+BALL_INTERVAL_MS = 50      # Default, 20 messages per second
+BALL_MIN_INTERVAL_MS = 10
+BALL_MAX_INTERVAL_MS = 1000
+BALL_BUFFER_SIZE = 256     # Positions kept per client, older ones are dropped
+MESSAGE_BUFFER_SIZE = 256  # Messages kept per client, older ones are dropped
+
+class ClientSender(threading.Thread):
+    def __init__(self, client):
+        threading.Thread.__init__(self, daemon=True)
+        self.client = client
+        self.messages = collections.deque(maxlen=MESSAGE_BUFFER_SIZE)
+        self.balls = collections.deque(maxlen=BALL_BUFFER_SIZE)
+        self.interval = None # What the client asked for, None when not subscribed
+        self.current = None  # Slower when the client is behind
+        self.event = threading.Event()
+        self.stopped = False
+
+    # Called from any thread, deque.append is thread-safe
+    def add_message(self, message):
+        self.messages.append(message)
+        self.event.set()
+
+    def add_ball(self, ball):
+        if self.interval is not None:
+            self.balls.append(ball)
+
+    def subscribe_balls(self, interval_ms):
+        self.current = interval_ms / 1000.0
+        self.interval = self.current
+        self.event.set()
+
+    def unsubscribe_balls(self):
+        self.interval = None
+        self.balls.clear()
+
+    def stop(self):
+        self.stopped = True
+        self.event.set()
+
+    def run(self):
+        nextBalls = time.monotonic()
+        while not self.stopped:
+            if self.interval is None:
+                self.event.wait()
+            else:
+                self.event.wait(max(0.0, nextBalls - time.monotonic()))
+            # Cleared before the deques are read, so nothing added after is missed
+            self.event.clear()
+            if self.stopped:
+                break
+            try:
+                while self.messages:
+                    server.send_message(self.client, self.messages.popleft())
+                if self.interval is not None and time.monotonic() >= nextBalls:
+                    self.send_balls()
+                    nextBalls = time.monotonic() + self.current
+            except Exception as e:
+                print("Client(%d) sender stopped: %s" % (self.client['id'], e))
+                break
+
+    def send_balls(self):
+        balls = []
+        while self.balls:
+            balls.append(self.balls.popleft())
+        if not balls:
+            return
+        start = time.monotonic()
+        server.send_message(self.client, "BALLS " + json.dumps(balls, separators=(',', ':')))
+        duration = time.monotonic() - start
+        if duration > self.current:
+            self.current = min(2 * self.current, BALL_MAX_INTERVAL_MS / 1000.0)
+        elif self.current > self.interval:
+            self.current = max(0.9 * self.current, self.interval)
+
+# By client id. A client that left stays in here as None, so that
+# no new sender is started for it (the ids are never reused).
+clientSenders = {}
+clientSendersLock = threading.Lock()
+
+# The server adds a client to server.clients before new_client is called,
+# so the fifo thread can see it first. Whoever comes first starts its sender.
+def client_sender(client):
+    with clientSendersLock:
+        if client['id'] in clientSenders:
+            return clientSenders[client['id']]
+        sender = ClientSender(client)
+        clientSenders[client['id']] = sender
+    sender.start()
+    return sender
+
+def remove_client_sender(client):
+    with clientSendersLock:
+        sender = clientSenders.get(client['id'])
+        clientSenders[client['id']] = None
+    if sender is not None:
+        sender.stop()
+
+# Never blocks, the sender threads do the sending
+def send_to_all(message):
+    for client in list(server.clients):
+        sender = client_sender(client)
+        if sender is not None:
+            sender.add_message(message)
+
+def subscribe_balls(client, interval_ms):
+    interval_ms = min(max(interval_ms, BALL_MIN_INTERVAL_MS), BALL_MAX_INTERVAL_MS)
+    sender = client_sender(client)
+    if sender is not None:
+        sender.subscribe_balls(interval_ms)
+        print("Client(%d) subscribed to balls every %d ms" % (client['id'], interval_ms))
+
+def unsubscribe_balls(client):
+    sender = client_sender(client)
+    if sender is not None:
+        sender.unsubscribe_balls()
+
+def publish_ball(ball):
+    with clientSendersLock:
+        senders = [sender for sender in clientSenders.values() if sender is not None]
+    for sender in senders:
+        sender.add_ball(ball)
+
+
 # Called for every client connecting (after handshake)
 def new_client(client, server):
     print("New client connected and was given id %d" % client['id'])
-    server.send_message_to_all("Hey all, a new client has joined us")
+    send_to_all("Hey all, a new client has joined us")
 
 
 # Called for every client disconnecting
 def client_left(client, server):
     print("Client(%d) disconnected" % client['id'])
+    remove_client_sender(client)
     stopTracking()
 
 
@@ -82,6 +219,15 @@ def message_received(client, server, message):
         heartbeatTimer = 0
         #startTracking()
         heartbeatLock.release()
+    elif (message.startswith("subscribe balls")):
+        args = message.split()
+        try:
+            interval = int(args[2]) if len(args) > 2 else BALL_INTERVAL_MS
+        except ValueError:
+            interval = BALL_INTERVAL_MS
+        subscribe_balls(client, interval)
+    elif (message == "unsubscribe balls"):
+        unsubscribe_balls(client)
     else:
         if len(message) > 200:
             message = message[:200]+'..'
@@ -95,6 +241,16 @@ server.set_fn_client_left(client_left)
 server.set_fn_message_received(message_received)
 
 
+# Framing of the event channel, see src/tracker/eventchannel.h
+EVENT_MAGIC = 0xFB
+EVENT_MESSAGE = 1
+EVENT_BALL = 2
+# magic, type, payload size, frame, timestamp (us)
+EVENT_HEADER = struct.Struct("<BBHIQ")
+# x, y, confidence, state (0 lost, 1 measured, 2 extrapolated)
+EVENT_BALL_DATA = struct.Struct("<fffB3x")
+
+
 class MyReadThread(threading.Thread):
     def run(self):
         print("Read thread started.")
@@ -104,19 +260,45 @@ class MyReadThread(threading.Thread):
         except:
             pass
         while True:
-            f = open(fifo_file, "r")
-            if not f:
+            try:
+                fd = os.open(fifo_file, os.O_RDONLY)
+            except OSError:
                 print("Error opening fifo file %s" % fifo_file)
                 time.sleep(5)
                 continue
             print("Fifo file opened.")
+            data = b""
             while True:
-                line = f.readline()
-                if not line:
+                # The tracker writes the events in batches,
+                # so read everything that is available at once
+                chunk = os.read(fd, 65536)
+                if not chunk:
                     break
-                line = line.strip()
+                data = self.handle_events(data + chunk)
+            os.close(fd)
+
+    # Returns the bytes of the last event when it is not complete yet
+    def handle_events(self, data):
+        pos = 0
+        while len(data) - pos >= EVENT_HEADER.size:
+            magic, eventtype, size, frame, timestamp = EVENT_HEADER.unpack_from(data, pos)
+            if magic != EVENT_MAGIC:
+                # Out of sync, look for the next event
+                pos += 1
+                continue
+            end = pos + EVENT_HEADER.size + size
+            if end > len(data):
+                break
+            if eventtype == EVENT_MESSAGE:
+                line = data[pos + EVENT_HEADER.size:end].decode("utf-8", errors="replace")
                 print("Message from fifo file: %s" % line)
-                server.send_message_to_all(line);
+                send_to_all(line)
+            elif eventtype == EVENT_BALL and size == EVENT_BALL_DATA.size:
+                x, y, confidence, state = EVENT_BALL_DATA.unpack_from(data, pos + EVENT_HEADER.size)
+                publish_ball([timestamp // 1000, round(x, 4), round(y, 4), round(confidence, 2), state])
+            pos = end
+        return data[pos:]
+
 
 mythread = MyReadThread()
 mythread.start()